@@ -0,0 +1,48 @@
+/*
+  Userspace interface of the cryptIC driver for what the Crypto API cannot express: /dev/cryptic takes
+  these ioctls. Shared by the driver and by the programs using it, see test/batch_bench and
+  test/merkle_bench
+*/
+#ifndef CRYPTIC_IOCTL_H
+#define CRYPTIC_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define CRYPTIC_IOC_DEVICE "/dev/cryptic"
+
+/* Message of a batch */
+struct cryptic_ioc_msg {
+  __u64 data;       /* address of the message */
+  __u32 len;        /* bytes of message */
+  __u32 reserved;   /* 0 */
+};
+
+/* Hash count independent messages with SHA-256, the digest of msgs[i] is written at digests + 32 * i.
+   Short messages travel to the device several per frame, see cryptic_sha256_batch */
+struct cryptic_ioc_batch {
+  __u64 msgs;       /* address of count struct cryptic_ioc_msg */
+  __u64 digests;    /* address of count * 32 bytes */
+  __u32 count;
+  __u32 flags;      /* 0 */
+};
+
+/* Root of the Merkle tree of the file fd from offset, built as fs-verity does without salt: leaves and blocks of
+   digests of leaf_size bytes, SHA-256 nodes. The leaves are hashed in parallel, see cryptic_merkle_update */
+struct cryptic_ioc_merkle {
+  __s32 fd;
+  __u32 leaf_size;  /* power of 2 from 1024 to 65536, 0 for the merkle_leaf parameter of the driver */
+  __u64 offset;
+  __u64 len;        /* bytes to hash, the file may end before; set to the bytes hashed */
+  __u64 root;       /* address of 32 bytes */
+};
+
+/* Limits of a single call */
+#define CRYPTIC_IOC_BATCH_MAX 4096
+#define CRYPTIC_IOC_BATCH_BYTES (1 << 20)
+
+#define CRYPTIC_IOC_MAGIC 0xC7
+#define CRYPTIC_IOC_SHA256_BATCH _IOW(CRYPTIC_IOC_MAGIC, 1, struct cryptic_ioc_batch)
+#define CRYPTIC_IOC_MERKLE_SHA256 _IOWR(CRYPTIC_IOC_MAGIC, 2, struct cryptic_ioc_merkle)
+
+#endif
@@ -1,189 +1,666 @@
 #include "crypticintf.h"
 
+#define CREATE_TRACE_POINTS
+#include "crypticintf_trace.h"
+
+/* Parameters */
+static unsigned int workers = 4;
+module_param(workers, uint, 0444);
+MODULE_PARM_DESC(workers, "Number of workers serving requests in parallel (1-" __stringify(CRYPTIC_MAX_WORKERS) ")");
+
+/* Cost model: the device is used only when it is expected to hash a request faster than the CPU.
+   The learnt values are published through the parameters, which can be overridden after turning
+   cost_learn off */
+static bool cost_learn = true;
+module_param(cost_learn, bool, 0644);
+MODULE_PARM_DESC(cost_learn, "Learn the cost model parameters at runtime");
+static unsigned long frame_ns = 2000000;
+module_param(frame_ns, ulong, 0644);
+MODULE_PARM_DESC(frame_ns, "Fixed cost of a device frame in ns");
+static unsigned long dev_byte_ps = 1000000;
+module_param(dev_byte_ps, ulong, 0644);
+MODULE_PARM_DESC(dev_byte_ps, "Cost of a byte hashed on the device in ps");
+static unsigned long sw_byte_ps = 5000;
+module_param(sw_byte_ps, ulong, 0644);
+MODULE_PARM_DESC(sw_byte_ps, "Cost of a byte hashed in software in ps");
+static unsigned int offload_min = 0;
+module_param(offload_min, uint, 0644);
+MODULE_PARM_DESC(offload_min, "If not 0, send operations of at least this many bytes to the device, ignoring the model");
+static unsigned int merkle_leaf = 4096;
+module_param(merkle_leaf, uint, 0444);
+MODULE_PARM_DESC(merkle_leaf, "Leaf size of merkle-sha256 in bytes, a power of 2 from 1024 to 65536");
+
+static struct cryptic_cost cost = {
+  .lock = __SPIN_LOCK_UNLOCKED(cost.lock),
+  .explore = ATOMIC_INIT(0)
+};
+
+/**
+ * cryptic_cost_frame: account a frame of len bytes answered by the device after ns nanoseconds.
+ * frame_ns and dev_byte_ps are the intercept and slope of a least squares fit over the recent
+ * frames, computed from exponentially decaying sums. May run in atomic context.
+ **/
+static void cryptic_cost_frame(unsigned int len, u64 ns){
+  s64 var, cov, slope, intercept;
+  unsigned long irqflags;
+
+  if (!READ_ONCE(cost_learn))
+    return;
+  spin_lock_irqsave(&cost.lock, irqflags);
+  cost.n += 1 - (cost.n >> CRYPTIC_COST_DECAY);
+  cost.x += len - (cost.x >> CRYPTIC_COST_DECAY);
+  cost.y += ns - (cost.y >> CRYPTIC_COST_DECAY);
+  cost.xx += (u64) len * len - (cost.xx >> CRYPTIC_COST_DECAY);
+  cost.xy += (u64) len * ns - (cost.xy >> CRYPTIC_COST_DECAY);
+
+  /* The slope is only meaningful if frame lengths vary by at least a block */
+  var = cost.n * cost.xx - cost.x * cost.x;
+  if (var >= (s64) (cost.n * cost.n) * SHA256_BLOCK_SIZE * SHA256_BLOCK_SIZE){
+    cov = cost.n * cost.xy - cost.x * cost.y;
+    slope = max_t(s64, div64_s64(cov * 1000, var), 0);
+    WRITE_ONCE(dev_byte_ps, slope);
+  }
+  slope = READ_ONCE(dev_byte_ps);
+  intercept = div64_s64((s64) cost.y - div64_s64((s64) cost.x * slope, 1000), cost.n);
+  WRITE_ONCE(frame_ns, max_t(s64, intercept, 0));
+  spin_unlock_irqrestore(&cost.lock, irqflags);
+}
+
+/**
+ * cryptic_cost_software: account len bytes hashed by the fallback in ns nanoseconds
+ **/
+static void cryptic_cost_software(unsigned int len, u64 ns){
+  unsigned long ps;
+
+  /* Short runs are dominated by the call overhead */
+  if (!READ_ONCE(cost_learn) || len < CRYPTIC_MAX_MSG_LEN)
+    return;
+  ps = READ_ONCE(sw_byte_ps);
+  WRITE_ONCE(sw_byte_ps, ps - (ps >> CRYPTIC_COST_DECAY) + (div_u64(ns * 1000, len) >> CRYPTIC_COST_DECAY));
+}
+
+/**
+ * cryptic_worth_offloading: compare the expected time to hash len bytes on the device, sent in frames
+ * frames, and in software
+ **/
+static bool cryptic_worth_offloading(u64 len, u64 frames){
+  unsigned int min_len = READ_ONCE(offload_min);
+  u64 dev_ns, sw_ns;
+
+  if (min_len != 0)
+    return len >= min_len;
+  /* Keep sampling the device now and then, or the model could never change its mind */
+  if (READ_ONCE(cost_learn) && atomic_inc_return(&cost.explore) % CRYPTIC_COST_EXPLORE == 0)
+    return true;
+
+  /* Costs are capped at 1 ms per byte so that the products fit */
+  len = min_t(u64, len, U32_MAX);
+  frames = min_t(u64, frames, U32_MAX);
+  dev_ns = frames * READ_ONCE(frame_ns) + div_u64(len * min_t(u64, READ_ONCE(dev_byte_ps), NSEC_PER_SEC), 1000);
+  sw_ns = div_u64(len * min_t(u64, READ_ONCE(sw_byte_ps), NSEC_PER_SEC), 1000);
+  return dev_ns < sw_ns;
+}
+
+/* Request queue shared by all the cryptIC transformations */
+static struct cryptic_engine engine;
+
+/* Statistics and their debugfs file */
+static struct cryptic_stats stats;
+static struct dentry* stats_file;
+
+static int cryptic_stats_show(struct seq_file* s, void* unused){
+  seq_printf(s, "requests %lld\n", (long long) atomic64_read(&stats.requests));
+  seq_printf(s, "bytes %lld\n", (long long) atomic64_read(&stats.bytes));
+  seq_printf(s, "frames %lld\n", (long long) atomic64_read(&stats.frames));
+  seq_printf(s, "fallback %lld\n", (long long) atomic64_read(&stats.fallback));
+  seq_printf(s, "migrations %lld\n", (long long) atomic64_read(&stats.migrations));
+  seq_printf(s, "failovers %lld\n", (long long) atomic64_read(&stats.failovers));
+  seq_printf(s, "errors %lld\n", (long long) atomic64_read(&stats.errors));
+  seq_printf(s, "batched %lld\n", (long long) atomic64_read(&stats.batched));
+  seq_printf(s, "in_flight %d\n", atomic_read(&stats.in_flight));
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cryptic_stats);
+
+/**
+ * cryptic_engine_kick: wake up a worker, in turn so that requests spread over all of them
+ **/
+static void cryptic_engine_kick(void){
+  unsigned int i = (unsigned int) atomic_inc_return(&engine.next) % engine.n_workers;
+
+  queue_work(engine.wq, &engine.work[i]);
+}
+
+/**
+ * cryptic_request_complete: invoke the completion callback of an asynchronous request
+ **/
+static void cryptic_request_complete(struct crypto_async_request* areq, int err){
+  local_bh_disable();
+#ifdef CRYPTO_REQUEST_COMPLETE
+  crypto_request_complete(areq, err);
+#else
+  areq->complete(areq, err);
+#endif
+  local_bh_enable();
+}
+
 /**
  * cryptic_ctx_init: initialization function for a Crypto API context
  **/
-static int cryptic_cra_sha256_init(struct crypto_shash *tfm){
-  struct cryptic_sha256_ctx* ctx = crypto_shash_ctx(tfm);
+static int cryptic_cra_sha256_init(struct crypto_tfm *tfm){
+  struct cryptic_sha256_ctx* ctx = crypto_tfm_ctx(tfm);
+  unsigned int reqsize = sizeof(struct cryptic_desc_ctx);
 #ifndef FAKE_HARDWARE
-  struct crypto_shash* fallback_tfm = NULL;
-
-  /* Check device state */
-  if (!crypticusb_isConnected()){
-      /* Setup a software callback */
-      const char* fallback_alg_name = crypto_shash_alg_name(tfm);
-      pr_info("cryptIC: device not detected, registering fallback algorithm %s\n", fallback_alg_name);
-      /* Allocate a fallback */
-      fallback_tfm = crypto_alloc_shash(fallback_alg_name, 0, CRYPTO_ALG_NEED_FALLBACK);
-      if (IS_ERR(fallback_tfm)){
-          pr_err("cryptIC: cannot allocate a fallback algorithm\n");
-          return PTR_ERR(fallback_tfm);
-      }
+  const char* fallback_alg_name = crypto_tfm_alg_name(tfm);
+  struct crypto_shash* fallback_tfm;
 
-      ctx->fallback = fallback_tfm;
-      tfm->descsize += crypto_shash_descsize(fallback_tfm);
-    }
-    else {
-      pr_info("cryptIC: device detected, using it as accelerator\n");
-      ctx->fallback = NULL;
-    }
+  /* Every transformation carries a fallback: the device may come and go at any time */
+  fallback_tfm = crypto_alloc_shash(fallback_alg_name, 0, CRYPTO_ALG_NEED_FALLBACK);
+  if (IS_ERR(fallback_tfm)){
+      pr_err("cryptIC: cannot allocate a fallback algorithm\n");
+      return PTR_ERR(fallback_tfm);
+  }
+
+  /* The fallback state is exported in place of ours when it cannot be converted */
+  if (crypto_shash_statesize(fallback_tfm) > sizeof(struct cryptic_sha256_state)){
+      pr_err("cryptIC: the state of fallback %s does not fit the exported state\n",
+             crypto_shash_driver_name(fallback_tfm));
+      crypto_free_shash(fallback_tfm);
+      return -EINVAL;
+  }
+
+  ctx->fallback = fallback_tfm;
+  reqsize += crypto_shash_descsize(fallback_tfm);
+  /* Requests move between the device and the fallback through the partial state */
+  ctx->migrate = crypto_shash_statesize(fallback_tfm) == sizeof(struct sha256_state);
+  ctx->software = !ctx->migrate && !crypticusb_isConnected();
+  if (!ctx->migrate)
+    pr_info("cryptIC: fallback %s cannot take over from the device, using %s\n",
+            crypto_shash_driver_name(fallback_tfm), ctx->software ? "software" : "the device");
 #else
   pr_info("cryptIC: running debug version. Hardware is emulated in software and fallback is disabled. "
           "Recompile without FAKE_HARDWARE flag for the real driver\n");
   ctx->fallback = NULL;
+  ctx->migrate = false;
+  ctx->software = false;
 #endif
-  
-  /* Initialize spinlock to protect access to the context */
-  spin_lock_init(&ctx->lock);
-  ctx->cryptic_data = kmalloc(sizeof (struct cryptpb), GFP_KERNEL);
-
-  if (ctx->cryptic_data == NULL)
-    return -ENOMEM;
+  ctx->merkle = false;
+  crypto_ahash_set_reqsize(__crypto_ahash_cast(tfm), reqsize);
   return 0;
 }
 
-static void cryptic_cra_sha256_exit(struct crypto_shash* tfm){
-  struct cryptic_sha256_ctx* ctx = crypto_shash_ctx(tfm);
+static void cryptic_cra_sha256_exit(struct crypto_tfm* tfm){
+  struct cryptic_sha256_ctx* ctx = crypto_tfm_ctx(tfm);
+
+  if (ctx->fallback != NULL)
+    crypto_free_shash(ctx->fallback);
+  ctx->fallback = NULL;
+}
+
+/**
+ * cryptic_frame_done: completion callback of a frame sent to the device. The request goes back
+ * to the worker, which sends its next frame or completes it. May run in atomic context.
+ **/
+static void cryptic_frame_done(void* context, int status){
+  struct ahash_request* req = context;
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+  s64 ns = ktime_to_ns(ktime_sub(ktime_get(), ctx->frame_sent));
   unsigned long irqflags;
 
-  spin_lock_irqsave(&ctx->lock, irqflags);
-  if (ctx->cryptic_data != NULL)
-    kfree(ctx->cryptic_data);
+  trace_cryptic_complete(req, ctx->frame_len, status, ns);
+#ifdef FAKE_HARDWARE
+  kmem_cache_free(engine.frames, ctx->emu.frame);
+#endif
+  if (status == 0)
+    cryptic_cost_frame(ctx->frame_len, ns);
+  else
+    ctx->chain = 0;
+  ctx->status = status;
 
-  ctx->cryptic_data = NULL;
+  spin_lock_irqsave(&engine.lock, irqflags);
+  list_add_tail(&req->base.list, &engine.ready);
+  spin_unlock_irqrestore(&engine.lock, irqflags);
 
-  if (ctx->fallback != NULL)
-    crypto_free_shash(ctx->fallback);
+  cryptic_engine_kick();
+}
+
+/**
+ * cryptic_get_frame: get the buffer where the next frame is built. Frames for the device are built
+ * in place in a DMA buffer lent by the transport, so that data is copied only once on its way to the
+ * wire. Frames for the emulated device come from a slab cache.
+ * max_len is set to the largest message a HASH frame can carry, a multiple of the block size, and size
+ * to the size of the buffer, header included. chain keeps the frames of a message on the device holding
+ * its state, 0 for a new message.
+ **/
+static struct cryptpb* cryptic_get_frame(struct crypticusb_wbuf** handle, unsigned int* max_len, size_t* size,
+                                         u64 chain){
+#ifdef FAKE_HARDWARE
+  struct cryptpb* frame = kmem_cache_alloc(engine.frames, GFP_KERNEL);
 
-  spin_unlock_irqrestore(&ctx->lock, irqflags);
+  if (frame == NULL)
+    return ERR_PTR(-ENOMEM);
+  *handle = NULL;
+  *max_len = CRYPTIC_MAX_MSG_LEN;
+  *size = sizeof(struct crypticusb_hdr) + CRYPTICUSB_MAX_PAYLOAD;
+  return frame;
+#else
+  struct cryptpb* frame;
+
+  frame = crypticusb_get_frame(handle, size, chain);
+  if (IS_ERR(frame)){
+    pr_err_ratelimited("cryptIC: cannot get a USB frame, error %ld\n", PTR_ERR(frame));
+    return frame;
+  }
+  /* The transport guarantees at least CRYPTICUSB_MIN_PAYLOAD bytes, more than CRYPTIC_BUF_LEN */
+  *max_len = min_t(size_t, CRYPTIC_MAX_MSG_LEN, round_down(*size - sizeof(struct cryptpb), SHA256_BLOCK_SIZE));
+  return frame;
+#endif
 }
 
-static ssize_t cryptic_submit_request(struct cryptic_desc_ctx* desc, struct cryptpb* cryptdata){
-    ssize_t status = 0;
+/**
+ * cryptic_submit_request: hash a frame. Returns -EINPROGRESS if the frame is in flight towards the
+ * device, real or emulated, in which case the result will be written to out before cryptic_frame_done
+ * is called. Otherwise the frame could not be sent.
+ **/
+static int cryptic_submit_request(struct ahash_request* req, struct cryptpb* cryptdata,
+                                  struct crypticusb_wbuf* handle, u8* out){
+    struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+    int status = 0;
+
+    trace_cryptic_submit(req, cryptdata->len, ctx->count);
 #ifdef FAKE_HARDWARE
-    runArduino((u8*) cryptdata, cryptdata->digest);
+    /* The emulated device hashes the frames of several requests together, each one is freed once answered */
+    ctx->frame_len = cryptdata->len;
+    ctx->frame_sent = ktime_get();
+    status = cryptic_emu_submit(&ctx->emu, (u8*) cryptdata, out, cryptic_frame_done, req);
+    if (status == 0){
+        atomic64_inc(&stats.frames);
+        return -EINPROGRESS;
+    }
+    kmem_cache_free(engine.frames, cryptdata);
 #else
-    if (desc->use_fallback) {
-        /* Device was unavailable at context creation time, resort to the software fallback */
-        crypto_shash_update(&(desc->fallback), cryptdata->message, cryptdata->len);
-    } else {
-        /* Try to communicate with device */
-        status = crypticusb_send((char *) cryptdata, offsetof(struct cryptpb,digest));
-        if (status >= 0) {
-            pr_info("cryptIC: sent %ld bytes over usb\n", status);
-            /* Read response */
-            status = crypticusb_read(cryptdata->digest, SHA256_DIGEST_SIZE);
-            if (status >= 0)
-                pr_info("cryptIC: read %ld bytes from usb\n", status);
-            else
-                pr_err("cryptIC: USB reading failed with error %ld\n", status);
-        } else {
-            pr_err("cryptIC: USB sending failed with error %ld. Using fallback\n", status);
-            crypto_shash_update(&(desc->fallback), cryptdata->message, cryptdata->len);
-        }
+    /* Try to communicate with device, the response is collected by the transport */
+    cryptdata->hdr.opcode = CRYPTICUSB_OP_HASH;
+    ctx->frame_len = cryptdata->len;
+    ctx->frame_sent = ktime_get();
+    status = crypticusb_submit_frame(handle, sizeof(struct cryptpb) + cryptdata->len, out, SHA256_DIGEST_SIZE,
+                                     cryptic_frame_done, req, &ctx->chain);
+    if (status == 0){
+        atomic64_inc(&stats.frames);
+        return -EINPROGRESS;
     }
-#endif    
+
+    crypticusb_put_frame(handle);
+#endif
   return status;
 }
 
-static int cryptic_sha_update(struct shash_desc* desc, const u8* data, unsigned int len){
-  struct cryptic_desc_ctx* ctx = shash_desc_ctx(desc);
-  struct cryptic_sha256_ctx* crctx = crypto_tfm_ctx(&(desc->tfm->base));
-  struct cryptpb* cryptdata = (struct cryptpb*) crctx->cryptic_data;
-  const unsigned sha_buf_len = (unsigned) CRYPTIC_BUF_LEN;
-  unsigned int total;
-  unsigned long irqflags;
+/**
+ * cryptic_pad: append the SHA-256 padding and the message length in bits, as a 64-bit big endian
+ * number, to the len bytes of message in buf. Returns the padded length, a multiple of the block size.
+ **/
+static unsigned int cryptic_pad(u8* buf, unsigned int len, u64 count){
+  unsigned int padded = round_up(len + 1 + sizeof(__be64), SHA256_BLOCK_SIZE);
+  __be64 bits = cpu_to_be64(count << 3);
 
-  spin_lock_irqsave(&crctx->lock, irqflags);
-
-  total = ctx->buflen + len;
-  if (total <= sha_buf_len){
-    /*
-      In this case the total message length is still lower than the minimum block size,
-      append the new data to the buffer
-    */
-    memcpy(ctx->buf + ctx->buflen, data, len);
-    ctx->count += len;
-    ctx->buflen += len;
-    spin_unlock_irqrestore(&crctx->lock, irqflags);
-    return 0;
-  }
-  /*
-    In this case the total length is larger than the block size, we will process
-    N blocks and leave the leftover in the buffer.
-  */
-  /* Copy what was already present in the buffer */
-  if (ctx->buflen > 0){
-    memcpy(cryptdata->message, ctx->buf, ctx->buflen);
-    total -= ctx->buflen;
+  buf[len] = 0x80;
+  memset(buf + len + 1, 0, padded - len - 1 - sizeof(bits));
+  memcpy(buf + padded - sizeof(bits), &bits, sizeof(bits));
+  return padded;
+}
+
+/**
+ * cryptic_fallback_process: serve a request with the software fallback, from where the device left
+ * it if the request was moved over. Data buffered by the synchronous update goes first.
+ **/
+static int cryptic_fallback_process(struct ahash_request* req){
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+  struct sg_mapping_iter miter;
+  unsigned int nbytes, len, total;
+  ktime_t start = ktime_get();
+  int status;
+  s64 ns;
+
+  atomic64_inc(&stats.fallback);
+  nbytes = (ctx->op == CRYPTIC_OP_FINAL) ? 0 : req->nbytes - ctx->offset;
+  total = ctx->buflen + nbytes;
+  ctx->count += nbytes;
+  status = crypto_shash_update(&(ctx->fallback), ctx->buf, ctx->buflen);
+  ctx->buflen = 0;
+
+  sg_miter_start(&miter, req->src, sg_nents(req->src), SG_MITER_FROM_SG);
+  if (ctx->offset > 0 && !sg_miter_skip(&miter, ctx->offset))
+    nbytes = 0;
+  while (status == 0 && nbytes > 0 && sg_miter_next(&miter)){
+    len = min_t(size_t, miter.length, nbytes);
+    status = crypto_shash_update(&(ctx->fallback), miter.addr, len);
+    nbytes -= len;
+    ctx->offset += len;
   }
+  sg_miter_stop(&miter);
+
+  if (status == 0 && ctx->op != CRYPTIC_OP_UPDATE)
+    status = crypto_shash_final(&(ctx->fallback), req->result);
+  ctx->op = CRYPTIC_OP_DONE;
+  ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+  trace_cryptic_fallback(req, total, ns);
+  if (status == 0)
+    cryptic_cost_software(total, ns);
+  return status;
+}
+
+/**
+ * cryptic_to_software: move a request from the device to the fallback. The device only ever saw
+ * whole blocks, so its partial digest and the number of bytes hashed make up a fallback state
+ * with an empty block buffer. The tail buffered in the request is then handed to the fallback.
+ **/
+static int cryptic_to_software(struct ahash_request* req){
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+  struct sha256_state sw;
+  int status;
+
+  memset(&sw, 0, sizeof(sw));
+  memcpy(sw.state, ctx->state, sizeof(sw.state));
+  sw.count = ctx->count - ctx->buflen;
+  status = crypto_shash_import(&(ctx->fallback), &sw);
+  if (status == 0)
+    status = crypto_shash_update(&(ctx->fallback), ctx->buf, ctx->buflen);
+  if (status < 0)
+    return status;
+  ctx->buflen = 0;
+  ctx->use_fallback = 1;
+  ctx->chain = 0;
+  atomic64_inc(&stats.migrations);
+  return 0;
+}
+
+/**
+ * cryptic_to_hardware: move a request from the fallback to the device. The fallback exports its
+ * partial digest at the last block boundary, the bytes past it become the request buffered tail.
+ **/
+static int cryptic_to_hardware(struct ahash_request* req){
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+  struct sha256_state sw;
+  int status;
+
+  /* Flush the buffered tail first, so that what remains past the boundary is less than a block */
+  status = crypto_shash_update(&(ctx->fallback), ctx->buf, ctx->buflen);
+  if (status == 0)
+    status = crypto_shash_export(&(ctx->fallback), &sw);
+  if (status < 0)
+    return status;
+  memcpy(ctx->state, sw.state, sizeof(ctx->state));
+  ctx->count = sw.count;
+  ctx->buflen = sw.count % SHA256_BLOCK_SIZE;
+  memcpy(ctx->buf, sw.buf, ctx->buflen);
+  ctx->use_fallback = 0;
+  ctx->chain = 0;
+  atomic64_inc(&stats.migrations);
+  return 0;
+}
+
+/**
+ * cryptic_select: choose between the device and the fallback for a new operation, following the
+ * arrival and removal of devices and the cost model. Requests move between operations, at a
+ * block boundary.
+ **/
+static int cryptic_select(struct ahash_request* req){
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+  struct cryptic_sha256_ctx* crctx = crypto_tfm_ctx(req->base.tfm);
+  u64 len;
+  bool offload;
+
+  if (!crctx->migrate)
+    return 0;
+  /* Data the operation is about to hash */
+  len = ctx->buflen + ((ctx->op == CRYPTIC_OP_FINAL) ? 0 : req->nbytes);
+  offload = crypticusb_isConnected() &&
+            cryptic_worth_offloading(len, DIV_ROUND_UP_ULL(len + 1 + sizeof(__be64), CRYPTIC_MAX_MSG_LEN));
+  if (ctx->use_fallback && offload)
+    return cryptic_to_hardware(req);
+  if (!ctx->use_fallback && !offload)
+    return cryptic_to_software(req);
+  return 0;
+}
+
+/**
+ * cryptic_rewind: undo the bookkeeping of the last frame, which did not make it through the device.
+ * Its data is still in the request: the buffered tail is left untouched until the next frame.
+ **/
+static void cryptic_rewind(struct cryptic_desc_ctx* ctx){
+  ctx->offset -= ctx->frame_chunk;
+  ctx->count -= ctx->frame_chunk;
+  ctx->buflen = ctx->frame_buflen;
+  ctx->op = ctx->frame_op;
+  ctx->chain = 0;
+}
+
+/**
+ * cryptic_fail_over: the device failed a request, go on in software if the fallback can take over
+ **/
+static int cryptic_fail_over(struct ahash_request* req, int err){
+  struct cryptic_sha256_ctx* crctx = crypto_tfm_ctx(req->base.tfm);
+  int status;
+
+  trace_cryptic_error(req, err, crctx->migrate);
+  if (!crctx->migrate)
+    return err;
+  pr_warn_ratelimited("cryptIC: device failed with error %d, going on in software\n", err);
+  atomic64_inc(&stats.failovers);
+  status = cryptic_to_software(req);
+  if (status < 0)
+    return status;
+  return cryptic_fallback_process(req);
+}
+
+/**
+ * cryptic_process: advance a request by sending frames to the device. Runs in a worker.
+ * Returns -EINPROGRESS while a frame of the request is in flight, otherwise the final status.
+ * Each frame carries as many whole blocks as the device accepts. Only the sub-block tail of the
+ * data is kept in the request context, everything else is copied straight from the source
+ * scatterlist into the frame. When the rest of the message fits in one frame along with the
+ * padding, it is sent as the last frame, so a short digest costs a single round trip.
+ **/
+static int cryptic_process(struct ahash_request* req){
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+  struct crypticusb_wbuf* handle;
+  struct cryptpb* cryptdata;
+  const unsigned sha_buf_len = (unsigned) CRYPTIC_BUF_LEN;
+  unsigned int remaining, chunk, len, max_len, i;
+  __be32 digest[SHA256_DIGEST_SIZE / 4];
+  size_t size;
+  int status;
+
+  if (ctx->use_fallback)
+    return cryptic_fallback_process(req);
+
+  for (;;) {
+    /* The last frame failed */
+    if (ctx->status < 0){
+      status = ctx->status;
+      ctx->status = 0;
+      cryptic_rewind(ctx);
+      /* The device lost the state a chained frame resumed from, send the frame again with the state */
+      if (status == -ESTALE)
+        continue;
+      return cryptic_fail_over(req, status);
+    }
+    if (ctx->op == CRYPTIC_OP_DONE){
+      /* The padding has gone through the device, the state is the digest in host order. The device
+         slot holding it can take another message */
+      crypticusb_release_chain(ctx->chain);
+      ctx->chain = 0;
+      for (i = 0; i < SHA256_DIGEST_SIZE / 4; i++)
+        digest[i] = cpu_to_be32(ctx->state[i]);
+      memcpy(req->result, digest, SHA256_DIGEST_SIZE);
+      return 0;
+    }
 
-  while (total > sha_buf_len) {
+    remaining = (ctx->op == CRYPTIC_OP_FINAL) ? 0 : req->nbytes - ctx->offset;
+    if (ctx->op == CRYPTIC_OP_UPDATE && ctx->buflen + remaining <= sha_buf_len){
+      /* Now copy the leftover into the buffer */
+      sg_pcopy_to_buffer(req->src, sg_nents(req->src), ctx->buf + ctx->buflen, remaining, ctx->offset);
+      ctx->offset += remaining;
+      ctx->count += remaining;
+      ctx->buflen += remaining;
+      return 0;
+    }
+
+    cryptdata = cryptic_get_frame(&handle, &max_len, &size, ctx->chain);
+    if (IS_ERR(cryptdata))
+      return cryptic_fail_over(req, PTR_ERR(cryptdata));
     memcpy(cryptdata->in_partial_digest, ctx->state, SHA256_DIGEST_SIZE);
-    if (ctx->buflen > 0) {
-      /* Copy data but don't overwrite the already existing data written before if buflen was > 0 */
-      memcpy(cryptdata->message + ctx->buflen, data, sha_buf_len - ctx->buflen);
-      ctx->buflen = 0;
+    memcpy(cryptdata->message, ctx->buf, ctx->buflen);
+
+    ctx->frame_op = ctx->op;
+    if (ctx->op != CRYPTIC_OP_UPDATE && round_up(ctx->buflen + remaining + 1 + sizeof(__be64), SHA256_BLOCK_SIZE) <= max_len){
+      /* The rest of the message fits in this frame along with the padding: this is the last one */
+      chunk = remaining;
+      ctx->op = CRYPTIC_OP_DONE;
     } else {
-      memcpy(cryptdata->message, data, sha_buf_len);
+      /*
+        Send a frame made of the buffered leftover followed by as many whole blocks of new data
+        as fit, and go on with the rest.
+      */
+      len = min(max_len, round_down(ctx->buflen + remaining, SHA256_BLOCK_SIZE));
+      chunk = len - ctx->buflen;
     }
-    cryptdata->len = (int) sha_buf_len;
-	cryptdata->finalize = 0;
-	cryptic_submit_request(ctx, cryptdata);
-    memcpy(ctx->state, cryptdata->digest, SHA256_DIGEST_SIZE);
+    sg_pcopy_to_buffer(req->src, sg_nents(req->src), cryptdata->message + ctx->buflen, chunk, ctx->offset);
+    ctx->frame_buflen = ctx->buflen;
+    ctx->frame_chunk = chunk;
+    ctx->offset += chunk;
+    ctx->count += chunk;
+    len = ctx->buflen + chunk;
+    ctx->buflen = 0;
 
-    /* Advance pointer */
-    data += cryptdata->len;
-    total -= sha_buf_len;
+    if (ctx->op == CRYPTIC_OP_DONE)
+      len = cryptic_pad(cryptdata->message, len, ctx->count);
+    cryptdata->len = len;
+    /* SEND REQUEST THROUGH USB */
+    status = cryptic_submit_request(req, cryptdata, handle, (u8*) ctx->state);
+    if (status == -EINPROGRESS)
+      return status;
+    if (status < 0){
+      cryptic_rewind(ctx);
+      return cryptic_fail_over(req, status);
+    }
   }
+}
 
-  if (total > 0) {
-    /* Now copy the leftover into the buffer */
-    memcpy(cryptdata->in_partial_digest, ctx->state, SHA256_DIGEST_SIZE);
-    memcpy(ctx->buf, data, total);
-    ctx->buflen = total;
+/**
+ * cryptic_engine_work: worker draining the request queue. Requests whose frame completed are
+ * resumed first, then new requests are started. Submitting a frame blocks while the transport
+ * has no free slot, which bounds the number of requests in flight. Several workers may run this
+ * concurrently, each request is only ever on one of them since it is taken off the queue.
+ **/
+static void cryptic_engine_work(struct work_struct* work){
+  struct crypto_async_request* async_req;
+  struct crypto_async_request* backlog;
+  struct cryptic_sha256_ctx* crctx;
+  struct ahash_request* req;
+  unsigned long irqflags;
+  bool resumed;
+  int status;
+
+  for (;;) {
+    spin_lock_irqsave(&engine.lock, irqflags);
+    backlog = NULL;
+    async_req = list_first_entry_or_null(&engine.ready, struct crypto_async_request, list);
+    resumed = async_req != NULL;
+    if (resumed){
+      list_del(&async_req->list);
+    } else {
+      backlog = crypto_get_backlog(&engine.queue);
+      async_req = crypto_dequeue_request(&engine.queue);
+    }
+    spin_unlock_irqrestore(&engine.lock, irqflags);
+
+    if (async_req == NULL)
+      return;
+
+    /* A backlogged request made it into the queue, let its owner know */
+    if (backlog != NULL)
+      cryptic_request_complete(backlog, -EINPROGRESS);
+
+    req = ahash_request_cast(async_req);
+    crctx = crypto_tfm_ctx(req->base.tfm);
+    if (crctx->merkle){
+      /* Completed by cryptic_merkle_work */
+      queue_work(engine.merkle_wq, &((struct cryptic_merkle_req*) ahash_request_ctx(req))->work);
+      status = -EINPROGRESS;
+    } else {
+      /* New operations may move to or from the device */
+      status = resumed ? 0 : cryptic_select(req);
+      if (status == 0)
+        status = cryptic_process(req);
+    }
+    if (status != -EINPROGRESS){
+      if (status < 0)
+        atomic64_inc(&stats.errors);
+      atomic_dec(&stats.in_flight);
+      cryptic_request_complete(async_req, status);
+    }
+    cond_resched();
   }
-  ctx->count += len;
-  spin_unlock_irqrestore(&crctx->lock, irqflags);
-  return 0;
 }
 
-
-static int cryptic_sha_final(struct shash_desc* desc, u8* out){
-  struct cryptic_desc_ctx* ctx = shash_desc_ctx(desc);
-  struct cryptic_sha256_ctx* crctx = crypto_tfm_ctx(&(desc->tfm->base));
-  struct cryptpb* cryptdata = (struct cryptpb*) crctx->cryptic_data;
+/**
+ * cryptic_queue: queue a request for the workers. Returns -EINPROGRESS, or -EBUSY if the
+ * request was backlogged
+ **/
+static int cryptic_queue(struct ahash_request* req, unsigned int op){
   unsigned long irqflags;
-  ssize_t status = 0;
+  int ret;
 
-  spin_lock_irqsave(&crctx->lock, irqflags);
-  
-  memcpy(cryptdata->in_partial_digest, ctx->state, SHA256_DIGEST_SIZE);
+  atomic64_inc(&stats.requests);
+  if (op != CRYPTIC_OP_FINAL)
+    atomic64_add(req->nbytes, &stats.bytes);
+  atomic_inc(&stats.in_flight);
+  spin_lock_irqsave(&engine.lock, irqflags);
+  ret = crypto_enqueue_request(&engine.queue, &req->base);
+  spin_unlock_irqrestore(&engine.lock, irqflags);
+  if (ret == -ENOSPC)
+    atomic_dec(&stats.in_flight);
 
-  /* Now copy buffer and finalize */
-  if (ctx->buflen){
-    memcpy(cryptdata->message, ctx->buf, ctx->buflen);
-    cryptdata->len = ctx->buflen;
-    cryptdata->bitlen = ctx->count*8;
-    cryptdata->finalize = 1;
-    /* SEND REQUEST THROUGH USB */
-    status = cryptic_submit_request(ctx, cryptdata);
+  cryptic_engine_kick();
+  return ret;
+}
+
+static int cryptic_enqueue(struct ahash_request* req, unsigned int op){
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+
+  ctx->op = op;
+  ctx->offset = 0;
+  ctx->status = 0;
+  return cryptic_queue(req, op);
+}
+
+static int cryptic_sha_update(struct ahash_request* req){
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+
+  if (ctx->buflen + req->nbytes <= CRYPTIC_BUF_LEN){
+    /* Data fits in the buffer, no need to reach the device: complete synchronously */
+    sg_copy_to_buffer(req->src, sg_nents(req->src), ctx->buf + ctx->buflen, req->nbytes);
+    ctx->count += req->nbytes;
+    ctx->buflen += req->nbytes;
+    atomic64_inc(&stats.requests);
+    atomic64_add(req->nbytes, &stats.bytes);
+    return 0;
   }
+  return cryptic_enqueue(req, CRYPTIC_OP_UPDATE);
+}
 
-  /* Compute result using fallback if applicable*/
-  if (ctx->use_fallback)
-    crypto_shash_final(&(ctx->fallback), cryptdata->digest);
-  
-  /* Copy result out */
-  memcpy(out, cryptdata->digest, SHA256_DIGEST_SIZE);
+static int cryptic_sha_final(struct ahash_request* req){
+  return cryptic_enqueue(req, CRYPTIC_OP_FINAL);
+}
 
-  spin_unlock_irqrestore(&crctx->lock, irqflags);
-  return (status>=0 ? 0 : -1);
+static int cryptic_sha_finup(struct ahash_request* req){
+  return cryptic_enqueue(req, CRYPTIC_OP_FINUP);
 }
 
-static int cryptic_sha_init(struct shash_desc* desc){
-  struct cryptic_desc_ctx* ctx = shash_desc_ctx(desc);
-  struct cryptic_sha256_ctx* crctx = crypto_tfm_ctx(&(desc->tfm->base));
+static int cryptic_sha_init(struct ahash_request* req){
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+  struct cryptic_sha256_ctx* crctx = crypto_tfm_ctx(req->base.tfm);
   memset(ctx, 0, sizeof(struct cryptic_desc_ctx));
 
   ctx->state[0] = 0x6a09e667;
@@ -202,16 +679,865 @@ static int cryptic_sha_init(struct shash_desc* desc){
   if (crctx->fallback != NULL){
     ctx->fallback.tfm = crctx->fallback;
     crypto_shash_init(&ctx->fallback);
+  }
+  ctx->use_fallback = crctx->migrate ? !crypticusb_isConnected() : crctx->software;
+  return 0;
+}
+
+/**
+ * cryptic_sha_export: export the partial digest, the byte count and the data not sent to the
+ * device yet, rather than the whole request context
+ **/
+static int cryptic_sha_export(struct ahash_request* req, void* out){
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+  struct cryptic_sha256_ctx* crctx = crypto_tfm_ctx(req->base.tfm);
+  struct cryptic_sha256_state* state = out;
+  int status;
+
+  if (ctx->use_fallback && crctx->migrate){
+    /* Convert the fallback state, the next operation picks the device or the fallback again */
+    status = cryptic_to_hardware(req);
+    if (status < 0)
+      return status;
+  } else if (ctx->use_fallback){
+    /* Hand the buffered data to the fallback, its state then covers the whole message */
+    status = crypto_shash_update(&(ctx->fallback), ctx->buf, ctx->buflen);
+    if (status < 0)
+      return status;
+    ctx->buflen = 0;
+    return crypto_shash_export(&(ctx->fallback), out);
+  }
+
+  memcpy(state->state, ctx->state, sizeof(state->state));
+  state->count = ctx->count;
+  state->buflen = ctx->buflen;
+  memcpy(state->buf, ctx->buf, ctx->buflen);
+  return 0;
+}
+
+/**
+ * cryptic_sha_import: resume a hash from a state exported by cryptic_sha_export
+ **/
+static int cryptic_sha_import(struct ahash_request* req, const void* in){
+  struct cryptic_desc_ctx* ctx = ahash_request_ctx(req);
+  struct cryptic_sha256_ctx* crctx = crypto_tfm_ctx(req->base.tfm);
+  const struct cryptic_sha256_state* state = in;
+
+  memset(ctx, 0, sizeof(struct cryptic_desc_ctx));
+  if (crctx->fallback != NULL)
+    ctx->fallback.tfm = crctx->fallback;
+  if (crctx->software){
     ctx->use_fallback = 1;
-  } else{
-    ctx->use_fallback = 0;
+    return crypto_shash_import(&(ctx->fallback), in);
   }
+
+  if (state->buflen > CRYPTIC_BUF_LEN)
+    return -EINVAL;
+  memcpy(ctx->state, state->state, sizeof(ctx->state));
+  ctx->count = state->count;
+  ctx->buflen = state->buflen;
+  memcpy(ctx->buf, state->buf, state->buflen);
   return 0;
 }
 
+static int cryptic_sha_digest(struct ahash_request* req){
+  cryptic_sha_init(req);
+  return cryptic_enqueue(req, CRYPTIC_OP_FINUP);
+}
+
+/* Software implementation for the messages of a batch the device does not take */
+static struct crypto_shash* batch_fallback;
+
+#ifdef FAKE_HARDWARE
+/* State the emulated device starts the messages of a BATCH frame from */
+static const u32 cryptic_sha256_iv[SHA256_DIGEST_SIZE / 4] = {
+  SHA256_H0, SHA256_H1, SHA256_H2, SHA256_H3, SHA256_H4, SHA256_H5, SHA256_H6, SHA256_H7
+};
+#endif
+
+/**
+ * cryptic_batch_software: hash messages of a batch in software
+ **/
+static int cryptic_batch_software(struct cryptic_batch_msg* msgs, unsigned int count){
+  SHASH_DESC_ON_STACK(desc, batch_fallback);
+  unsigned int i;
+  int status = 0;
+
+  desc->tfm = batch_fallback;
+  for (i = 0; i < count && status == 0; i++)
+    status = crypto_shash_digest(desc, msgs[i].data, msgs[i].len, msgs[i].digest);
+  atomic64_add(count, &stats.fallback);
+  return status;
+}
+
+/**
+ * cryptic_batch_frame_done: completion callback of a BATCH frame. May run in atomic context.
+ **/
+static void cryptic_batch_frame_done(void* context, int status){
+  struct cryptic_batch_frame* bf = context;
+  s64 ns = ktime_to_ns(ktime_sub(ktime_get(), bf->sent));
+
+  if (status == 0)
+    cryptic_cost_frame(bf->len, ns);
+  bf->status = status;
+  if (atomic_dec_and_test(&bf->batch->pending))
+    complete(&bf->batch->done);
+}
+
+#ifdef FAKE_HARDWARE
+/* The emulated device hashes the messages of a frame one by one, the frame is answered with the last one */
+static void cryptic_batch_emu_done(void* context, int status){
+  struct cryptic_batch_frame* bf = context;
+
+  if (atomic_dec_and_test(&bf->jobs)){
+    kmem_cache_free(engine.frames, bf->frame);
+    cryptic_batch_frame_done(bf, status);
+  }
+}
+#endif
+
+/**
+ * cryptic_batch_submit: pack as many of the count messages as fit into a BATCH frame, each one padded on
+ * its own, and send it. Returns the number of messages sent, 0 if the first one is too long for a frame,
+ * -EOPNOTSUPP if the device takes no BATCH frames, or another error.
+ **/
+static int cryptic_batch_submit(struct cryptic_batch* batch, struct cryptic_batch_msg* msgs, unsigned int count){
+  struct cryptic_batch_frame* bf;
+  struct crypticusb_wbuf* handle;
+  struct crypticusb_batch_msg* msg;
+  struct cryptbatch* frame;
+  unsigned int max_len, max_count, room, padded, n;
+  size_t size;
+  u8* pos;
+#ifdef FAKE_HARDWARE
+  unsigned int i;
+#else
+  int status;
+#endif
+
+  bf = kmalloc(sizeof(*bf), GFP_KERNEL);
+  if (bf == NULL)
+    return -ENOMEM;
+  frame = (struct cryptbatch*) cryptic_get_frame(&handle, &max_len, &size, 0);
+  if (IS_ERR(frame)){
+    kfree(bf);
+    return PTR_ERR(frame);
+  }
+#ifdef FAKE_HARDWARE
+  max_count = CRYPTICUSB_BATCH_MAX;
+#else
+  max_count = crypticusb_frame_batch(handle);
+#endif
+
+  /* Unlike HASH frames, BATCH frames fill the whole buffer */
+  room = size - sizeof(struct cryptbatch);
+  pos = frame->messages;
+  for (n = 0; n < count && n < max_count; n++){
+    if (msgs[n].len >= room)
+      break;
+    padded = round_up(msgs[n].len + 1 + sizeof(__be64), SHA256_BLOCK_SIZE);
+    if (sizeof(*msg) + padded > room)
+      break;
+    msg = (struct crypticusb_batch_msg*) pos;
+    msg->blocks = cpu_to_le32(padded / SHA256_BLOCK_SIZE);
+    memcpy(pos + sizeof(*msg), msgs[n].data, msgs[n].len);
+    cryptic_pad(pos + sizeof(*msg), msgs[n].len, msgs[n].len);
+    pos += sizeof(*msg) + padded;
+    room -= sizeof(*msg) + padded;
+  }
+  if (n == 0){
+#ifdef FAKE_HARDWARE
+    kmem_cache_free(engine.frames, frame);
+#else
+    crypticusb_put_frame(handle);
+#endif
+    kfree(bf);
+    return (max_count == 0) ? -EOPNOTSUPP : 0;
+  }
+
+  frame->batch.count = cpu_to_le32(n);
+  bf->batch = batch;
+  bf->msgs = msgs;
+  bf->count = n;
+  bf->status = 0;
+  bf->len = pos - (u8*) frame;
+  bf->sent = ktime_get();
+  /* The frame may be answered as soon as it is sent */
+  list_add_tail(&bf->node, &batch->frames);
+  atomic_inc(&batch->pending);
+#ifdef FAKE_HARDWARE
+  bf->frame = frame;
+  atomic_set(&bf->jobs, n);
+  pos = frame->messages;
+  for (i = 0; i < n; i++){
+    msg = (struct crypticusb_batch_msg*) pos;
+    pos += sizeof(*msg);
+    cryptic_emu_submit_blocks(&bf->emu[i], cryptic_sha256_iv, pos, le32_to_cpu(msg->blocks), (u8*) bf->state[i],
+                              cryptic_batch_emu_done, bf);
+    pos += le32_to_cpu(msg->blocks) * SHA256_BLOCK_SIZE;
+  }
+#else
+  frame->hdr.opcode = CRYPTICUSB_OP_BATCH;
+  status = crypticusb_submit_frame(handle, bf->len, (u8*) bf->state, n * CRYPTICUSB_CHAIN_STATE_LEN,
+                                   cryptic_batch_frame_done, bf, NULL);
+  if (status < 0){
+    crypticusb_put_frame(handle);
+    atomic_dec(&batch->pending);
+    list_del(&bf->node);
+    kfree(bf);
+    return status;
+  }
+#endif
+  atomic64_inc(&stats.frames);
+  return n;
+}
+
+/**
+ * cryptic_batch_cpu_work: hash the CPU share of a batch
+ **/
+static void cryptic_batch_cpu_work(struct work_struct* work){
+  struct cryptic_batch_cpu* cpu = container_of(work, struct cryptic_batch_cpu, work);
+
+  cpu->status = cryptic_batch_software(cpu->msgs, cpu->count);
+}
+
+/**
+ * cryptic_batch_split: number of messages of a batch, from the first one, that go to the device while the
+ * others are hashed by cpus CPUs, so that both are done at the same time according to the cost model.
+ * padded is the length of the messages once padded.
+ **/
+static unsigned int cryptic_batch_split(unsigned int count, u64 padded, unsigned int cpus){
+#ifdef FAKE_HARDWARE
+  return count;
+#else
+  unsigned int min_len = READ_ONCE(offload_min);
+  u64 frames, dev_ns, sw_ns, share;
+
+  if (!crypticusb_isConnected())
+    return 0;
+  if (min_len != 0)
+    return (padded >= min_len) ? count : 0;
+
+  /* Costs are capped at 1 ms per byte so that the products fit */
+  padded = min_t(u64, padded, U32_MAX);
+  frames = max(DIV_ROUND_UP_ULL(padded, CRYPTIC_MAX_MSG_LEN), (u64) DIV_ROUND_UP(count, CRYPTICUSB_BATCH_MAX));
+  dev_ns = frames * READ_ONCE(frame_ns) + div_u64(padded * min_t(u64, READ_ONCE(dev_byte_ps), NSEC_PER_SEC), 1000);
+  sw_ns = div_u64(div_u64(padded * min_t(u64, READ_ONCE(sw_byte_ps), NSEC_PER_SEC), 1000), cpus);
+  /* The device takes the share d, in 1/1024, such that d * dev_ns = (1 - d) * sw_ns */
+  share = div64_u64(sw_ns, max_t(u64, (dev_ns + sw_ns) >> 10, 1));
+  if (share == 0 && READ_ONCE(cost_learn) && atomic_inc_return(&cost.explore) % CRYPTIC_COST_EXPLORE == 0)
+    return 1;
+  return min_t(u64, (count * share) >> 10, count);
+#endif
+}
+
+/**
+ * cryptic_batch_hash: hash the messages of a batch, see cryptic_sha256_batch. The device takes a share of the
+ * messages, as BATCH frames sent from here, while the rest is spread over works on other CPUs. Without device
+ * share this CPU takes a slice too, with too few messages it hashes them all.
+ **/
+static int cryptic_batch_hash(struct cryptic_batch_msg* msgs, unsigned int count){
+  struct cryptic_batch_cpu cpu[CRYPTIC_BATCH_CPUS];
+  struct cryptic_batch_frame* bf;
+  struct cryptic_batch_frame* tmp;
+  struct cryptic_batch batch;
+  __be32 digest[SHA256_DIGEST_SIZE / 4];
+  unsigned int i, j, k, dev, cpus, works, per;
+  u64 padded = 0;
+  int status = 0, ret;
+  int n = 0;
+
+  for (i = 0; i < count; i++)
+    padded += round_up(msgs[i].len + 1 + sizeof(__be64), SHA256_BLOCK_SIZE);
+  atomic64_add(count, &stats.batched);
+  INIT_LIST_HEAD(&batch.frames);
+  init_completion(&batch.done);
+  /* Held by the submission loop, so that the batch cannot complete before all its frames are out */
+  atomic_set(&batch.pending, 1);
+
+  cpus = clamp_t(unsigned int, num_online_cpus(), 1, CRYPTIC_BATCH_CPUS);
+  dev = cryptic_batch_split(count, padded, cpus);
+  works = min(cpus, (count - dev) / CRYPTIC_BATCH_CPU_MIN);
+  if (dev == 0 && works > 0)
+    works--;
+  per = (works > 0) ? (count - dev) / (works + (dev == 0)) : 0;
+  for (j = 0; j < works; j++){
+    INIT_WORK_ONSTACK(&cpu[j].work, cryptic_batch_cpu_work);
+    cpu[j].msgs = msgs + dev + j * per;
+    cpu[j].count = per;
+    cpu[j].status = 0;
+    queue_work(engine.batch_wq, &cpu[j].work);
+  }
+
+  /* While frames are in flight, messages that do not fit one are hashed here */
+  for (i = 0; i < dev; i += n){
+    n = cryptic_batch_submit(&batch, msgs + i, dev - i);
+    if (n < 0)
+      break;
+    if (n == 0){
+      ret = cryptic_batch_software(msgs + i, 1);
+      status = status ? status : ret;
+      n = 1;
+    }
+  }
+  if (n < 0 && n != -EOPNOTSUPP){
+    pr_warn_ratelimited("cryptIC: batch frame failed with error %d, going on in software\n", n);
+    atomic64_inc(&stats.failovers);
+  }
+  if (i < dev){
+    ret = cryptic_batch_software(msgs + i, dev - i);
+    status = status ? status : ret;
+  }
+  /* What the works left */
+  if (dev + works * per < count){
+    ret = cryptic_batch_software(msgs + dev + works * per, count - dev - works * per);
+    status = status ? status : ret;
+  }
+  for (j = 0; j < works; j++){
+    flush_work(&cpu[j].work);
+    destroy_work_on_stack(&cpu[j].work);
+    status = status ? status : cpu[j].status;
+  }
+
+  if (!atomic_dec_and_test(&batch.pending))
+    wait_for_completion(&batch.done);
+  list_for_each_entry_safe(bf, tmp, &batch.frames, node){
+    if (bf->status == 0){
+      /* The states are the digests in host order */
+      for (j = 0; j < bf->count; j++){
+        for (k = 0; k < SHA256_DIGEST_SIZE / 4; k++)
+          digest[k] = cpu_to_be32(bf->state[j][k]);
+        memcpy(bf->msgs[j].digest, digest, SHA256_DIGEST_SIZE);
+      }
+    } else {
+      pr_warn_ratelimited("cryptIC: device failed a batch frame with error %d, going on in software\n",
+                          bf->status);
+      atomic64_inc(&stats.failovers);
+      ret = cryptic_batch_software(bf->msgs, bf->count);
+      status = status ? status : ret;
+    }
+    list_del(&bf->node);
+    kfree(bf);
+  }
+  return status;
+}
+
+/**
+ * cryptic_sha256_batch: hash count independent messages with SHA-256, the digest of each one is written to
+ * its digest. Instead of a round trip per message, short messages travel to the device several per BATCH
+ * frame, with as many frames in flight as the transport allows, so that their throughput is bound by the
+ * link rather than by its latency. Meanwhile the CPUs hash the share of the messages the cost model gives
+ * them, as well as messages too long for a frame and those of frames the device fails. Sleeps until every
+ * digest is ready.
+ **/
+int cryptic_sha256_batch(struct cryptic_batch_msg* msgs, unsigned int count){
+  unsigned int i;
+  u64 len = 0;
+  int status;
+
+  for (i = 0; i < count; i++)
+    len += msgs[i].len;
+  atomic64_add(len, &stats.bytes);
+  atomic_inc(&stats.in_flight);
+  status = cryptic_batch_hash(msgs, count);
+  if (status < 0)
+    atomic64_inc(&stats.errors);
+  atomic_dec(&stats.in_flight);
+  return status;
+}
+
+EXPORT_SYMBOL(cryptic_sha256_batch);
+
+static bool cryptic_merkle_leaf_valid(unsigned int leaf_size){
+  return is_power_of_2(leaf_size) && leaf_size >= CRYPTIC_MERKLE_LEAF_MIN && leaf_size <= CRYPTIC_MERKLE_LEAF_MAX;
+}
+
+/**
+ * cryptic_merkle_init: start an empty tree with leaves of leaf_size bytes
+ **/
+static void cryptic_merkle_init(struct cryptic_merkle* tree, unsigned int leaf_size){
+  struct sha256_state iv;
+  unsigned int i;
+
+  memset(tree, 0, sizeof(*tree));
+  tree->leaf_size = leaf_size;
+  sha256_init(&iv);
+  for (i = 0; i < CRYPTIC_MERKLE_LEVELS; i++)
+    memcpy(tree->levels[i].state, iv.state, sizeof(iv.state));
+}
+
+/**
+ * cryptic_merkle_zeros: hash len zero bytes
+ **/
+static void cryptic_merkle_zeros(struct sha256_state* sctx, unsigned int len){
+  static const u8 zeros[SHA256_BLOCK_SIZE];
+  unsigned int n;
+
+  for (; len > 0; len -= n){
+    n = min_t(unsigned int, len, sizeof(zeros));
+    sha256_update(sctx, zeros, n);
+  }
+}
+
+/**
+ * cryptic_merkle_resume: SHA-256 state of the block of a level, which holds no partial SHA-256 block once
+ * the tail is left out
+ **/
+static void cryptic_merkle_resume(struct cryptic_merkle_level* level, struct sha256_state* sctx){
+  memcpy(sctx->state, level->state, sizeof(level->state));
+  sctx->count = (u64) (level->digests / 2) * 2 * SHA256_DIGEST_SIZE;
+}
+
+/**
+ * cryptic_merkle_node: hash the block of a level, zero-padded, into digest and start the next block
+ **/
+static void cryptic_merkle_node(struct cryptic_merkle* tree, struct cryptic_merkle_level* level, u8* digest){
+  struct sha256_state sctx;
+
+  cryptic_merkle_resume(level, &sctx);
+  if (level->digests % 2)
+    sha256_update(&sctx, level->tail, SHA256_DIGEST_SIZE);
+  cryptic_merkle_zeros(&sctx, tree->leaf_size - level->digests * SHA256_DIGEST_SIZE);
+  sha256_final(&sctx, digest);
+
+  sha256_init(&sctx);
+  memcpy(level->state, sctx.state, sizeof(level->state));
+  level->digests = 0;
+  level->blocks++;
+}
+
+/**
+ * cryptic_merkle_push: add a digest to the given level of the tree, the blocks it fills go up.
+ * Returns -EFBIG if the tree outgrows CRYPTIC_MERKLE_LEVELS.
+ **/
+static int cryptic_merkle_push(struct cryptic_merkle* tree, unsigned int height, const u8* digest){
+  struct cryptic_merkle_level* level;
+  struct sha256_state sctx;
+  u8 node[SHA256_DIGEST_SIZE];
+
+  for (; height < CRYPTIC_MERKLE_LEVELS; height++){
+    level = &tree->levels[height];
+    if (level->digests % 2 == 0){
+      memcpy(level->tail, digest, SHA256_DIGEST_SIZE);
+    } else {
+      cryptic_merkle_resume(level, &sctx);
+      sha256_update(&sctx, level->tail, SHA256_DIGEST_SIZE);
+      sha256_update(&sctx, digest, SHA256_DIGEST_SIZE);
+      memcpy(level->state, sctx.state, sizeof(level->state));
+    }
+    level->digests++;
+    if (level->digests * SHA256_DIGEST_SIZE < tree->leaf_size)
+      return 0;
+    cryptic_merkle_node(tree, level, node);
+    digest = node;
+  }
+  return -EFBIG;
+}
+
+/**
+ * cryptic_merkle_leaf: hash the open leaf, zero-padded, into the tree
+ **/
+static int cryptic_merkle_leaf(struct cryptic_merkle* tree){
+  u8 digest[SHA256_DIGEST_SIZE];
+
+  cryptic_merkle_zeros(&tree->leaf, tree->leaf_size - tree->leaf_len);
+  sha256_final(&tree->leaf, digest);
+  tree->leaf_len = 0;
+  return cryptic_merkle_push(tree, 0, digest);
+}
+
+/**
+ * cryptic_merkle_update: add len bytes of data to a tree. Its whole leaves are hashed as batches of up to
+ * buf->leaves messages, spread over the device and the CPUs, while a leaf cut by the end of the data stays
+ * open in the tree and is hashed here, on the CPU. buf may be NULL if the data does not reach the end of a
+ * leaf. Sleeps when it holds whole leaves.
+ **/
+static int cryptic_merkle_update(struct cryptic_merkle* tree, struct cryptic_merkle_buf* buf, const u8* data, size_t len){
+  unsigned int take, n, i;
+  int status = 0;
+
+  if (tree->leaf_len > 0){
+    take = min_t(size_t, len, tree->leaf_size - tree->leaf_len);
+    sha256_update(&tree->leaf, data, take);
+    tree->leaf_len += take;
+    tree->count += take;
+    data += take;
+    len -= take;
+    if (tree->leaf_len == tree->leaf_size)
+      status = cryptic_merkle_leaf(tree);
+  }
+
+  while (status == 0 && len >= tree->leaf_size){
+    n = min_t(size_t, len / tree->leaf_size, buf->leaves);
+    for (i = 0; i < n; i++){
+      buf->msgs[i].data = data + i * tree->leaf_size;
+      buf->msgs[i].len = tree->leaf_size;
+      buf->msgs[i].digest = buf->digests + i * SHA256_DIGEST_SIZE;
+    }
+    status = cryptic_batch_hash(buf->msgs, n);
+    for (i = 0; i < n && status == 0; i++)
+      status = cryptic_merkle_push(tree, 0, buf->digests + i * SHA256_DIGEST_SIZE);
+    data += n * tree->leaf_size;
+    len -= n * tree->leaf_size;
+    tree->count += n * tree->leaf_size;
+  }
+
+  if (status == 0 && len > 0){
+    sha256_init(&tree->leaf);
+    sha256_update(&tree->leaf, data, len);
+    tree->leaf_len = len;
+    tree->count += len;
+  }
+  return status;
+}
+
+/**
+ * cryptic_merkle_final: hash what is left of the tree, level by level, up to its root
+ **/
+static int cryptic_merkle_final(struct cryptic_merkle* tree, u8* root){
+  struct cryptic_merkle_level* level;
+  u8 node[SHA256_DIGEST_SIZE];
+  unsigned int height;
+  int status = 0;
+
+  if (tree->count == 0){
+    memset(root, 0, SHA256_DIGEST_SIZE);
+    return 0;
+  }
+  if (tree->leaf_len > 0)
+    status = cryptic_merkle_leaf(tree);
+
+  for (height = 0; status == 0 && height < CRYPTIC_MERKLE_LEVELS; height++){
+    level = &tree->levels[height];
+    /* Nothing went above a level made of a single digest: it is the root */
+    if (level->blocks == 0 && level->digests == 1){
+      memcpy(root, level->tail, SHA256_DIGEST_SIZE);
+      return 0;
+    }
+    if (level->digests > 0){
+      cryptic_merkle_node(tree, level, node);
+      status = cryptic_merkle_push(tree, height + 1, node);
+    }
+  }
+  return status ? status : -EFBIG;
+}
+
+static void cryptic_merkle_buf_free(struct cryptic_merkle_buf* buf){
+  if (buf == NULL)
+    return;
+  kvfree(buf->data);
+  kfree(buf->msgs);
+  kfree(buf->digests);
+  kfree(buf);
+}
+
+/**
+ * cryptic_merkle_buf_alloc: working memory for rounds of leaves of leaf_size bytes, no larger than needed
+ * for len bytes of data
+ **/
+static struct cryptic_merkle_buf* cryptic_merkle_buf_alloc(unsigned int leaf_size, u64 len){
+  struct cryptic_merkle_buf* buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+
+  if (buf == NULL)
+    return NULL;
+  buf->leaves = max_t(unsigned int, CRYPTIC_MERKLE_CHUNK / leaf_size, CRYPTIC_MERKLE_MIN_LEAVES);
+  buf->leaves = clamp_t(u64, DIV_ROUND_UP_ULL(len, leaf_size), 1, buf->leaves);
+  buf->size = (size_t) buf->leaves * leaf_size;
+  buf->data = kvmalloc(buf->size, GFP_KERNEL);
+  buf->msgs = kmalloc_array(buf->leaves, sizeof(*buf->msgs), GFP_KERNEL);
+  buf->digests = kmalloc_array(buf->leaves, SHA256_DIGEST_SIZE, GFP_KERNEL);
+  if (buf->data == NULL || buf->msgs == NULL || buf->digests == NULL){
+    cryptic_merkle_buf_free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+/**
+ * cryptic_merkle_process: serve a merkle-sha256 request, its data goes through a bounce buffer a round
+ * of leaves at a time. Runs on a merkle worker, which it holds until the leaves are hashed.
+ **/
+static int cryptic_merkle_process(struct ahash_request* req){
+  struct cryptic_merkle_req* ctx = ahash_request_ctx(req);
+  struct cryptic_merkle_buf* buf = NULL;
+  unsigned int nbytes = (ctx->op == CRYPTIC_OP_FINAL) ? 0 : req->nbytes;
+  unsigned int offset, chunk;
+  int status = 0;
+
+  if (nbytes > 0){
+    buf = cryptic_merkle_buf_alloc(ctx->tree.leaf_size, nbytes);
+    if (buf == NULL)
+      return -ENOMEM;
+  }
+  for (offset = 0; status == 0 && offset < nbytes; offset += chunk){
+    chunk = min_t(size_t, nbytes - offset, buf->size);
+    sg_pcopy_to_buffer(req->src, sg_nents(req->src), buf->data, chunk, offset);
+    status = cryptic_merkle_update(&ctx->tree, buf, buf->data, chunk);
+  }
+  if (status == 0 && ctx->op != CRYPTIC_OP_UPDATE)
+    status = cryptic_merkle_final(&ctx->tree, req->result);
+  cryptic_merkle_buf_free(buf);
+  return status;
+}
+
+static int cryptic_cra_merkle_init(struct crypto_tfm* tfm){
+  struct cryptic_sha256_ctx* ctx = crypto_tfm_ctx(tfm);
+
+  /* Leaves the device does not take are hashed in software by the batches */
+  ctx->fallback = NULL;
+  ctx->migrate = false;
+  ctx->software = false;
+  ctx->merkle = true;
+  crypto_ahash_set_reqsize(__crypto_ahash_cast(tfm), sizeof(struct cryptic_merkle_req));
+  return 0;
+}
+
+/**
+ * cryptic_merkle_work: merkle worker, serves a request handed over by the engine
+ **/
+static void cryptic_merkle_work(struct work_struct* work){
+  struct cryptic_merkle_req* ctx = container_of(work, struct cryptic_merkle_req, work);
+  int status;
+
+  status = cryptic_merkle_process(ctx->req);
+  if (status < 0)
+    atomic64_inc(&stats.errors);
+  atomic_dec(&stats.in_flight);
+  cryptic_request_complete(&ctx->req->base, status);
+}
+
+static int cryptic_merkle_enqueue(struct ahash_request* req, unsigned int op){
+  struct cryptic_merkle_req* ctx = ahash_request_ctx(req);
+
+  ctx->op = op;
+  ctx->req = req;
+  INIT_WORK(&ctx->work, cryptic_merkle_work);
+  return cryptic_queue(req, op);
+}
+
+static int cryptic_merkle_sha_init(struct ahash_request* req){
+  struct cryptic_merkle_req* ctx = ahash_request_ctx(req);
+
+  cryptic_merkle_init(&ctx->tree, merkle_leaf);
+  return 0;
+}
+
+static int cryptic_merkle_sha_update(struct ahash_request* req){
+  struct cryptic_merkle_req* ctx = ahash_request_ctx(req);
+  struct sg_mapping_iter miter;
+  unsigned int nbytes = req->nbytes;
+  size_t len;
+
+  if (ctx->tree.leaf_len + req->nbytes < ctx->tree.leaf_size){
+    /* Data stays in the open leaf, no need for the workers: complete synchronously */
+    sg_miter_start(&miter, req->src, sg_nents(req->src), SG_MITER_ATOMIC | SG_MITER_FROM_SG);
+    while (nbytes > 0 && sg_miter_next(&miter)){
+      len = min_t(size_t, miter.length, nbytes);
+      cryptic_merkle_update(&ctx->tree, NULL, miter.addr, len);
+      nbytes -= len;
+    }
+    sg_miter_stop(&miter);
+    atomic64_inc(&stats.requests);
+    atomic64_add(req->nbytes, &stats.bytes);
+    return 0;
+  }
+  return cryptic_merkle_enqueue(req, CRYPTIC_OP_UPDATE);
+}
+
+static int cryptic_merkle_sha_final(struct ahash_request* req){
+  return cryptic_merkle_enqueue(req, CRYPTIC_OP_FINAL);
+}
+
+static int cryptic_merkle_sha_finup(struct ahash_request* req){
+  return cryptic_merkle_enqueue(req, CRYPTIC_OP_FINUP);
+}
+
+static int cryptic_merkle_sha_digest(struct ahash_request* req){
+  cryptic_merkle_sha_init(req);
+  return cryptic_merkle_enqueue(req, CRYPTIC_OP_FINUP);
+}
+
+/**
+ * cryptic_merkle_sha_export: the tree holds no pointer, it is the exported state
+ **/
+static int cryptic_merkle_sha_export(struct ahash_request* req, void* out){
+  struct cryptic_merkle_req* ctx = ahash_request_ctx(req);
+
+  memcpy(out, &ctx->tree, sizeof(ctx->tree));
+  return 0;
+}
+
+static int cryptic_merkle_sha_import(struct ahash_request* req, const void* in){
+  struct cryptic_merkle_req* ctx = ahash_request_ctx(req);
+  const struct cryptic_merkle* tree = in;
+  unsigned int i;
+
+  if (!cryptic_merkle_leaf_valid(tree->leaf_size) || tree->leaf_len >= tree->leaf_size)
+    return -EINVAL;
+  for (i = 0; i < CRYPTIC_MERKLE_LEVELS; i++)
+    if (tree->levels[i].digests >= tree->leaf_size / SHA256_DIGEST_SIZE)
+      return -EINVAL;
+  memcpy(&ctx->tree, tree, sizeof(ctx->tree));
+  return 0;
+}
+
+/**
+ * cryptic_ioctl_batch: CRYPTIC_IOC_SHA256_BATCH, copy the messages in, hash them as a batch and copy the
+ * digests out
+ **/
+static long cryptic_ioctl_batch(struct cryptic_ioc_batch __user* arg){
+  struct cryptic_ioc_batch req;
+  struct cryptic_ioc_msg* umsgs = NULL;
+  struct cryptic_batch_msg* msgs = NULL;
+  u8* digests = NULL;
+  u8* data = NULL;
+  unsigned int i;
+  size_t total = 0;
+  long status;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (req.flags != 0 || req.count > CRYPTIC_IOC_BATCH_MAX)
+    return -EINVAL;
+  if (req.count == 0)
+    return 0;
+
+  status = -ENOMEM;
+  umsgs = kvmalloc_array(req.count, sizeof(*umsgs), GFP_KERNEL);
+  msgs = kvmalloc_array(req.count, sizeof(*msgs), GFP_KERNEL);
+  digests = kvmalloc_array(req.count, SHA256_DIGEST_SIZE, GFP_KERNEL);
+  if (umsgs == NULL || msgs == NULL || digests == NULL)
+    goto out;
+  status = -EFAULT;
+  if (copy_from_user(umsgs, u64_to_user_ptr(req.msgs), req.count * sizeof(*umsgs)))
+    goto out;
+  status = -EINVAL;
+  for (i = 0; i < req.count; i++){
+    if (umsgs[i].reserved != 0 || umsgs[i].len > CRYPTIC_IOC_BATCH_BYTES - total)
+      goto out;
+    total += umsgs[i].len;
+  }
+  status = -ENOMEM;
+  data = kvmalloc(max_t(size_t, total, 1), GFP_KERNEL);
+  if (data == NULL)
+    goto out;
+  status = -EFAULT;
+  for (total = 0, i = 0; i < req.count; total += umsgs[i].len, i++){
+    if (copy_from_user(data + total, u64_to_user_ptr(umsgs[i].data), umsgs[i].len))
+      goto out;
+    msgs[i].data = data + total;
+    msgs[i].len = umsgs[i].len;
+    msgs[i].digest = digests + i * SHA256_DIGEST_SIZE;
+  }
+
+  status = cryptic_sha256_batch(msgs, req.count);
+  if (status == 0 && copy_to_user(u64_to_user_ptr(req.digests), digests, req.count * SHA256_DIGEST_SIZE))
+    status = -EFAULT;
+out:
+  kvfree(data);
+  kvfree(digests);
+  kvfree(msgs);
+  kvfree(umsgs);
+  return status;
+}
+
+/**
+ * cryptic_ioctl_merkle: CRYPTIC_IOC_MERKLE_SHA256, read the file into the tree a round of leaves at a time
+ **/
+static long cryptic_ioctl_merkle(struct cryptic_ioc_merkle __user* arg){
+  struct cryptic_ioc_merkle req;
+  struct cryptic_merkle_buf* buf = NULL;
+  struct cryptic_merkle* tree = NULL;
+  u8 root[SHA256_DIGEST_SIZE];
+  struct file* file;
+  loff_t pos;
+  ssize_t n;
+  u64 done = 0;
+  long status;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (req.leaf_size == 0)
+    req.leaf_size = merkle_leaf;
+  if (!cryptic_merkle_leaf_valid(req.leaf_size) || req.offset > LLONG_MAX)
+    return -EINVAL;
+  file = fget(req.fd);
+  if (file == NULL)
+    return -EBADF;
+  status = -EBADF;
+  if (!(file->f_mode & FMODE_READ))
+    goto out;
+  status = -ENOMEM;
+  tree = kmalloc(sizeof(*tree), GFP_KERNEL);
+  buf = cryptic_merkle_buf_alloc(req.leaf_size, req.len);
+  if (tree == NULL || buf == NULL)
+    goto out;
+
+  cryptic_merkle_init(tree, req.leaf_size);
+  atomic64_inc(&stats.requests);
+  atomic_inc(&stats.in_flight);
+  status = 0;
+  for (pos = req.offset; done < req.len; done += n){
+    if (fatal_signal_pending(current)){
+      status = -EINTR;
+      break;
+    }
+    n = kernel_read(file, buf->data, min_t(u64, req.len - done, buf->size), &pos);
+    if (n <= 0){
+      status = n;
+      break;
+    }
+    status = cryptic_merkle_update(tree, buf, buf->data, n);
+    if (status < 0)
+      break;
+  }
+  atomic64_add(done, &stats.bytes);
+  if (status == 0)
+    status = cryptic_merkle_final(tree, root);
+  if (status < 0)
+    atomic64_inc(&stats.errors);
+  atomic_dec(&stats.in_flight);
+
+  req.len = done;
+  if (status == 0 && (copy_to_user(u64_to_user_ptr(req.root), root, sizeof(root)) ||
+                      copy_to_user(arg, &req, sizeof(req))))
+    status = -EFAULT;
+out:
+  cryptic_merkle_buf_free(buf);
+  kfree(tree);
+  fput(file);
+  return status;
+}
+
+static long cryptic_ioctl(struct file* file, unsigned int cmd, unsigned long arg){
+  switch (cmd){
+  case CRYPTIC_IOC_SHA256_BATCH:
+    return cryptic_ioctl_batch((struct cryptic_ioc_batch __user*) arg);
+  case CRYPTIC_IOC_MERKLE_SHA256:
+    return cryptic_ioctl_merkle((struct cryptic_ioc_merkle __user*) arg);
+  default:
+    return -ENOTTY;
+  }
+}
+
+static const struct file_operations cryptic_fops = {
+  .owner = THIS_MODULE,
+  .unlocked_ioctl = cryptic_ioctl,
+  .compat_ioctl = compat_ptr_ioctl
+};
+
+/* /dev/cryptic, for userspace to reach what the Crypto API cannot express. Only root opens it, a udev rule
+ * can grant wider access */
+static struct miscdevice cryptic_misc = {
+  .minor = MISC_DYNAMIC_MINOR,
+  .name = "cryptic",
+  .fops = &cryptic_fops,
+  .mode = 0600
+};
+
 /*
-  struct shash_alg
-  .init: initalize the transformation context
+  struct ahash_alg
+  .init: initalize the request context
   .update: push a chunk of data into the driver for transformation. The driver then
   passes the data to the driver as seen fit. The function must not finalize the the HASH transformation,
   it only adds data to the transformation.
@@ -219,50 +1545,161 @@ static int cryptic_sha_init(struct shash_desc* desc){
   .finup: combination of update and final in sequence
   .digest: combination of init, update and final
   .setkey: Set an optional key used by the hashing algorithm
-  .statesize
-  .descsize
-  .base: crypto_alg structure
+  .export: save the partial state of a request, e.g. to checkpoint a long hash
+  .import: resume a request from an exported state
+  .halg.statesize: size of the exported state
+  .halg.base: crypto_alg structure
+  Every operation that needs the device is queued and completed asynchronously by the worker.
 */
-static struct shash_alg alg_sha256 = {
+static struct ahash_alg alg_sha256 = {
 				      .init   = cryptic_sha_init,
 				      .update = cryptic_sha_update,
 				      .final  = cryptic_sha_final,
-				      //  .finup  = cryptic_sha_finup,
-				      //  .digest = cryptic_sha_digest,
-				      .digestsize = SHA256_DIGEST_SIZE, // =32, defined in crypto/sha2.h
-				      .statesize = sizeof (struct cryptic_desc_ctx),
-				      .descsize = sizeof (struct cryptic_desc_ctx),
-				      .init_tfm = cryptic_cra_sha256_init,
-				      .exit_tfm = cryptic_cra_sha256_exit,
-				      .base = {
-					       .cra_name = "sha256",
-					       .cra_driver_name = "cryptic-sha256",
-					       .cra_priority = 300,
-					       .cra_flags = CRYPTO_ALG_KERN_DRIVER_ONLY | CRYPTO_ALG_NEED_FALLBACK, // hardware-accelerated but not in the ISA
-					       .cra_blocksize = SHA256_BLOCK_SIZE, // = 64
-					       .cra_ctxsize = sizeof(struct cryptic_sha256_ctx),
-					       /* cra_init: initialize the transformation object, this is called right after the
-						  transformation object is allocated */
-					       //.cra_init = cryptic_cra_sha256_init,
-					       //.cra_exit = cryptic_cra_sha256_exit,
-					       .cra_module = THIS_MODULE
-
+				      .finup  = cryptic_sha_finup,
+				      .digest = cryptic_sha_digest,
+				      .export = cryptic_sha_export,
+				      .import = cryptic_sha_import,
+				      .halg = {
+					       .digestsize = SHA256_DIGEST_SIZE, // =32, defined in crypto/sha2.h
+					       .statesize = sizeof (struct cryptic_sha256_state),
+					       .base = {
+							.cra_name = "sha256",
+							.cra_driver_name = "cryptic-sha256",
+							.cra_priority = 300,
+							.cra_flags = CRYPTO_ALG_ASYNC | CRYPTO_ALG_KERN_DRIVER_ONLY | CRYPTO_ALG_NEED_FALLBACK, // hardware-accelerated but not in the ISA
+							.cra_blocksize = SHA256_BLOCK_SIZE, // = 64
+							.cra_ctxsize = sizeof(struct cryptic_sha256_ctx),
+							/* cra_init: initialize the transformation object, this is called right after the
+							   transformation object is allocated */
+							.cra_init = cryptic_cra_sha256_init,
+							.cra_exit = cryptic_cra_sha256_exit,
+							.cra_module = THIS_MODULE
+							}
 					       }
 };
 
+/* Merkle tree of SHA-256 nodes, see struct cryptic_merkle. The leaves are hashed in parallel, as batches */
+static struct ahash_alg alg_merkle_sha256 = {
+					      .init   = cryptic_merkle_sha_init,
+					      .update = cryptic_merkle_sha_update,
+					      .final  = cryptic_merkle_sha_final,
+					      .finup  = cryptic_merkle_sha_finup,
+					      .digest = cryptic_merkle_sha_digest,
+					      .export = cryptic_merkle_sha_export,
+					      .import = cryptic_merkle_sha_import,
+					      .halg = {
+						       .digestsize = SHA256_DIGEST_SIZE,
+						       .statesize = sizeof (struct cryptic_merkle),
+						       .base = {
+								.cra_name = "merkle-sha256",
+								.cra_driver_name = "cryptic-merkle-sha256",
+								.cra_priority = 300,
+								.cra_flags = CRYPTO_ALG_ASYNC | CRYPTO_ALG_KERN_DRIVER_ONLY,
+								.cra_blocksize = SHA256_BLOCK_SIZE,
+								.cra_ctxsize = sizeof(struct cryptic_sha256_ctx),
+								.cra_init = cryptic_cra_merkle_init,
+								.cra_exit = cryptic_cra_sha256_exit,
+								.cra_module = THIS_MODULE
+								}
+						       }
+};
+
 int cryptic_sha256_register(void){
-  int ret = crypto_register_shash(&alg_sha256);
+  unsigned int i;
+  int ret;
+
+  /* The transport leaves out the chaining state of frames when the device holds it */
+  BUILD_BUG_ON(offsetof(struct cryptpb, len) - offsetof(struct cryptpb, in_partial_digest) != CRYPTICUSB_CHAIN_STATE_LEN ||
+               offsetof(struct cryptpb, in_partial_digest) != sizeof(struct crypticusb_hdr));
+  BUILD_BUG_ON(sizeof(struct cryptic_merkle) > HASH_MAX_STATESIZE);
+  if (!cryptic_merkle_leaf_valid(merkle_leaf)){
+    pr_warn("cryptIC: merkle_leaf %u is not a power of 2 from 1024 to 65536, using 4096\n", merkle_leaf);
+    merkle_leaf = 4096;
+  }
+  /* Setup the request queue before exposing the algorithm */
+  spin_lock_init(&engine.lock);
+  crypto_init_queue(&engine.queue, CRYPTIC_QUEUE_LEN);
+  INIT_LIST_HEAD(&engine.ready);
+  engine.n_workers = clamp_t(unsigned int, workers, 1, CRYPTIC_MAX_WORKERS);
+  for (i = 0; i < engine.n_workers; i++)
+    INIT_WORK(&engine.work[i], cryptic_engine_work);
+  atomic_set(&engine.next, 0);
+#ifdef FAKE_HARDWARE
+  /* As large as the largest USB frame, BATCH frames fill them */
+  engine.frames = kmem_cache_create("cryptic_frame", sizeof(struct crypticusb_hdr) + CRYPTICUSB_MAX_PAYLOAD, 0, 0, NULL);
+  if (engine.frames == NULL){
+    pr_err("cryptIC: failed to allocate the frame cache.\n");
+    return -ENOMEM;
+  }
+#endif
+  engine.wq = alloc_workqueue("cryptic", WQ_MEM_RECLAIM | WQ_UNBOUND, engine.n_workers);
+  engine.merkle_wq = alloc_workqueue("cryptic_merkle", WQ_MEM_RECLAIM | WQ_UNBOUND, engine.n_workers);
+  engine.batch_wq = alloc_workqueue("cryptic_batch", WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+  if (engine.wq == NULL || engine.merkle_wq == NULL || engine.batch_wq == NULL){
+    pr_err("cryptIC: failed to allocate the request queue workers.\n");
+    ret = -ENOMEM;
+    goto err_shash;
+  }
+
+  /* Batches hash what the device does not take in software, whatever the fallback of the transformations */
+  batch_fallback = crypto_alloc_shash("sha256", 0, CRYPTO_ALG_NEED_FALLBACK);
+  if (IS_ERR(batch_fallback)){
+    pr_err("cryptIC: cannot allocate the software implementation for batches\n");
+    ret = PTR_ERR(batch_fallback);
+    goto err_shash;
+  }
+
+  ret = crypto_register_ahash(&alg_sha256);
   if (ret < 0){
     pr_err("cryptIC: failed to register sha256.\n");
+    goto err_ahash;
   }
-  else{
-    pr_info("cryptIC: sha256 registered successfully.\n");
+  ret = crypto_register_ahash(&alg_merkle_sha256);
+  if (ret < 0){
+    pr_err("cryptIC: failed to register merkle-sha256.\n");
+    goto err_merkle;
+  }
+  ret = misc_register(&cryptic_misc);
+  if (ret < 0){
+    pr_err("cryptIC: failed to register /dev/cryptic.\n");
+    goto err_misc;
   }
+  pr_info("cryptIC: sha256 and merkle-sha256 (%u byte leaves) registered successfully.\n", merkle_leaf);
+  stats_file = debugfs_create_file("sha256", 0444, crypticusb_debugfs_root(), NULL, &cryptic_stats_fops);
+  return 0;
+
+err_misc:
+  crypto_unregister_ahash(&alg_merkle_sha256);
+err_merkle:
+  crypto_unregister_ahash(&alg_sha256);
+err_ahash:
+  crypto_free_shash(batch_fallback);
+err_shash:
+  if (engine.wq != NULL)
+    destroy_workqueue(engine.wq);
+  if (engine.merkle_wq != NULL)
+    destroy_workqueue(engine.merkle_wq);
+  if (engine.batch_wq != NULL)
+    destroy_workqueue(engine.batch_wq);
+#ifdef FAKE_HARDWARE
+  kmem_cache_destroy(engine.frames);
+#endif
   return ret;
 }
 
 int cryptic_sha256_unregister(void){
-  crypto_unregister_shash(&alg_sha256);
+  debugfs_remove(stats_file);
+  misc_deregister(&cryptic_misc);
+  crypto_unregister_ahash(&alg_merkle_sha256);
+  crypto_unregister_ahash(&alg_sha256);
+  /* Wait for the workers to drain the queue, then for the merkle requests they handed over */
+  destroy_workqueue(engine.wq);
+  destroy_workqueue(engine.merkle_wq);
+  destroy_workqueue(engine.batch_wq);
+  crypto_free_shash(batch_fallback);
+#ifdef FAKE_HARDWARE
+  kmem_cache_destroy(engine.frames);
+#endif
   return 0;
 }
 
@@ -16,8 +16,14 @@
 #include <linux/cdev.h>
 #include <asm/uaccess.h>
 #include <crypto/internal/hash.h>
+#include <crypto/algapi.h>
 #include <linux/crypto.h>
 #include <linux/stddef.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/completion.h>
 
 #ifdef SPLIT_SHA_HEADER
 #include <crypto/sha2.h>
@@ -30,6 +36,7 @@
 #endif
 
 #include "../usb/crypticusb.h"
+#include "cryptic_ioctl.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -37,26 +44,143 @@ MODULE_LICENSE("Dual BSD/GPL");
 #define HASH_MAX_KEY_SIZE (SHA256_BLOCK_SIZE * 8)
 #define CRYPTIC_N_BLOCKS 2
 #define CRYPTIC_BUF_LEN SHA256_BLOCK_SIZE*CRYPTIC_N_BLOCKS
+#define CRYPTIC_QUEUE_LEN 64
+#define CRYPTIC_MAX_WORKERS 16
+/* Cost model: weight of a new sample is 1/2^CRYPTIC_COST_DECAY, one request in CRYPTIC_COST_EXPLORE
+   goes to the device whatever the model says */
+#define CRYPTIC_COST_DECAY 4
+#define CRYPTIC_COST_EXPLORE 64
+/* Largest message chunk carried by a single frame, the device may accept less */
+#define CRYPTIC_FRAME_BLOCKS 64
+#define CRYPTIC_MAX_MSG_LEN (SHA256_BLOCK_SIZE*CRYPTIC_FRAME_BLOCKS)
+/* Batches: the CPU share is spread over up to CRYPTIC_BATCH_CPUS works of at least CRYPTIC_BATCH_CPU_MIN
+   messages each */
+#define CRYPTIC_BATCH_CPUS 8
+#define CRYPTIC_BATCH_CPU_MIN 4
+/* Merkle trees: leaf sizes allowed, levels above the leaves kept in the state, and data hashed per round
+   of leaves, at least CRYPTIC_MERKLE_MIN_LEAVES of them */
+#define CRYPTIC_MERKLE_LEAF_MIN 1024
+#define CRYPTIC_MERKLE_LEAF_MAX 65536
+#define CRYPTIC_MERKLE_LEVELS 5
+#define CRYPTIC_MERKLE_CHUNK (256 * 1024)
+#define CRYPTIC_MERKLE_MIN_LEAVES 16
 
-/* cryptic parameter block: this structure is the data sent to the hardware device */
+/* Operations carried out by the worker on behalf of an ahash request */
+enum cryptic_op {
+  CRYPTIC_OP_UPDATE,
+  CRYPTIC_OP_FINAL,
+  CRYPTIC_OP_FINUP,
+  CRYPTIC_OP_DONE    /* result computed, the request only needs to be completed */
+};
+
+/* cryptic parameter block: this structure is the HASH frame sent to the hardware device. The message
+   follows the parameters, len is always a multiple of the block size: the driver pads the message
+   itself, so the device only runs the compression function and answers with the updated state */
 struct cryptpb{
-  u8 message[CRYPTIC_BUF_LEN];
+  struct crypticusb_hdr hdr;
   u8 in_partial_digest[SHA256_DIGEST_SIZE];
   u32 len;
-  u32 finalize;
-  u32 bitlen;
-  u8 digest[SHA256_DIGEST_SIZE];
+  u8 message[];
+};
+
+/* BATCH frame: several short messages, each one padded and preceded by its struct crypticusb_batch_msg.
+   Built in the same buffers as the HASH frames */
+struct cryptbatch{
+  struct crypticusb_hdr hdr;
+  struct crypticusb_batch batch;
+  u8 messages[];
+};
+
+/* Message of a batch, see cryptic_sha256_batch */
+struct cryptic_batch_msg {
+  const u8* data;
+  unsigned int len;
+  u8* digest;
 };
 
-/* Hash context structure */
+/* Batch being hashed: its frames and the number of them waiting for the device */
+struct cryptic_batch {
+  struct list_head frames;
+  atomic_t pending;
+  struct completion done;
+};
+
+/** BATCH frame sent for a batch
+* msgs, count: the messages it carries
+* state: the final state of each message, as answered by the device
+* len, sent: length and submission time of the frame, for the cost model
+* frame, jobs, emu: the frame while the emulated device holds it, one job per message
+**/
+struct cryptic_batch_frame {
+  struct list_head node;
+  struct cryptic_batch* batch;
+  struct cryptic_batch_msg* msgs;
+  unsigned int count;
+  int status;
+  u32 state[CRYPTICUSB_BATCH_MAX][SHA256_DIGEST_SIZE / 4];
+  unsigned int len;
+  ktime_t sent;
+#ifdef FAKE_HARDWARE
+  struct cryptbatch* frame;
+  atomic_t jobs;
+  struct cryptic_emu_job emu[CRYPTICUSB_BATCH_MAX];
+#endif
+};
+
+/* Software share of a batch, hashed by another CPU while the device works on the rest */
+struct cryptic_batch_cpu {
+  struct work_struct work;
+  struct cryptic_batch_msg* msgs;
+  unsigned int count;
+  int status;
+};
+
+/* Hash context structure: read-only once initialized, every in-flight request owns its frame */
 struct cryptic_sha256_ctx {
-  /* Device structure */
-  /* ... */
+  struct crypto_shash* fallback;
+  bool migrate;     /* requests can move between the device and the fallback */
+  bool software;    /* no migration and no device at creation time: always use the fallback */
+  bool merkle;      /* a merkle-sha256 transformation, see struct cryptic_merkle */
+};
+
+/* Request queue: ahash requests are queued here and served by a pool of workers. A request is
+   handled by one worker at a time, different requests in parallel */
+struct cryptic_engine {
   spinlock_t lock;
+  struct crypto_queue queue;
+  struct list_head ready;     /* requests whose frame has been answered by the device */
+  struct workqueue_struct* wq;
+  struct work_struct work[CRYPTIC_MAX_WORKERS];
+  unsigned int n_workers;
+  atomic_t next;              /* worker to kick next */
+  /* merkle-sha256 requests sleep until their leaves are hashed, they are handed over to workers of their own
+     so that sha256 requests are not held up. Batches flush the works hashing their CPU share, which run on
+     batch_wq: work flushed from a reclaim workqueue must run on one too */
+  struct workqueue_struct* merkle_wq;
+  struct workqueue_struct* batch_wq;
+#ifdef FAKE_HARDWARE
+  struct kmem_cache* frames;  /* frames handed to the emulated device */
+#endif
+};
 
-  struct cryptpb* cryptic_data;
+/* Cost model state: exponentially decaying sums of the frame lengths x and latencies y */
+struct cryptic_cost {
+  spinlock_t lock;
+  s64 n, x, y, xx, xy;
+  atomic_t explore;
+};
 
-  struct crypto_shash* fallback;
+/* Statistics of the algorithm, exposed through debugfs next to the per-device ones */
+struct cryptic_stats {
+  atomic64_t requests;    /* update, final, finup and digest operations */
+  atomic64_t bytes;       /* message bytes handed to the driver */
+  atomic64_t frames;      /* frames sent to the device */
+  atomic64_t fallback;    /* operations served by the software fallback */
+  atomic64_t migrations;  /* requests moved between the device and the fallback */
+  atomic64_t failovers;   /* requests moved to the fallback because the device failed them */
+  atomic64_t errors;      /* operations completed with an error */
+  atomic64_t batched;     /* messages hashed through batches */
+  atomic_t in_flight;     /* operations queued or waiting for the device */
 };
 
 /** Context
@@ -64,25 +188,107 @@ struct cryptic_sha256_ctx {
 * count: total data length
 * buf: temporary buffer to hold the message. When it is full, it is sent to the device for a partial digest
 *      before being updated.
+* op: operation requested to the worker
+* offset: bytes of the request source already consumed
+* status: outcome of the last frame sent to the device
+* frame_op, frame_buflen, frame_chunk: bookkeeping of the last frame, to hash its data again in
+*      software if the device fails it
+* frame_len, frame_sent: length and submission time of the last frame, for the cost model
+* chain: cookie of the last frame sent to the device, 0 when state does not come from its response.
+*      A slot of the device may still hold that state, then the next frame goes without it
+* emu: the last frame, while the emulated device holds it
 **/
 struct cryptic_desc_ctx {
   __u32 state[SHA256_DIGEST_SIZE / 4];
-  unsigned int count;
+  u64 count;
   u8 buf[CRYPTIC_BUF_LEN];
   unsigned int buflen;
-  /* Fallback */
-  
+  unsigned int op;
+  unsigned int offset;
+  int status;
+  unsigned int frame_op;
+  unsigned int frame_buflen;
+  unsigned int frame_chunk;
+  unsigned int frame_len;
+  ktime_t frame_sent;
+  u64 chain;
+#ifdef FAKE_HARDWARE
+  struct cryptic_emu_job emu;
+#endif
+  /* Fallback: the descriptor must be the last member, its context follows it */
   unsigned int use_fallback;
   struct shash_desc fallback;
 };
 
+/** Exported state
+* state, count, buf, buflen: as in the request context, enough to resume the hash on any request.
+* When the software fallback is in use, its own exported state is stored here instead.
+**/
+struct cryptic_sha256_state {
+  __u32 state[SHA256_DIGEST_SIZE / 4];
+  u64 count;
+  u32 buflen;
+  u8 buf[CRYPTIC_BUF_LEN];
+};
+
+/** Level of a Merkle tree being built: the block of child digests filling up, hashed as they come
+* state: SHA-256 state of the block, over the pairs of digests received
+* tail: the last digest when their number is odd, it waits for the next one to make a SHA-256 block
+* digests: digests in the block
+* blocks: blocks of the level already hashed into the level above
+**/
+struct cryptic_merkle_level {
+  u32 state[SHA256_DIGEST_SIZE / 4];
+  u8 tail[SHA256_DIGEST_SIZE];
+  u32 digests;
+  u32 blocks;
+};
+
+/** Merkle tree, as fs-verity builds it without salt: the data is cut into leaves of leaf_size bytes, the last
+* one zero-padded, each hashed with SHA-256. The digests of a level are grouped into blocks of leaf_size bytes,
+* the last one zero-padded, and each block is hashed into the level above, up to the level of a single digest:
+* the root. A single leaf is its own root, no data gives an all-zero root.
+* Only the blocks being filled are kept, so that the state can be exported.
+* leaf: SHA-256 state of the leaf being filled, leaf_len bytes long
+* count: bytes of data
+* levels: the levels above the leaves, from the bottom
+**/
+struct cryptic_merkle {
+  struct sha256_state leaf;
+  u32 leaf_size;
+  u32 leaf_len;
+  u64 count;
+  struct cryptic_merkle_level levels[CRYPTIC_MERKLE_LEVELS];
+};
+
+/* Request context of merkle-sha256: the tree is also the exported state */
+struct cryptic_merkle_req {
+  struct cryptic_merkle tree;
+  unsigned int op;
+  struct ahash_request* req;
+  struct work_struct work;    /* serves the request on the merkle workers */
+};
+
+/** Working memory to hash the leaves of a tree a round at a time
+* data: size bytes, whole leaves
+* msgs, digests: one per leaf of a round
+**/
+struct cryptic_merkle_buf {
+  u8* data;
+  size_t size;
+  unsigned int leaves;
+  struct cryptic_batch_msg* msgs;
+  u8* digests;
+};
+
 /* Function prototypes */
-//static int cryptic_cra_sha256_init(struct crypto_shash *tfm);
-//static void cryptic_cra_sha256_exit(struct crypto_shash* tfm);
+//static int cryptic_cra_sha256_init(struct crypto_tfm *tfm);
+//static void cryptic_cra_sha256_exit(struct crypto_tfm* tfm);
 //static int cryptic_submit_request(struct cryptic_desc_ctx* desc, struct cryptpb* cryptdata);
-//static int cryptic_sha_update(struct shash_desc* desc, const u8* data, unsigned int len);
-//static int cryptic_sha_final(struct shash_desc* desc, u8* out);
-//static int cryptic_sha_init(struct shash_desc* desc);
+//static int cryptic_sha_update(struct ahash_request* req);
+//static int cryptic_sha_final(struct ahash_request* req);
+//static int cryptic_sha_init(struct ahash_request* req);
+int cryptic_sha256_batch(struct cryptic_batch_msg* msgs, unsigned int count);
 int cryptic_sha256_register(void);
 int cryptic_sha256_unregister(void);
 #endif
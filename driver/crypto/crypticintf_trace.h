@@ -0,0 +1,91 @@
+/*
+  Tracepoints of the hash interface, see Documentation/trace/events.rst. They cost a branch when
+  tracing is off, enable them with e.g. echo 1 > /sys/kernel/tracing/events/cryptic/enable
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cryptic
+
+#if !defined(CRYPTIC_INTERFACE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define CRYPTIC_INTERFACE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* A frame of a request was sent to the device, count is the message length hashed so far */
+TRACE_EVENT(cryptic_submit,
+  TP_PROTO(const void* req, unsigned int len, u64 count),
+  TP_ARGS(req, len, count),
+  TP_STRUCT__entry(
+    __field(const void*, req)
+    __field(unsigned int, len)
+    __field(u64, count)
+  ),
+  TP_fast_assign(
+    __entry->req = req;
+    __entry->len = len;
+    __entry->count = count;
+  ),
+  TP_printk("req=%p len=%u count=%llu", __entry->req, __entry->len, (unsigned long long) __entry->count)
+);
+
+/* The device answered a frame of a request, or failed it when status is negative */
+TRACE_EVENT(cryptic_complete,
+  TP_PROTO(const void* req, unsigned int len, int status, s64 latency_ns),
+  TP_ARGS(req, len, status, latency_ns),
+  TP_STRUCT__entry(
+    __field(const void*, req)
+    __field(unsigned int, len)
+    __field(int, status)
+    __field(s64, latency_ns)
+  ),
+  TP_fast_assign(
+    __entry->req = req;
+    __entry->len = len;
+    __entry->status = status;
+    __entry->latency_ns = latency_ns;
+  ),
+  TP_printk("req=%p len=%u status=%d latency_ns=%lld", __entry->req, __entry->len, __entry->status,
+            (long long) __entry->latency_ns)
+);
+
+/* The software fallback hashed len bytes of a request */
+TRACE_EVENT(cryptic_fallback,
+  TP_PROTO(const void* req, unsigned int len, s64 latency_ns),
+  TP_ARGS(req, len, latency_ns),
+  TP_STRUCT__entry(
+    __field(const void*, req)
+    __field(unsigned int, len)
+    __field(s64, latency_ns)
+  ),
+  TP_fast_assign(
+    __entry->req = req;
+    __entry->len = len;
+    __entry->latency_ns = latency_ns;
+  ),
+  TP_printk("req=%p len=%u latency_ns=%lld", __entry->req, __entry->len, (long long) __entry->latency_ns)
+);
+
+/* The device failed a request, recovered tells whether the fallback took over */
+TRACE_EVENT(cryptic_error,
+  TP_PROTO(const void* req, int status, bool recovered),
+  TP_ARGS(req, status, recovered),
+  TP_STRUCT__entry(
+    __field(const void*, req)
+    __field(int, status)
+    __field(bool, recovered)
+  ),
+  TP_fast_assign(
+    __entry->req = req;
+    __entry->status = status;
+    __entry->recovered = recovered;
+  ),
+  TP_printk("req=%p status=%d recovered=%d", __entry->req, __entry->status, __entry->recovered)
+);
+
+#endif //CRYPTIC_INTERFACE_TRACE_H
+
+/* Out of tree: the header is found through the include path set in the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE crypticintf_trace
+#include <trace/define_trace.h>
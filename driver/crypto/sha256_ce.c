@@ -0,0 +1,86 @@
+/*
+  Single-stream SHA-256 with the ARMv8 SHA2 instructions. sha256h and sha256h2 run four rounds on the
+  two halves of the state, sha256su0 and sha256su1 roll the message schedule forward four words at a
+  time. Compiled with the crypto extensions enabled; it must run between kernel_neon_begin and
+  kernel_neon_end.
+*/
+#include "sha256_mb.h"
+#include <asm/neon-intrinsics.h>
+
+static const u32 ce_k[64] = {
+  0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+  0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+  0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+  0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+  0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+  0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+  0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+  0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+/* Four rounds on message words w, 4 * i to 4 * i + 3 */
+#define CE_ROUNDS4(w, i)                          \
+  do {                                            \
+    wk = vaddq_u32((w), vld1q_u32(&ce_k[4 * (i)])); \
+    tmp = abcd;                                   \
+    abcd = vsha256hq_u32(abcd, efgh, wk);         \
+    efgh = vsha256h2q_u32(efgh, tmp, wk);         \
+  } while (0)
+
+/* Next four words of the schedule, from the sixteen before them */
+#define CE_SCHEDULE(w0, w1, w2, w3) \
+  (w0) = vsha256su1q_u32(vsha256su0q_u32((w0), (w1)), (w2), (w3))
+
+void sha256_ce_blocks(u32 state[8], const u8* data, unsigned int blocks)
+{
+  uint32x4_t abcd, efgh, abcd_save, efgh_save, w0, w1, w2, w3, wk, tmp;
+  unsigned int n;
+
+  abcd = vld1q_u32(state);
+  efgh = vld1q_u32(state + 4);
+
+  for (n = 0; n < blocks; ++n, data += SHA256_MB_BLOCK_SIZE) {
+    abcd_save = abcd;
+    efgh_save = efgh;
+
+    w0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+    w1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+    w2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+    w3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+    CE_ROUNDS4(w0, 0);
+    CE_ROUNDS4(w1, 1);
+    CE_ROUNDS4(w2, 2);
+    CE_ROUNDS4(w3, 3);
+    CE_SCHEDULE(w0, w1, w2, w3);
+    CE_ROUNDS4(w0, 4);
+    CE_SCHEDULE(w1, w2, w3, w0);
+    CE_ROUNDS4(w1, 5);
+    CE_SCHEDULE(w2, w3, w0, w1);
+    CE_ROUNDS4(w2, 6);
+    CE_SCHEDULE(w3, w0, w1, w2);
+    CE_ROUNDS4(w3, 7);
+    CE_SCHEDULE(w0, w1, w2, w3);
+    CE_ROUNDS4(w0, 8);
+    CE_SCHEDULE(w1, w2, w3, w0);
+    CE_ROUNDS4(w1, 9);
+    CE_SCHEDULE(w2, w3, w0, w1);
+    CE_ROUNDS4(w2, 10);
+    CE_SCHEDULE(w3, w0, w1, w2);
+    CE_ROUNDS4(w3, 11);
+    CE_SCHEDULE(w0, w1, w2, w3);
+    CE_ROUNDS4(w0, 12);
+    CE_SCHEDULE(w1, w2, w3, w0);
+    CE_ROUNDS4(w1, 13);
+    CE_SCHEDULE(w2, w3, w0, w1);
+    CE_ROUNDS4(w2, 14);
+    CE_SCHEDULE(w3, w0, w1, w2);
+    CE_ROUNDS4(w3, 15);
+
+    abcd = vaddq_u32(abcd, abcd_save);
+    efgh = vaddq_u32(efgh, efgh_save);
+  }
+
+  vst1q_u32(state, abcd);
+  vst1q_u32(state + 4, efgh);
+}
@@ -0,0 +1,36 @@
+/*
+  Multi-buffer SHA-256: the compression function of up to SHA256_MB_MAX_LANES independent messages
+  runs at once, one message per vector lane. Single-stream kernels use the SHA instructions of the
+  CPU on one message. Used by the emulated device (softwareHash.c), which picks the kernels the CPU
+  supports when it is loaded.
+*/
+#ifndef SHA256_MB_H
+#define SHA256_MB_H
+
+#include <linux/types.h>
+#include <linux/string.h>
+#include <asm/byteorder.h>
+
+#define SHA256_MB_MAX_LANES 16
+#define SHA256_MB_BLOCK_SIZE 64
+
+/**
+ * Lane kernel: hash blocks 64-byte blocks of message in each lane, lane l reading from data[l] and
+ * going on from the state in column l of state, where row i holds word i of every lane. Every lane
+ * the kernel handles must point to data, even when its result is not needed. The vector kernels
+ * must run between kernel_fpu_begin and kernel_fpu_end.
+ **/
+typedef void (*sha256_mb_fn)(u32 state[8][SHA256_MB_MAX_LANES], const u8* data[SHA256_MB_MAX_LANES],
+                             unsigned int blocks);
+
+void sha256_mb_avx2(u32 state[8][SHA256_MB_MAX_LANES], const u8* data[SHA256_MB_MAX_LANES], unsigned int blocks);
+void sha256_mb_avx512(u32 state[8][SHA256_MB_MAX_LANES], const u8* data[SHA256_MB_MAX_LANES], unsigned int blocks);
+
+/**
+ * Single-stream kernels: hash blocks 64-byte blocks of data going on from state. They must run between
+ * kernel_fpu_begin and kernel_fpu_end (x86) or kernel_neon_begin and kernel_neon_end (arm64).
+ **/
+void sha256_ni_blocks(u32 state[8], const u8* data, unsigned int blocks);
+void sha256_ce_blocks(u32 state[8], const u8* data, unsigned int blocks);
+
+#endif
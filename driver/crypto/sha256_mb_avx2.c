@@ -0,0 +1,4 @@
+/* Multi-buffer SHA-256 over the 8 lanes of AVX2 registers */
+#define SHA256_MB_LANES 8
+#define SHA256_MB_NAME sha256_mb_avx2
+#include "sha256_mb_lanes.h"
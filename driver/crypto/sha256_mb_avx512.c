@@ -0,0 +1,4 @@
+/* Multi-buffer SHA-256 over the 16 lanes of AVX-512 registers */
+#define SHA256_MB_LANES 16
+#define SHA256_MB_NAME sha256_mb_avx512
+#include "sha256_mb_lanes.h"
@@ -0,0 +1,101 @@
+/*
+  Lane kernel of the multi-buffer SHA-256, included once per vector width with SHA256_MB_LANES and
+  SHA256_MB_NAME defined. Word i of the state, and of the message schedule, of every lane sits in one
+  vector, so each operation of the compression function runs on all the lanes at once. It is written
+  with the GCC vector extensions and compiled with the instruction set of its width.
+*/
+#include "sha256_mb.h"
+
+typedef u32 sha256_mb_vec __attribute__((vector_size(SHA256_MB_LANES * sizeof(u32))));
+
+#define MB_ROTRIGHT(a,b) (((a) >> (b)) | ((a) << (32-(b))))
+#define MB_CH(x,y,z) (((x) & (y)) ^ (~(x) & (z)))
+#define MB_MAJ(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define MB_EP0(x) (MB_ROTRIGHT(x,2) ^ MB_ROTRIGHT(x,13) ^ MB_ROTRIGHT(x,22))
+#define MB_EP1(x) (MB_ROTRIGHT(x,6) ^ MB_ROTRIGHT(x,11) ^ MB_ROTRIGHT(x,25))
+#define MB_SIG0(x) (MB_ROTRIGHT(x,7) ^ MB_ROTRIGHT(x,18) ^ ((x) >> 3))
+#define MB_SIG1(x) (MB_ROTRIGHT(x,17) ^ MB_ROTRIGHT(x,19) ^ ((x) >> 10))
+
+/* Round i, with the working variables rotated by the caller instead of moved. From round 16 on,
+   the 16-word schedule is rolled forward in place */
+#define MB_ROUND(a,b,c,d,e,f,g,h,i)                                                              \
+  do {                                                                                          \
+    if ((i) >= 16)                                                                              \
+      w[(i) & 15] += MB_SIG1(w[((i) - 2) & 15]) + w[((i) - 7) & 15] + MB_SIG0(w[((i) - 15) & 15]); \
+    t1 = h + MB_EP1(e) + MB_CH(e,f,g) + mb_k[i] + w[(i) & 15];                                  \
+    d += t1;                                                                                    \
+    h = t1 + MB_EP0(a) + MB_MAJ(a,b,c);                                                         \
+  } while (0)
+
+#define MB_ROUNDS8(i)                       \
+  do {                                      \
+    MB_ROUND(a,b,c,d,e,f,g,h,(i) + 0);      \
+    MB_ROUND(h,a,b,c,d,e,f,g,(i) + 1);      \
+    MB_ROUND(g,h,a,b,c,d,e,f,(i) + 2);      \
+    MB_ROUND(f,g,h,a,b,c,d,e,(i) + 3);      \
+    MB_ROUND(e,f,g,h,a,b,c,d,(i) + 4);      \
+    MB_ROUND(d,e,f,g,h,a,b,c,(i) + 5);      \
+    MB_ROUND(c,d,e,f,g,h,a,b,(i) + 6);      \
+    MB_ROUND(b,c,d,e,f,g,h,a,(i) + 7);      \
+  } while (0)
+
+static const u32 mb_k[64] = {
+  0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+  0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+  0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+  0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+  0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+  0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+  0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+  0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+void SHA256_MB_NAME(u32 state[8][SHA256_MB_MAX_LANES], const u8* data[SHA256_MB_MAX_LANES], unsigned int blocks)
+{
+  sha256_mb_vec s[8], w[16], a, b, c, d, e, f, g, h, t1;
+  unsigned int i, l, n;
+  __be32 word;
+
+  for (i = 0; i < 8; ++i)
+    memcpy(&s[i], state[i], sizeof(s[i]));
+
+  for (n = 0; n < blocks; ++n) {
+    /* Transpose the blocks: word i of every lane goes to w[i] */
+    for (i = 0; i < 16; ++i) {
+      for (l = 0; l < SHA256_MB_LANES; ++l) {
+        memcpy(&word, data[l] + n * SHA256_MB_BLOCK_SIZE + 4 * i, sizeof(word));
+        w[i][l] = be32_to_cpu(word);
+      }
+    }
+
+    a = s[0];
+    b = s[1];
+    c = s[2];
+    d = s[3];
+    e = s[4];
+    f = s[5];
+    g = s[6];
+    h = s[7];
+
+    MB_ROUNDS8(0);
+    MB_ROUNDS8(8);
+    MB_ROUNDS8(16);
+    MB_ROUNDS8(24);
+    MB_ROUNDS8(32);
+    MB_ROUNDS8(40);
+    MB_ROUNDS8(48);
+    MB_ROUNDS8(56);
+
+    s[0] += a;
+    s[1] += b;
+    s[2] += c;
+    s[3] += d;
+    s[4] += e;
+    s[5] += f;
+    s[6] += g;
+    s[7] += h;
+  }
+
+  for (i = 0; i < 8; ++i)
+    memcpy(state[i], &s[i], sizeof(s[i]));
+}
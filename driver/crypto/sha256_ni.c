@@ -0,0 +1,108 @@
+/*
+  Single-stream SHA-256 with the x86 SHA extensions. Each sha256rnds2 runs two rounds, on the state
+  split in the ABEF and CDGH halves the instruction expects, and sha256msg1/sha256msg2 roll the
+  message schedule forward four words at a time. Written with the compiler builtins, which GCC and
+  clang share, and compiled with -msha; it must run between kernel_fpu_begin and kernel_fpu_end.
+*/
+#include "sha256_mb.h"
+
+typedef int sha256_ni_v4si __attribute__((vector_size(16)));
+typedef short sha256_ni_v8hi __attribute__((vector_size(16)));
+typedef char sha256_ni_v16qi __attribute__((vector_size(16)));
+
+static const u32 ni_k[64] __attribute__((aligned(16))) = {
+  0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+  0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+  0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+  0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+  0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+  0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+  0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+  0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+/* Words 1 to 4 of the eight in lo then hi, like palignr by 4 bytes */
+static inline sha256_ni_v4si ni_align4(sha256_ni_v4si hi, sha256_ni_v4si lo)
+{
+  return __builtin_ia32_pshufd((sha256_ni_v4si) __builtin_ia32_pblendw128((sha256_ni_v8hi) lo, (sha256_ni_v8hi) hi, 0x03),
+                               0x39);
+}
+
+/* Four rounds on message words w, 4 * i to 4 * i + 3 */
+#define NI_ROUNDS4(w, i)                                                        \
+  do {                                                                          \
+    memcpy(&k, &ni_k[4 * (i)], sizeof(k));                                      \
+    k += (w);                                                                   \
+    cdgh = __builtin_ia32_sha256rnds2(cdgh, abef, k);                           \
+    abef = __builtin_ia32_sha256rnds2(abef, cdgh, __builtin_ia32_pshufd(k, 0x0e)); \
+  } while (0)
+
+/* Next four words of the schedule, from the sixteen before them */
+#define NI_SCHEDULE(w0, w1, w2, w3) \
+  (w0) = __builtin_ia32_sha256msg2(__builtin_ia32_sha256msg1((w0), (w1)) + ni_align4((w3), (w2)), (w3))
+
+void sha256_ni_blocks(u32 state[8], const u8* data, unsigned int blocks)
+{
+  const sha256_ni_v16qi bswap = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12};
+  sha256_ni_v4si abef, cdgh, abef_save, cdgh_save, w0, w1, w2, w3, k;
+  unsigned int n;
+
+  /* The rounds work on the state in the order the instruction expects, lowest word first */
+  abef = (sha256_ni_v4si) {state[5], state[4], state[1], state[0]};
+  cdgh = (sha256_ni_v4si) {state[7], state[6], state[3], state[2]};
+
+  for (n = 0; n < blocks; ++n, data += SHA256_MB_BLOCK_SIZE) {
+    abef_save = abef;
+    cdgh_save = cdgh;
+
+    memcpy(&w0, data, sizeof(w0));
+    memcpy(&w1, data + 16, sizeof(w1));
+    memcpy(&w2, data + 32, sizeof(w2));
+    memcpy(&w3, data + 48, sizeof(w3));
+    w0 = (sha256_ni_v4si) __builtin_ia32_pshufb128((sha256_ni_v16qi) w0, bswap);
+    w1 = (sha256_ni_v4si) __builtin_ia32_pshufb128((sha256_ni_v16qi) w1, bswap);
+    w2 = (sha256_ni_v4si) __builtin_ia32_pshufb128((sha256_ni_v16qi) w2, bswap);
+    w3 = (sha256_ni_v4si) __builtin_ia32_pshufb128((sha256_ni_v16qi) w3, bswap);
+
+    NI_ROUNDS4(w0, 0);
+    NI_ROUNDS4(w1, 1);
+    NI_ROUNDS4(w2, 2);
+    NI_ROUNDS4(w3, 3);
+    NI_SCHEDULE(w0, w1, w2, w3);
+    NI_ROUNDS4(w0, 4);
+    NI_SCHEDULE(w1, w2, w3, w0);
+    NI_ROUNDS4(w1, 5);
+    NI_SCHEDULE(w2, w3, w0, w1);
+    NI_ROUNDS4(w2, 6);
+    NI_SCHEDULE(w3, w0, w1, w2);
+    NI_ROUNDS4(w3, 7);
+    NI_SCHEDULE(w0, w1, w2, w3);
+    NI_ROUNDS4(w0, 8);
+    NI_SCHEDULE(w1, w2, w3, w0);
+    NI_ROUNDS4(w1, 9);
+    NI_SCHEDULE(w2, w3, w0, w1);
+    NI_ROUNDS4(w2, 10);
+    NI_SCHEDULE(w3, w0, w1, w2);
+    NI_ROUNDS4(w3, 11);
+    NI_SCHEDULE(w0, w1, w2, w3);
+    NI_ROUNDS4(w0, 12);
+    NI_SCHEDULE(w1, w2, w3, w0);
+    NI_ROUNDS4(w1, 13);
+    NI_SCHEDULE(w2, w3, w0, w1);
+    NI_ROUNDS4(w2, 14);
+    NI_SCHEDULE(w3, w0, w1, w2);
+    NI_ROUNDS4(w3, 15);
+
+    abef += abef_save;
+    cdgh += cdgh_save;
+  }
+
+  state[0] = abef[3];
+  state[1] = abef[2];
+  state[4] = abef[1];
+  state[5] = abef[0];
+  state[2] = cdgh[3];
+  state[3] = cdgh[2];
+  state[6] = cdgh[1];
+  state[7] = cdgh[0];
+}
@@ -1,11 +1,22 @@
 #include "softwareHash.h"
+#include "sha256_mb.h"
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#if defined(CONFIG_X86_64)
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#elif defined(CONFIG_ARM64)
+#include <asm/cpufeature.h>
+#include <asm/neon.h>
+#endif
 
 typedef u8 byte;
 
 #define SHA256_BLOCK_SIZE 64
 #define SHA256_DIGEST_SIZE 32
-#define CRYPTIC_N_BLOCKS 2
-#define CRYPTIC_BUF_LEN SHA256_BLOCK_SIZE*CRYPTIC_N_BLOCKS
 
 /**************************** DATA TYPES ****************************/
 typedef byte BYTE;             // 8-bit byte
@@ -18,13 +29,17 @@ typedef struct {
   WORD state[8];
 } SHA256_CTX;
 
+/* HASH frame: header, parameters, then len bytes of message */
 typedef struct cryptpb {
-  u8 message[CRYPTIC_BUF_LEN];
+  u8 magic;
+  u8 version;
+  u8 opcode;
+  u8 flags;
+  u32 seq;
+  u32 frame_len;
   u8 in_partial_digest[SHA256_DIGEST_SIZE];
   u32 len;
-  u8 finalize;
-  u32 bitlen;
-  u8 digest[SHA256_DIGEST_SIZE];
+  u8 message[];
 } CryptICData;
 
 
@@ -51,7 +66,7 @@ static const WORD k[64] = {
 };
 
 /*********************** FUNCTION DEFINITIONS ***********************/
-void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+static void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 {
   WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
 
@@ -96,135 +111,321 @@ void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
   ctx->state[7] += h;
 }
 
-void sha256_init(SHA256_CTX *ctx,BYTE in_partial_digest[])
+/* Backends ******************************************************************/
+/* Whole blocks of one message, hashed in place */
+typedef void (*sha256_blocks_fn)(u32 state[8], const u8* data, unsigned int blocks);
+
+static void sha256_blocks_generic(u32 state[8], const u8* data, unsigned int blocks)
 {
-  ctx->datalen = 0;
-  ctx->bitlen = 0;
-  //ctx->state[0] = 0x6a09e667;
-  //ctx->state[1] = 0xbb67ae85;
-  //ctx->state[2] = 0x3c6ef372;
-  //ctx->state[3] = 0xa54ff53a;
-  //ctx->state[4] = 0x510e527f;
-  //ctx->state[5] = 0x9b05688c;
-  //ctx->state[6] = 0x1f83d9ab;
-  //ctx->state[7] = 0x5be0cd19;
-  memcpy(ctx->state, in_partial_digest, SHA256_DIGEST_SIZE);
+  SHA256_CTX ctx;
+  unsigned int i;
+
+  memcpy(ctx.state, state, sizeof(ctx.state));
+  for (i = 0; i < blocks; ++i)
+    sha256_transform(&ctx, data + i * SHA256_BLOCK_SIZE);
+  memcpy(state, ctx.state, sizeof(ctx.state));
 }
 
-void sha256_main_loop(SHA256_CTX *ctx, const BYTE data[], size_t len)
-{
-  int i;
-    //main loop
-  for (i = 0; i < len; ++i) {
-    ctx->data[ctx->datalen] = data[i];
-    ctx->datalen++;
-    if (ctx->datalen == 64) {
-      sha256_transform(ctx, ctx->data);
-      ctx->bitlen += 512;
-      ctx->datalen = 0;
-    }
-  }
-  pr_info("main loop terminated with datalen = %d", ctx->datalen);
+/* Vector registers are only usable in the kernel between these */
+#if defined(CONFIG_X86_64)
+#define emu_simd_begin() kernel_fpu_begin()
+#define emu_simd_end() kernel_fpu_end()
+#elif defined(CONFIG_ARM64)
+#define emu_simd_begin() kernel_neon_begin()
+#define emu_simd_end() kernel_neon_end()
+#else
+#define emu_simd_begin() do { } while (0)
+#define emu_simd_end() do { } while (0)
+#endif
+
+#define EMU_MAX_WORKERS 16
+/* Most blocks hashed in one go, the vector code runs with preemption disabled */
+#define EMU_BATCH_BLOCKS 64
+#define EMU_CALIBRATE_RUNS 8
+
+static unsigned int workers = 4;
+module_param(workers, uint, 0444);
+MODULE_PARM_DESC(workers, "Workers of the emulated device, each one hashes a frame per lane");
+
+static bool simd = true;
+module_param(simd, bool, 0444);
+MODULE_PARM_DESC(simd, "Use the SHA instructions and the AVX2 or AVX-512 lanes when the CPU has them");
+
+static struct {
+  spinlock_t lock;
+  struct list_head queue;         /* frames waiting for a lane */
+  struct workqueue_struct* wq;
+  struct work_struct work[EMU_MAX_WORKERS];
+  unsigned int n_workers;
+  atomic_t submitted;             /* frames submitted so far, to choose the worker to kick */
+  sha256_blocks_fn single;        /* one frame at a time */
+  bool single_simd;               /* single uses vector registers */
+  const char* single_name;
+  sha256_mb_fn kernel;            /* vector lane kernel, NULL if none pays off */
+  const char* kernel_name;
+  unsigned int lanes;             /* frames a worker holds, those of kernel */
+  unsigned int kernel_min;        /* frames from which kernel beats single */
+} emu;
+
+static void cryptic_emu_single(u32 state[8], const u8* data, unsigned int blocks){
+  if (emu.single_simd)
+    emu_simd_begin();
+  emu.single(state, data, blocks);
+  if (emu.single_simd)
+    emu_simd_end();
 }
 
-void sha256_final(SHA256_CTX *ctx, BYTE hash[], u32 bitlen)
-{
-  WORD i;
-  int ii;
-  i = ctx->datalen;
-
-  // Pad whatever data is left in the buffer.
-  if (ctx->datalen < 56) {
-    ctx->data[i++] = 0x80;
-    while (i < 56)
-      ctx->data[i++] = 0x00;
-  }
-  else {
-    ctx->data[i++] = 0x80;
-    while (i < 64)
-      ctx->data[i++] = 0x00;
-    sha256_transform(ctx, ctx->data);
-    //memset(ctx->data, 0, 56);
-    for (ii = 0; ii < 56; ii++)
-    {
-      ctx->data[ii] = 0x0;
+static void cryptic_emu_lanes(u32 state[8][SHA256_MB_MAX_LANES], const u8* data[SHA256_MB_MAX_LANES],
+                              unsigned int blocks){
+  emu_simd_begin();
+  emu.kernel(state, data, blocks);
+  emu_simd_end();
+}
+
+/* Multi-buffer engine *******************************************************/
+/*
+  Frames submitted by the driver wait in a queue, workers take as many of them as there are lanes and
+  run them through the compression function together, one frame per lane. A lane whose frame is done
+  takes the next one waiting, so frames of different lengths keep the lanes busy. Nothing waits for
+  the lanes to fill: a worker starts with whatever is queued, batches grow with the load. The lane
+  kernel costs the same however many lanes are in use, so with few frames the worker hashes them one
+  after the other with the single-stream code instead.
+*/
+static void cryptic_emu_work(struct work_struct* work){
+  struct cryptic_emu_job* lane[SHA256_MB_MAX_LANES] = {NULL};
+  u32 state[8][SHA256_MB_MAX_LANES];
+  const u8* data[SHA256_MB_MAX_LANES];
+  struct cryptic_emu_job* job;
+  unsigned int active = 0, first = 0, blocks, i, j;
+  u32 column[8];
+
+  for (;;) {
+    /* Free lanes take the next frames waiting */
+    spin_lock_bh(&emu.lock);
+    for (i = 0; i < emu.lanes && !list_empty(&emu.queue); i++) {
+      if (lane[i] != NULL)
+        continue;
+      job = list_first_entry(&emu.queue, struct cryptic_emu_job, node);
+      list_del(&job->node);
+      lane[i] = job;
+      for (j = 0; j < 8; j++)
+        state[j][i] = job->state[j];
+      active++;
+    }
+    spin_unlock_bh(&emu.lock);
+    if (active == 0)
+      return;
+
+    /* Every lane goes on for as many blocks as the shortest frame has left, lanes without a frame
+       hash the data of another one */
+    blocks = EMU_BATCH_BLOCKS;
+    for (i = 0; i < emu.lanes; i++) {
+      if (lane[i] != NULL) {
+        first = i;
+        blocks = min(blocks, lane[i]->blocks);
+      }
+    }
+    for (i = 0; i < emu.lanes; i++)
+      data[i] = (lane[i] != NULL) ? lane[i]->data : lane[first]->data;
+    if (blocks > 0 && active >= emu.kernel_min) {
+      cryptic_emu_lanes(state, data, blocks);
+    } else if (blocks > 0) {
+      for (i = 0; i < emu.lanes; i++) {
+        if (lane[i] == NULL)
+          continue;
+        for (j = 0; j < 8; j++)
+          column[j] = state[j][i];
+        cryptic_emu_single(column, data[i], blocks);
+        for (j = 0; j < 8; j++)
+          state[j][i] = column[j];
+      }
     }
-  }
 
-  // Append to the padding the total message's length in bits and transform.
-  //ctx->bitlen += ctx->datalen * 8;
-  ctx->bitlen = bitlen;
-  ctx->data[63] = ctx->bitlen;
-  ctx->data[62] = ctx->bitlen >> 8;
-  ctx->data[61] = ctx->bitlen >> 16;
-  ctx->data[60] = ctx->bitlen >> 24;
-  ctx->data[59] = ctx->bitlen >> 32;
-  ctx->data[58] = ctx->bitlen >> 40;
-  ctx->data[57] = ctx->bitlen >> 48;
-  ctx->data[56] = ctx->bitlen >> 56;
-  sha256_transform(ctx, ctx->data);
-
-  // Since this implementation uses little endian byte ordering and SHA uses big endian,
-  // reverse all the bytes when copying the final state to the output hash.
-  for (i = 0; i < 4; ++i) {
-    hash[i]      = (ctx->state[0] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 4]  = (ctx->state[1] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 8]  = (ctx->state[2] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 12] = (ctx->state[3] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 16] = (ctx->state[4] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 20] = (ctx->state[5] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 24] = (ctx->state[6] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 28] = (ctx->state[7] >> (24 - i * 8)) & 0x000000ff;
+    /* Frames done go back to the driver */
+    for (i = 0; i < emu.lanes; i++) {
+      job = lane[i];
+      if (job == NULL)
+        continue;
+      job->data += blocks * SHA256_BLOCK_SIZE;
+      job->blocks -= blocks;
+      if (job->blocks > 0)
+        continue;
+      for (j = 0; j < 8; j++)
+        job->state[j] = state[j][i];
+      memcpy(job->digest, job->state, SHA256_DIGEST_SIZE);
+      lane[i] = NULL;
+      active--;
+      job->done(job->context, 0);
+    }
+    cond_resched();
   }
 }
 
-void sha256(SHA256_CTX *ctx, const BYTE data[], size_t len, BYTE hash[], BYTE in_partial_digest[], u8 finalize, u32 bitlen)
-{
-  int i;
-  pr_info("Starting with partial:");
-  for (i=0; i<32; i++)
-	pr_info("%x",in_partial_digest[i]);
+/* Queue a job for the workers */
+static void cryptic_emu_queue(struct cryptic_emu_job* job){
+  unsigned int n;
 
-  sha256_init(ctx,in_partial_digest);
+  spin_lock_bh(&emu.lock);
+  list_add_tail(&job->node, &emu.queue);
+  spin_unlock_bh(&emu.lock);
+  /* Consecutive frames kick the same worker until there are enough for the lane kernel to pay off,
+     otherwise they spread over the workers */
+  n = (unsigned int) atomic_inc_return(&emu.submitted) - 1;
+  queue_work(emu.wq, &emu.work[n / emu.kernel_min % emu.n_workers]);
+}
 
-    sha256_main_loop(ctx, data, len);
+/**
+ * cryptic_emu_submit: hand a HASH frame to the emulated device, which writes the updated state to
+ * digest and calls done from one of its workers. The frame is hashed in place.
+ **/
+int cryptic_emu_submit(struct cryptic_emu_job* job, u8* serialData, u8* digest, cryptic_emu_done_t done, void* context){
+  CryptICData* data = (CryptICData*) serialData;
 
-    if (finalize != 0){
-      sha256_final(ctx, hash, bitlen);
-      pr_info("finalized");
-    }
-    else{
-      memcpy(hash, ctx->state, SHA256_DIGEST_SIZE);
-      pr_info("Exporting partial:");
-      for (i=0; i<32; i++)
-	pr_info("%x",hash[i]);
-      
+  job->frame = serialData;
+  job->digest = digest;
+  job->done = done;
+  job->context = context;
+  memcpy(job->state, data->in_partial_digest, SHA256_DIGEST_SIZE);
+  job->data = data->message;
+  /* The host takes care of the padding, a partial block at the end is left out */
+  job->blocks = data->len / SHA256_BLOCK_SIZE;
+  cryptic_emu_queue(job);
+  return 0;
+}
+
+EXPORT_SYMBOL(cryptic_emu_submit);
+
+/**
+ * cryptic_emu_submit_blocks: hand blocks whole blocks at data to the emulated device, going on from state,
+ * like a message of a BATCH frame. The updated state is written to digest before done is called.
+ **/
+int cryptic_emu_submit_blocks(struct cryptic_emu_job* job, const u32 state[8], const u8* data, unsigned int blocks,
+                              u8* digest, cryptic_emu_done_t done, void* context){
+  job->frame = NULL;
+  job->digest = digest;
+  job->done = done;
+  job->context = context;
+  memcpy(job->state, state, SHA256_DIGEST_SIZE);
+  job->data = data;
+  job->blocks = blocks;
+  cryptic_emu_queue(job);
+  return 0;
+}
+
+EXPORT_SYMBOL(cryptic_emu_submit_blocks);
+
+/* Time of the fastest of a few runs of EMU_BATCH_BLOCKS blocks, in ns */
+static u64 cryptic_emu_time(sha256_blocks_fn single, const u8* buf){
+  u32 state[8][SHA256_MB_MAX_LANES] = {{0}};
+  const u8* data[SHA256_MB_MAX_LANES];
+  u64 best = U64_MAX, start;
+  unsigned int i;
+
+  for (i = 0; i < SHA256_MB_MAX_LANES; i++)
+    data[i] = buf;
+  for (i = 0; i < EMU_CALIBRATE_RUNS; i++) {
+    start = ktime_get_ns();
+    if (single == NULL)
+      cryptic_emu_lanes(state, data, EMU_BATCH_BLOCKS);
+    else if (single == emu.single)
+      cryptic_emu_single(state[0], buf, EMU_BATCH_BLOCKS);
+    else
+      single(state[0], buf, EMU_BATCH_BLOCKS);
+    best = min(best, ktime_get_ns() - start);
+  }
+  return max_t(u64, best, 1);
+}
+
+/* Throughput in MB/s of lanes frames hashed in ns */
+#define EMU_MBPS(lanes, ns) div64_u64((u64) (lanes) * EMU_BATCH_BLOCKS * SHA256_BLOCK_SIZE * 1000, (ns))
+
+/**
+ * cryptic_emu_calibrate: time the backends, like the RAID6 and XOR code do at boot, and find from how
+ * many frames the lane kernel is worth it. It is dropped if it never is.
+ **/
+static void cryptic_emu_calibrate(void){
+  u64 generic, single, lanes;
+  u8* buf;
+
+  buf = kzalloc(EMU_BATCH_BLOCKS * SHA256_BLOCK_SIZE, GFP_KERNEL);
+  if (buf == NULL)
+    return;
+  generic = cryptic_emu_time(sha256_blocks_generic, buf);
+  single = cryptic_emu_time(emu.single, buf);
+  pr_info("cryptIC: emulated device, generic %llu MB/s, %s %llu MB/s\n", EMU_MBPS(1, generic),
+          emu.single_name, EMU_MBPS(1, single));
+  if (emu.kernel != NULL) {
+    lanes = cryptic_emu_time(NULL, buf);
+    emu.kernel_min = div64_u64(lanes, single) + 1;
+    pr_info("cryptIC: emulated device, %s %llu MB/s over %u lanes, from %u frames\n", emu.kernel_name,
+            EMU_MBPS(emu.lanes, lanes), emu.lanes, emu.kernel_min);
+    if (emu.kernel_min > emu.lanes) {
+      emu.kernel = NULL;
+      emu.lanes = 1;
+      emu.kernel_min = 1;
     }
-    
+  }
+  kfree(buf);
 }
 
-/* Arduino code **************************************************************/
-#define PIN_LED 13
-const unsigned rx_data_size = offsetof(CryptICData, digest);
+/* Pick the fastest single-stream code and the widest lane kernel the CPU supports */
+static void cryptic_emu_select(void){
+  emu.single = sha256_blocks_generic;
+  emu.single_simd = false;
+  emu.single_name = "generic";
+  emu.kernel = NULL;
+  emu.kernel_name = "none";
+  emu.lanes = 1;
+  emu.kernel_min = 1;
+  if (!simd)
+    return;
+#if defined(CONFIG_X86_64)
+  if (boot_cpu_has(X86_FEATURE_SHA_NI) && boot_cpu_has(X86_FEATURE_XMM4_1)) {
+    emu.single = sha256_ni_blocks;
+    emu.single_simd = true;
+    emu.single_name = "sha-ni";
+  }
+  if (boot_cpu_has(X86_FEATURE_AVX512F) &&
+      cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM | XFEATURE_MASK_AVX512, NULL)) {
+    emu.kernel = sha256_mb_avx512;
+    emu.kernel_name = "avx512";
+    emu.lanes = 16;
+  } else if (boot_cpu_has(X86_FEATURE_AVX2) && cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL)) {
+    emu.kernel = sha256_mb_avx2;
+    emu.kernel_name = "avx2";
+    emu.lanes = 8;
+  }
+#elif defined(CONFIG_ARM64)
+  if (cpu_have_named_feature(SHA2)) {
+    emu.single = sha256_ce_blocks;
+    emu.single_simd = true;
+    emu.single_name = "arm-ce";
+  }
+#endif
+  cryptic_emu_calibrate();
+}
 
-CryptICData data;
-/*
-void setup() {
-	Serial.begin(9600);
-  Serial.setTimeout(5000);
-  // Pin for status signalling
-  pinMode(PIN_LED, OUTPUT);
+static int __init cryptic_emu_init(void){
+  unsigned int i;
+
+  spin_lock_init(&emu.lock);
+  INIT_LIST_HEAD(&emu.queue);
+  atomic_set(&emu.submitted, 0);
+  emu.n_workers = clamp_t(unsigned int, workers, 1, EMU_MAX_WORKERS);
+  for (i = 0; i < emu.n_workers; i++)
+    INIT_WORK(&emu.work[i], cryptic_emu_work);
+  cryptic_emu_select();
+  emu.wq = alloc_workqueue("cryptic_emu", WQ_UNBOUND, emu.n_workers);
+  if (emu.wq == NULL)
+    return -ENOMEM;
+  pr_info("cryptIC: emulated device on %u workers, single frames with %s, up to %u frames with %s\n",
+          emu.n_workers, emu.single_name, emu.lanes, emu.kernel_name);
+  return 0;
 }
-*/
 
-void runArduino(u8* serialData, u8* digest) {
-  SHA256_CTX ctx;
-  memcpy(&data, serialData, sizeof(CryptICData));
-	//Compute the sha256 of the received string
-  sha256(&ctx, data.message, data.len, data.digest,data.in_partial_digest, data.finalize, data.bitlen);  
-    
-	//Write the result on USB
-  memcpy(digest,data.digest,SHA256_DIGEST_SIZE);
+static void __exit cryptic_emu_exit(void){
+  destroy_workqueue(emu.wq);
 }
 
-EXPORT_SYMBOL(runArduino);
+module_init(cryptic_emu_init);
+module_exit(cryptic_emu_exit);
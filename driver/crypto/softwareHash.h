@@ -2,8 +2,30 @@
 #include <linux/stddef.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/list.h>
 
 MODULE_LICENSE("Dual BSD/GPL");
 
-void runArduino(u8* serialData, u8* digest);
+/* Completion callback of a frame handed to the emulated device, called from its workers */
+typedef void (*cryptic_emu_done_t)(void* context, int status);
 
+/** Frame handed to the emulated device, owned by it until done is called
+* frame: the HASH frame, as received by the device, NULL for blocks handed over on their own. It must
+*        stay around until done is called
+* digest: where the updated state goes
+* state, data, blocks: progress of the frame through the engine
+**/
+struct cryptic_emu_job {
+  struct list_head node;
+  u8* frame;
+  u8* digest;
+  cryptic_emu_done_t done;
+  void* context;
+  u32 state[8];
+  const u8* data;
+  unsigned int blocks;
+};
+
+int cryptic_emu_submit(struct cryptic_emu_job* job, u8* serialData, u8* digest, cryptic_emu_done_t done, void* context);
+int cryptic_emu_submit_blocks(struct cryptic_emu_job* job, const u32 state[8], const u8* data, unsigned int blocks,
+                              u8* digest, cryptic_emu_done_t done, void* context);
@@ -0,0 +1,241 @@
+/*
+  cryptIC benchmark, modeled on the hash speed tests of tcrypt.
+  Messages from 16 bytes to 1 MiB are hashed with a single digest and with smaller updates, by the
+  implementation under test and by a reference one. For each size it reports ops/s, cycles/byte and
+  latency percentiles, and checks that both give the same digest. It only goes through the Crypto API,
+  so the same module measures the FAKE_HARDWARE build and the real device:
+    insmod crypticbench.ko [alg=cryptic-sha256] [ref=sha256-generic] [iters=256] [budget=4194304]
+    dmesg | grep cryptic-bench
+  As with tcrypt, loading fails once the benchmark is over, so the module never stays loaded.
+*/
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/timex.h>
+#include <linux/sort.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/scatterlist.h>
+#include <crypto/hash.h>
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_AUTHOR("cryptic");
+
+/* Defines */
+#define BENCH_MIN_LEN 16
+#define BENCH_MAX_LEN (1 << 20)
+#define BENCH_PAGES (BENCH_MAX_LEN / PAGE_SIZE)
+#define BENCH_MAX_DIGEST 64
+/* Updates smaller than this fraction of the message are not worth timing */
+#define BENCH_MAX_UPDATES 4096
+
+/* Parameters */
+static char* alg = "cryptic-sha256";
+module_param(alg, charp, 0444);
+MODULE_PARM_DESC(alg, "Driver name of the implementation under test");
+
+static char* ref = "sha256-generic";
+module_param(ref, charp, 0444);
+MODULE_PARM_DESC(ref, "Driver name of the reference implementation, empty to skip it");
+
+static unsigned int iters = 256;
+module_param(iters, uint, 0444);
+MODULE_PARM_DESC(iters, "Largest number of operations timed for each size");
+
+static unsigned long budget = 4 << 20;
+module_param(budget, ulong, 0444);
+MODULE_PARM_DESC(budget, "Bytes hashed for each size, fewer operations are timed for large messages");
+
+/* Types */
+struct bench_tfm {
+  const char* name;
+  struct crypto_ahash* tfm;
+  struct ahash_request* req;
+  struct crypto_wait wait;
+};
+
+/* Globals */
+static unsigned long pages[BENCH_PAGES];
+static struct scatterlist* sg;
+static u64* latency;
+
+/**
+ * bench_op: hash blen bytes, in a single digest or in updates of plen bytes. Like tcrypt, every update
+ * hashes the first plen bytes of the message again.
+ **/
+static int bench_op(struct bench_tfm* b, unsigned int blen, unsigned int plen, u8* out){
+  unsigned int done;
+  int ret;
+
+  ahash_request_set_crypt(b->req, sg, out, plen);
+  if (plen == blen)
+    return crypto_wait_req(crypto_ahash_digest(b->req), &b->wait);
+
+  ret = crypto_wait_req(crypto_ahash_init(b->req), &b->wait);
+  for (done = 0; ret == 0 && done < blen; done += plen)
+    ret = crypto_wait_req(crypto_ahash_update(b->req), &b->wait);
+  if (ret == 0)
+    ret = crypto_wait_req(crypto_ahash_final(b->req), &b->wait);
+  return ret;
+}
+
+static int bench_cmp(const void* a, const void* b){
+  u64 x = *(const u64*) a, y = *(const u64*) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * bench_run: time one size and print the results. The digest of an untimed first operation, which
+ * also warms up the caches and the device, is stored in out.
+ **/
+static int bench_run(struct bench_tfm* b, unsigned int blen, unsigned int plen, u8* out){
+  unsigned int ops = clamp_t(unsigned long, budget / blen, 1, iters);
+  u64 total_ns = 0, total_cycles = 0, cpb;
+  u8 scratch[BENCH_MAX_DIGEST];
+  cycles_t start_cycles;
+  unsigned int i;
+  u64 start;
+  int ret;
+
+  ret = bench_op(b, blen, plen, out);
+  for (i = 0; ret == 0 && i < ops; i++){
+    start = ktime_get_ns();
+    start_cycles = get_cycles();
+    ret = bench_op(b, blen, plen, scratch);
+    total_cycles += get_cycles() - start_cycles;
+    latency[i] = ktime_get_ns() - start;
+    total_ns += latency[i];
+    cond_resched();
+  }
+  if (ret < 0){
+    pr_err("cryptic-bench: %s failed on %u bytes in updates of %u, error %d\n", b->name, blen, plen, ret);
+    return ret;
+  }
+
+  sort(latency, ops, sizeof(*latency), bench_cmp, NULL);
+  cpb = div64_u64(total_cycles * 100, (u64) ops * blen);
+  pr_info("cryptic-bench: %-20s %7u bytes %7u per update: %8llu ops/s %6llu.%02llu cycles/byte "
+          "latency ns p50 %llu p90 %llu p99 %llu\n", b->name, blen, plen,
+          div64_u64((u64) ops * NSEC_PER_SEC, max_t(u64, total_ns, 1)), cpb / 100, cpb % 100,
+          latency[(ops - 1) * 50 / 100], latency[(ops - 1) * 90 / 100], latency[(ops - 1) * 99 / 100]);
+  return 0;
+}
+
+static int bench_alloc(struct bench_tfm* b, const char* name){
+  b->tfm = crypto_alloc_ahash(name, 0, 0);
+  if (IS_ERR(b->tfm)){
+    pr_err("cryptic-bench: cannot allocate %s, error %ld\n", name, PTR_ERR(b->tfm));
+    return PTR_ERR(b->tfm);
+  }
+  if (crypto_ahash_digestsize(b->tfm) > BENCH_MAX_DIGEST){
+    crypto_free_ahash(b->tfm);
+    return -EINVAL;
+  }
+  b->req = ahash_request_alloc(b->tfm, GFP_KERNEL);
+  if (b->req == NULL){
+    crypto_free_ahash(b->tfm);
+    return -ENOMEM;
+  }
+  b->name = crypto_ahash_driver_name(b->tfm);
+  crypto_init_wait(&b->wait);
+  ahash_request_set_callback(b->req, CRYPTO_TFM_REQ_MAY_BACKLOG, crypto_req_done, &b->wait);
+  return 0;
+}
+
+static void bench_free(struct bench_tfm* b){
+  ahash_request_free(b->req);
+  crypto_free_ahash(b->tfm);
+}
+
+/**
+ * bench_sizes: sweep the message sizes, for each one a single digest and updates of 16 bytes and up,
+ * by factors of 16
+ **/
+static int bench_sizes(struct bench_tfm* test, struct bench_tfm* reference){
+  u8 digest[BENCH_MAX_DIGEST], expected[BENCH_MAX_DIGEST];
+  unsigned int blen, plen;
+  int mismatches = 0;
+  int ret;
+
+  for (blen = BENCH_MIN_LEN; blen <= BENCH_MAX_LEN; blen <<= 2){
+    for (plen = BENCH_MIN_LEN; plen <= blen; plen = (plen << 4 < blen) ? plen << 4 : blen){
+      if (blen / plen <= BENCH_MAX_UPDATES){
+        ret = bench_run(test, blen, plen, digest);
+        if (ret == 0 && reference != NULL)
+          ret = bench_run(reference, blen, plen, expected);
+        if (ret < 0)
+          return ret;
+        if (reference != NULL && memcmp(digest, expected, crypto_ahash_digestsize(test->tfm)) != 0){
+          pr_err("cryptic-bench: %s and %s disagree on %u bytes in updates of %u\n", test->name,
+                 reference->name, blen, plen);
+          mismatches++;
+        }
+      }
+      if (plen == blen)
+        break;
+    }
+  }
+  return mismatches ? -EBADMSG : 0;
+}
+
+static int __init bench_init(void){
+  struct bench_tfm test, reference;
+  bool with_reference = ref != NULL && ref[0] != '\0';
+  unsigned int i;
+  int ret = -ENOMEM;
+
+  /* The message is spread over pages, so that no large contiguous allocation is needed */
+  sg = kmalloc_array(BENCH_PAGES, sizeof(*sg), GFP_KERNEL);
+  latency = kmalloc_array(max(iters, 1U), sizeof(*latency), GFP_KERNEL);
+  if (sg == NULL || latency == NULL)
+    goto out;
+  sg_init_table(sg, BENCH_PAGES);
+  for (i = 0; i < BENCH_PAGES; i++){
+    pages[i] = __get_free_page(GFP_KERNEL);
+    if (pages[i] == 0)
+      goto out;
+    get_random_bytes((void*) pages[i], PAGE_SIZE);
+    sg_set_buf(&sg[i], (void*) pages[i], PAGE_SIZE);
+  }
+  iters = max(iters, 1U);
+
+  ret = bench_alloc(&test, alg);
+  if (ret < 0)
+    goto out;
+  if (with_reference){
+    ret = bench_alloc(&reference, ref);
+    if (ret < 0){
+      bench_free(&test);
+      goto out;
+    }
+  }
+
+  pr_info("cryptic-bench: %s against %s, up to %u operations or %lu bytes per size\n", test.name,
+          with_reference ? reference.name : "nothing", iters, budget);
+  ret = bench_sizes(&test, with_reference ? &reference : NULL);
+  pr_info("cryptic-bench: done, status %d\n", ret);
+
+  if (with_reference)
+    bench_free(&reference);
+  bench_free(&test);
+out:
+  for (i = 0; i < BENCH_PAGES; i++){
+    free_page(pages[i]);
+    pages[i] = 0;
+  }
+  kfree(latency);
+  kfree(sg);
+  /* Do not stay loaded, the benchmark can be run again right away */
+  return ret < 0 ? ret : -EAGAIN;
+}
+
+static void __exit bench_exit(void){
+}
+
+module_init(bench_init);
+module_exit(bench_exit);
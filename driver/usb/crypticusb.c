@@ -1,33 +1,162 @@
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/delay.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+
 #include "crypticusb.h"
 
+#define CREATE_TRACE_POINTS
+#include "crypticusb_trace.h"
+
 #ifndef UNUSED
 #define UNUSED(x) (void) (x)
 #endif
 
-#define MAX_TRANSFER 512
-#define WRITES_IN_FLIGHT 1
+#define MAX_IN_FLIGHT 16
+#define HELLO_TIMEOUT_MS 1000
+#define HELLO_ATTEMPTS 3
+/* Latency histograms have log2 buckets of microseconds, the first one counting what took less than 1us */
+#define LATENCY_BUCKETS 24
+/* Serial link: rate of a device behind a USB to serial bridge until another one is negotiated, time for
+ * both ends to settle on a new rate, and number of TEST frames checking it */
+#define LINK_DEFAULT_RATE 9600
+#define LINK_SETTLE_MS 20
+#define LINK_TESTS 3
+
+/* CH340/CH341 USB to serial bridge, programmed like drivers/usb/serial/ch341.c does */
+#define CH341_VENDOR_ID 0x1a86
+#define CH341_REQ_READ_VERSION 0x5F
+#define CH341_REQ_WRITE_REG 0x9A
+#define CH341_REQ_SERIAL_INIT 0xA1
+#define CH341_REG_PRESCALER 0x12
+#define CH341_REG_DIVISOR 0x13
+#define CH341_REG_LCR 0x18
+#define CH341_REG_LCR2 0x25
+#define CH341_LCR_ENABLE_RX 0x80
+#define CH341_LCR_ENABLE_TX 0x40
+#define CH341_LCR_CS8 0x03
+#define CH341_CLKRATE 48000000
+#define CH341_CLK_DIV(ps, fact) (1 << (12 - 3 * (ps) - (fact)))
+#define CH341_MIN_RATE(ps) (CH341_CLKRATE / (CH341_CLK_DIV((ps), 1) * 512))
+
+/* Parameters */
+static unsigned int depth = 4;
+module_param(depth, uint, 0444);
+MODULE_PARM_DESC(depth, "Number of frames kept in flight towards the device (1-" __stringify(MAX_IN_FLIGHT) ")");
+
+static unsigned int baud = 2000000;
+module_param(baud, uint, 0444);
+MODULE_PARM_DESC(baud, "Highest rate tried on the serial link of a device behind a USB to serial bridge, "
+                 "0 to stay at " __stringify(LINK_DEFAULT_RATE));
+
+static unsigned int rsp_timeout_ms = 1000;
+module_param(rsp_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(rsp_timeout_ms, "Time the device gets to answer a frame, on top of the time the frame and its "
+                 "response take on the serial link");
+
+/* Link rates tried at probe time, fastest first. An ATmega328P at 16 MHz reaches 2 Mbit/s exactly,
+ * 115200 is 2% off */
+static const unsigned int crypticusb_rates[] = {2000000, 1000000, 500000, 250000, 115200};
 
 /* Types *************************************************************************************************************/
+/* Phases of a frame timed by the latency histograms */
+enum crypticusb_phase {
+    CRYPTICUSB_LAT_SEND,                       /* from submission to the write urb completing */
+    CRYPTICUSB_LAT_COMPUTE,                    /* from the write urb completing to the first response byte */
+    CRYPTICUSB_LAT_READ,                       /* from the first to the last response byte */
+    CRYPTICUSB_LAT_PHASES
+};
+
+/* Counters exposed through sysfs and debugfs, updated without locks */
+struct crypticusb_stats {
+    atomic64_t frames;                         /* frames sent */
+    atomic64_t bytes;                          /* frame bytes sent, headers included */
+    atomic64_t errors;                         /* failed transfers and malformed responses */
+    atomic64_t chained;                        /* HASH frames sent without their chaining state */
+    atomic64_t evictions;                      /* states dropped from a slot while their message went on */
+    atomic64_t latency[CRYPTICUSB_LAT_PHASES][LATENCY_BUCKETS];
+};
+
+/* Frame waiting for its response */
+struct crypticusb_pending {
+    u32 seq;                                   /* sequence number the response must carry */
+    u8 *rsp;                                   /* where to copy the response payload */
+    size_t rsp_len;                            /* expected response payload length */
+    size_t len;                                /* frame length, header included */
+    bool chained;                              /* the frame left out its state, resuming from a slot */
+    crypticusb_complete_t done;                /* completion callback */
+    void *context;                             /* completion callback argument */
+    ktime_t sent;                              /* when the frame was submitted */
+    ktime_t written;                           /* when the write urb completed, zero until then */
+};
+
+/* Preallocated write urb with its DMA-coherent transfer buffer */
+struct crypticusb_wbuf {
+    struct list_head node;                     /* entry in the free list */
+    struct urb *urb;                           /* the urb to write data with */
+    unsigned char *data;                       /* the DMA-coherent buffer of frame_size bytes */
+    dma_addr_t dma;                            /* DMA address of data */
+    struct crypticusb_dev *dev;                /* owner device */
+    unsigned int slot;                         /* completion ring slot of the frame being sent */
+    ktime_t sent;                              /* when the frame being sent was submitted */
+};
+
 /* Device information */
 struct crypticusb_dev {
+    struct list_head node;                     /* entry in the list of devices */
     struct usb_device *udev;                   /* the usb device for this device */
     struct usb_interface *interface;           /* the interface for this device */
-    struct semaphore limit_sem;                /* limiting the number of writes in progress */
+    struct semaphore limit_sem;                /* limiting the number of frames in flight */
     struct usb_anchor submitted;               /* in case we need to retract our submissions */
-    struct urb *bulk_in_urb;                   /* the urb to read data with */
-    unsigned char *bulk_in_buffer;             /* the buffer to receive data */
-    size_t bulk_in_size;                       /* the size of the receive buffer */
-    size_t bulk_in_filled;                     /* number of bytes in the buffer */
-    size_t bulk_in_copied;                     /* already copied to user space */
+    unsigned int depth;                        /* number of frames and read urbs in flight */
+    struct urb *bulk_in_urbs[MAX_IN_FLIGHT];   /* the urbs to read data with */
+    unsigned char *bulk_in_buffers[MAX_IN_FLIGHT]; /* the buffers to receive data */
+    size_t bulk_in_size;                       /* the size of each receive buffer */
     __u8 bulk_in_endpointAddr;                 /* the address of the bulk in endpoint */
     __u8 bulk_out_endpointAddr;                /* the address of the bulk out endpoint */
+    size_t max_payload;                        /* largest frame payload, negotiated with the device */
+    size_t frame_size;                         /* size of each write buffer, header included */
+    unsigned int slots;                        /* chaining states the device keeps, 0 if none */
+    bool link_ctl;                             /* the device accepts BAUD and TEST frames */
+    unsigned int batch;                        /* messages per BATCH frame, 0 if the device does not accept them */
+    u8 bridge_version;                         /* version of the USB to serial bridge */
+    unsigned int baud;                         /* rate of the serial link, 0 for a native USB device */
+    u64 link_bps;                              /* link bandwidth measured at probe time in bytes/s, 0 if unknown */
+    /* Write buffer pool, so that sending a frame does not allocate */
+    struct crypticusb_wbuf pool[MAX_IN_FLIGHT];
+    struct list_head pool_free;                /* write buffers neither in flight nor lent */
+    unsigned int pool_avail;                   /* number of buffers in the free list */
+    spinlock_t pool_lock;                      /* lock for the free list */
+    wait_queue_head_t pool_wait;               /* to wait for a write buffer */
+    unsigned long pool_exhausted;              /* times a frame had to wait for a write buffer */
     int errors;                                /* the last request tanked */
-    bool ongoing_read;                         /* a read is going on */
     spinlock_t err_lock;                       /* lock for errors */
+    /* Completion ring: frames are answered in the order they are sent */
+    spinlock_t ring_lock;                      /* lock for the ring and the response reassembly */
+    struct crypticusb_pending ring[MAX_IN_FLIGHT];
+    unsigned int ring_head;                    /* oldest frame waiting for a response */
+    unsigned int ring_tail;                    /* next free slot */
+    u32 next_seq;                              /* sequence number of the next frame */
+    /* Device slots, under ring_lock: chain cookie of the last frame sent to each, 0 if free or unsure, and
+     * when it was last used */
+    u64 slot_chain[CRYPTICUSB_MAX_SLOTS];
+    u64 slot_used[CRYPTICUSB_MAX_SLOTS];
+    u64 slot_clock;
+    ktime_t last_rsp;                          /* when the last response was received */
+    struct delayed_work watchdog;              /* fails the frames when the oldest one is not answered in time */
+    struct work_struct clear_halt;             /* restarts the reads once the bulk in endpoint stalled */
+    u64 service_ns;                            /* moving average of the time the device takes per frame */
+    unsigned int in_flight_peak;               /* largest number of frames seen waiting for a response */
+    u8 rx_buf[sizeof(struct crypticusb_hdr) + CRYPTICUSB_RSP_MAX_LEN]; /* response being reassembled */
+    size_t rx_filled;                          /* bytes of the response received so far */
+    ktime_t rx_start;                          /* when the first byte of the response was received */
+    struct crypticusb_stats stats;
+    struct dentry *debugfs;                    /* debugfs directory of this device */
     struct kref kref;
     struct mutex io_mutex;                     /* synchronize I/O with disconnect */
     unsigned long disconnected: 1;
-    wait_queue_head_t bulk_in_wait;            /* to wait for an ongoing read */
 };
 #define to_crypticusb_dev(d) container_of(d, struct crypticusb_dev, kref)
 
@@ -35,6 +164,51 @@ struct crypticusb_dev {
 static int crypticusb_probe(struct usb_interface *intf, const struct usb_device_id *id);
 static void crypticusb_disconnect(struct usb_interface *intf);
 
+/* Attributes */
+#define CRYPTICUSB_ATTR_RO(name, fmt, value)                                                      \
+static ssize_t name##_show(struct device *d, struct device_attribute *attr, char *buf) {          \
+    struct crypticusb_dev *dev = usb_get_intfdata(to_usb_interface(d));                           \
+    UNUSED(attr);                                                                                 \
+    if (!dev)                                                                                     \
+        return -ENODEV;                                                                           \
+    return sprintf(buf, fmt "\n", value);                                                         \
+}                                                                                                 \
+static DEVICE_ATTR_RO(name)
+
+CRYPTICUSB_ATTR_RO(pool_exhausted, "%lu", READ_ONCE(dev->pool_exhausted));
+CRYPTICUSB_ATTR_RO(frames, "%lld", (long long) atomic64_read(&dev->stats.frames));
+CRYPTICUSB_ATTR_RO(bytes, "%lld", (long long) atomic64_read(&dev->stats.bytes));
+CRYPTICUSB_ATTR_RO(errors, "%lld", (long long) atomic64_read(&dev->stats.errors));
+CRYPTICUSB_ATTR_RO(chained, "%lld", (long long) atomic64_read(&dev->stats.chained));
+CRYPTICUSB_ATTR_RO(evictions, "%lld", (long long) atomic64_read(&dev->stats.evictions));
+CRYPTICUSB_ATTR_RO(slots, "%u", dev->slots);
+CRYPTICUSB_ATTR_RO(batch, "%u", dev->batch);
+CRYPTICUSB_ATTR_RO(in_flight, "%u", READ_ONCE(dev->ring_tail) - READ_ONCE(dev->ring_head));
+CRYPTICUSB_ATTR_RO(in_flight_peak, "%u", READ_ONCE(dev->in_flight_peak));
+CRYPTICUSB_ATTR_RO(service_ns, "%llu", (unsigned long long) READ_ONCE(dev->service_ns));
+CRYPTICUSB_ATTR_RO(max_payload, "%zu", dev->max_payload);
+CRYPTICUSB_ATTR_RO(baud, "%u", dev->baud);
+CRYPTICUSB_ATTR_RO(link_bps, "%llu", (unsigned long long) dev->link_bps);
+
+static struct attribute *crypticusb_attrs[] = {
+        &dev_attr_pool_exhausted.attr,
+        &dev_attr_frames.attr,
+        &dev_attr_bytes.attr,
+        &dev_attr_errors.attr,
+        &dev_attr_chained.attr,
+        &dev_attr_evictions.attr,
+        &dev_attr_slots.attr,
+        &dev_attr_batch.attr,
+        &dev_attr_in_flight.attr,
+        &dev_attr_in_flight_peak.attr,
+        &dev_attr_service_ns.attr,
+        &dev_attr_max_payload.attr,
+        &dev_attr_baud.attr,
+        &dev_attr_link_bps.attr,
+        NULL
+};
+ATTRIBUTE_GROUPS(crypticusb);
+
 /* Globals */
 static const struct usb_device_id crypticusb_devs_table[] = {
         {USB_DEVICE(CRYPTIC_DEV_VENDOR_ID, CRYPTIC_DEV_PRODUCT_ID)},
@@ -45,111 +219,863 @@ static struct usb_driver crypticusb_driver = {
         .name = CRYPTIC_DEV_NAME,
         .probe = crypticusb_probe,
         .disconnect = crypticusb_disconnect,
-        .id_table = crypticusb_devs_table
+        .id_table = crypticusb_devs_table,
+        .dev_groups = crypticusb_groups
 };
 
-static struct crypticusb_dev *gdev = NULL;
+/* Connected devices, each holds a reference until disconnected */
+static LIST_HEAD(crypticusb_devs);
+static DEFINE_SPINLOCK(crypticusb_devs_lock);
+
+/* debugfs directory of the driver, holding one directory per device */
+static struct dentry *crypticusb_debugfs;
+
+/* Source of the chain cookies, unique among all devices */
+static atomic64_t crypticusb_chain_next = ATOMIC64_INIT(0);
+
+static void crypticusb_write_bulk_callback(struct urb *urb);
 
 /* Helpers */
+static bool crypticusb_hdr_valid(const struct crypticusb_hdr *hdr, size_t max_len) {
+    return hdr->magic == CRYPTICUSB_MAGIC && hdr->version == CRYPTICUSB_PROTO_VERSION &&
+           le32_to_cpu(hdr->len) <= max_len;
+}
+
+/* Header of the frames exchanged at probe time, before sequence numbers matter */
+static void crypticusb_fill_hdr(struct crypticusb_hdr *hdr, u8 opcode, size_t len) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = CRYPTICUSB_MAGIC;
+    hdr->version = CRYPTICUSB_PROTO_VERSION;
+    hdr->opcode = opcode;
+    hdr->len = cpu_to_le32(len);
+}
+
+/* Count a sample in a latency histogram, given the start and the end of the phase */
+static void crypticusb_latency(struct crypticusb_dev *dev, enum crypticusb_phase phase, ktime_t start, ktime_t end) {
+    s64 ns = ktime_to_ns(ktime_sub(end, start));
+    u64 us = ns > 0 ? div_u64(ns, NSEC_PER_USEC) : 0;
+    unsigned int bucket = us ? min_t(unsigned int, ilog2(us) + 1, LATENCY_BUCKETS - 1) : 0;
+
+    atomic64_inc(&dev->stats.latency[phase][bucket]);
+}
+
+/* Count a failed transfer or a malformed response */
+static void crypticusb_error(struct crypticusb_dev *dev, int status) {
+    atomic64_inc(&dev->stats.errors);
+    trace_crypticusb_error(dev->udev, status);
+}
+
+static int crypticusb_latency_show(struct seq_file *s, void *unused) {
+    struct crypticusb_dev *dev = s->private;
+    unsigned int i;
+    UNUSED(unused);
+
+    seq_printf(s, "%-10s %12s %12s %12s\n", "usecs", "send", "compute", "read");
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        if (i < LATENCY_BUCKETS - 1)
+            seq_printf(s, "<%-9lu", 1UL << i);
+        else
+            seq_printf(s, ">=%-8lu", 1UL << (i - 1));
+        seq_printf(s, " %12lld %12lld %12lld\n",
+                   (long long) atomic64_read(&dev->stats.latency[CRYPTICUSB_LAT_SEND][i]),
+                   (long long) atomic64_read(&dev->stats.latency[CRYPTICUSB_LAT_COMPUTE][i]),
+                   (long long) atomic64_read(&dev->stats.latency[CRYPTICUSB_LAT_READ][i]));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(crypticusb_latency);
+
+/* Send a frame at probe time and wait for the rx_size bytes of its answer. The read urbs are not running
+ * yet, so it is read synchronously; rx must have room for the response plus bulk_in_size bytes */
+static int crypticusb_exchange(struct crypticusb_dev *dev, u8 *tx, size_t tx_size, u8 *rx, size_t rx_size) {
+    size_t filled = 0;
+    int actual, status;
+
+    status = usb_bulk_msg(dev->udev, usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr), tx, tx_size,
+                          &actual, HELLO_TIMEOUT_MS);
+    if (status < 0)
+        return status;
+
+    while (filled < rx_size) {
+        status = usb_bulk_msg(dev->udev, usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr), rx + filled,
+                              dev->bulk_in_size, &actual, HELLO_TIMEOUT_MS);
+        if (status < 0)
+            return status;
+        filled += actual;
+        /* Skip whatever the device sent before the response, e.g. while booting */
+        while (filled > 0 && rx[0] != CRYPTICUSB_MAGIC)
+            memmove(rx, rx + 1, --filled);
+    }
+    return 0;
+}
+
+/* Agree with the device on the protocol version and on the largest frame payload */
+static int crypticusb_handshake(struct crypticusb_dev *dev) {
+    const size_t size = sizeof(struct crypticusb_hdr) + sizeof(struct crypticusb_hello);
+    struct crypticusb_hdr *hdr;
+    struct crypticusb_hello *hello;
+    unsigned int attempt = 0;
+    ktime_t start;
+    u8 *tx, *rx;
+    int status;
+
+    tx = kzalloc(size, GFP_KERNEL);
+    rx = kmalloc(size + dev->bulk_in_size, GFP_KERNEL);
+    if (!tx || !rx) {
+        status = -ENOMEM;
+        goto out;
+    }
+    hdr = (struct crypticusb_hdr *) tx;
+    hello = (struct crypticusb_hello *) (tx + sizeof(*hdr));
+    crypticusb_fill_hdr(hdr, CRYPTICUSB_OP_HELLO, sizeof(*hello));
+    hello->max_payload = cpu_to_le32(CRYPTICUSB_MAX_PAYLOAD);
+
+    /* The device may still be booting and miss the first frames */
+    do {
+        start = ktime_get();
+        status = crypticusb_exchange(dev, tx, size, rx, size);
+    } while (status == -ETIMEDOUT && ++attempt < HELLO_ATTEMPTS);
+    if (status < 0) {
+        dev_err(&dev->interface->dev, "%s - device did not answer HELLO, error %d\n", __func__, status);
+        goto out;
+    }
+
+    hdr = (struct crypticusb_hdr *) rx;
+    hello = (struct crypticusb_hello *) (rx + sizeof(*hdr));
+    if (!crypticusb_hdr_valid(hdr, sizeof(*hello)) || hdr->opcode != CRYPTICUSB_OP_HELLO ||
+        le32_to_cpu(hdr->len) != sizeof(*hello)) {
+        dev_err(&dev->interface->dev, "%s - device speaks protocol version %u, driver speaks %u\n", __func__,
+                hdr->version, CRYPTICUSB_PROTO_VERSION);
+        status = -EPROTO;
+        goto out;
+    }
+    dev->max_payload = min_t(size_t, le32_to_cpu(hello->max_payload), CRYPTICUSB_MAX_PAYLOAD);
+    if (dev->max_payload < CRYPTICUSB_MIN_PAYLOAD) {
+        dev_err(&dev->interface->dev, "%s - device accepts only %zu bytes per frame\n", __func__,
+                dev->max_payload);
+        status = -EPROTO;
+        goto out;
+    }
+    dev->frame_size = sizeof(struct crypticusb_hdr) + dev->max_payload;
+    if (hdr->flags & CRYPTICUSB_FLAG_CHAINED)
+        dev->slots = (hdr->flags >> CRYPTICUSB_SLOT_SHIFT) + 1;
+    dev->link_ctl = hdr->flags & CRYPTICUSB_FLAG_LINK;
+    if (hdr->flags & CRYPTICUSB_FLAG_BATCH)
+        dev->batch = CRYPTICUSB_BATCH_MAX;
+    /* The round trip is the first estimate of the service time, until frames are answered */
+    dev->last_rsp = ktime_get();
+    dev->service_ns = max_t(s64, ktime_to_ns(ktime_sub(dev->last_rsp, start)), 1);
+    status = 0;
+out:
+    kfree(tx);
+    kfree(rx);
+    return status;
+}
+
+/* Divisor register of the bridge for a rate, see ch341_get_divisor */
+static int crypticusb_bridge_divisor(unsigned int rate) {
+    unsigned int fact = 1, clk_div, div;
+    int ps;
+
+    /* The fastest base clock that gives a divisor below 512 */
+    for (ps = 3; ps >= 0; ps--) {
+        if (rate > CH341_MIN_RATE(ps))
+            break;
+    }
+    if (ps < 0 || rate > CH341_CLKRATE / (CH341_CLK_DIV(3, 0) * 2))
+        return -EINVAL;
+    clk_div = CH341_CLK_DIV(ps, fact);
+    div = CH341_CLKRATE / (clk_div * rate);
+    if (div < 9 || div > 255) {
+        div /= 2;
+        clk_div *= 2;
+        fact = 0;
+    }
+    if (div < 2)
+        return -EINVAL;
+    /* Round to the nearest rate, and prefer the slower base clock which tolerates more errors */
+    if (16 * CH341_CLKRATE / (clk_div * div) - 16 * rate >= 16 * rate - 16 * CH341_CLKRATE / (clk_div * (div + 1)))
+        div++;
+    if (fact == 1 && div % 2 == 0) {
+        div /= 2;
+        fact = 0;
+    }
+    return (0x100 - div) << 8 | fact << 2 | ps;
+}
+
+static int crypticusb_bridge_write(struct crypticusb_dev *dev, u8 request, u16 value, u16 index) {
+    return usb_control_msg(dev->udev, usb_sndctrlpipe(dev->udev, 0), request,
+                           USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_OUT, value, index, NULL, 0,
+                           USB_CTRL_SET_TIMEOUT);
+}
+
+/* Set the serial side of the bridge to rate, 8N1 */
+static int crypticusb_bridge_set_rate(struct crypticusb_dev *dev, unsigned int rate) {
+    int divisor = crypticusb_bridge_divisor(rate);
+    int status;
+
+    if (divisor < 0)
+        return divisor;
+    /* Unless bit 7 is set, the bridge holds received bytes until they fill a packet */
+    if (dev->bridge_version > 0x27)
+        divisor |= BIT(7);
+    status = crypticusb_bridge_write(dev, CH341_REQ_WRITE_REG, CH341_REG_DIVISOR << 8 | CH341_REG_PRESCALER, divisor);
+    if (status < 0 || dev->bridge_version < 0x30)
+        return status;
+    return crypticusb_bridge_write(dev, CH341_REQ_WRITE_REG, CH341_REG_LCR2 << 8 | CH341_REG_LCR,
+                                   CH341_LCR_ENABLE_RX | CH341_LCR_ENABLE_TX | CH341_LCR_CS8);
+}
+
+/* A device behind a CH34x bridge starts at the default rate, anything else is a native USB device. The
+ * simulator has the IDs of the bridge but stalls its requests */
+static void crypticusb_bridge_init(struct crypticusb_dev *dev) {
+    u8 *version;
+    int status;
+
+    dev->baud = 0;
+    if (le16_to_cpu(dev->udev->descriptor.idVendor) != CH341_VENDOR_ID)
+        return;
+    version = kmalloc(2, GFP_KERNEL);
+    if (!version)
+        return;
+    status = usb_control_msg(dev->udev, usb_rcvctrlpipe(dev->udev, 0), CH341_REQ_READ_VERSION,
+                             USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_IN, 0, 0, version, 2, USB_CTRL_GET_TIMEOUT);
+    if (status == 2) {
+        dev->bridge_version = version[0];
+        status = crypticusb_bridge_write(dev, CH341_REQ_SERIAL_INIT, 0, 0);
+        if (status >= 0)
+            status = crypticusb_bridge_set_rate(dev, LINK_DEFAULT_RATE);
+    } else if (status >= 0) {
+        status = -EIO;
+    }
+    kfree(version);
+    if (status < 0) {
+        dev_info(&dev->interface->dev, "%s - no serial bridge (error %d), native USB link\n", __func__, status);
+        return;
+    }
+    dev->baud = LINK_DEFAULT_RATE;
+}
+
+/* TEST frames last about a quarter of a second on a serial link */
+static size_t crypticusb_link_test_len(struct crypticusb_dev *dev) {
+    return dev->baud ? clamp_t(size_t, dev->baud / 10 / 4, 1, dev->max_payload) : dev->max_payload;
+}
+
+/* Check the link with TEST frames of len bytes. Sets bps to its bandwidth, both directions counted */
+static int crypticusb_link_test(struct crypticusb_dev *dev, u8 *tx, u8 *rx, size_t len, u64 *bps) {
+    const size_t rsp_size = sizeof(struct crypticusb_hdr) + sizeof(struct crypticusb_test);
+    struct crypticusb_hdr *hdr = (struct crypticusb_hdr *) tx;
+    struct crypticusb_hdr *rsp = (struct crypticusb_hdr *) rx;
+    struct crypticusb_test *test = (struct crypticusb_test *) (rx + sizeof(*rsp));
+    unsigned int i;
+    ktime_t start;
+    u32 sum = 0;
+    s64 ns;
+    int status;
+
+    crypticusb_fill_hdr(hdr, CRYPTICUSB_OP_TEST, len);
+    get_random_bytes(tx + sizeof(*hdr), len);
+    for (i = 0; i < len; i++)
+        sum += tx[sizeof(*hdr) + i];
+
+    start = ktime_get();
+    for (i = 0; i < LINK_TESTS; i++) {
+        hdr->seq = cpu_to_le32(i);
+        status = crypticusb_exchange(dev, tx, sizeof(*hdr) + len, rx, rsp_size);
+        if (status < 0)
+            return status;
+        if (!crypticusb_hdr_valid(rsp, sizeof(*test)) || rsp->opcode != CRYPTICUSB_OP_TEST ||
+            le32_to_cpu(rsp->len) != sizeof(*test) || le32_to_cpu(test->len) != len || le32_to_cpu(test->sum) != sum)
+            return -EIO;
+    }
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    *bps = div64_u64((u64) LINK_TESTS * (sizeof(*hdr) + len + rsp_size) * NSEC_PER_SEC, max_t(s64, ns, 1));
+    return 0;
+}
+
+/* Send a BAUD frame at the current rate, true if the device agrees to rate */
+static bool crypticusb_link_baud(struct crypticusb_dev *dev, unsigned int rate, u8 *tx, u8 *rx) {
+    const size_t size = sizeof(struct crypticusb_hdr) + sizeof(struct crypticusb_baud);
+    struct crypticusb_hdr *rsp = (struct crypticusb_hdr *) rx;
+    struct crypticusb_baud *req = (struct crypticusb_baud *) (tx + sizeof(struct crypticusb_hdr));
+    struct crypticusb_baud *ack = (struct crypticusb_baud *) (rx + sizeof(struct crypticusb_hdr));
+
+    crypticusb_fill_hdr((struct crypticusb_hdr *) tx, CRYPTICUSB_OP_BAUD, sizeof(*req));
+    req->rate = cpu_to_le32(rate);
+    return crypticusb_exchange(dev, tx, size, rx, size) == 0 && crypticusb_hdr_valid(rsp, sizeof(*ack)) &&
+           rsp->opcode == CRYPTICUSB_OP_BAUD && le32_to_cpu(rsp->len) == sizeof(*ack) &&
+           le32_to_cpu(ack->rate) == rate;
+}
+
+/* Move the link to rate: the device switches after answering a first BAUD frame, then the bridge follows
+ * and TEST frames check the link. A second BAUD frame at the new rate makes the device keep it, without it
+ * the device goes back to the old rate after CRYPTICUSB_BAUD_CONFIRM_MS, and so does the bridge */
+static int crypticusb_link_try(struct crypticusb_dev *dev, unsigned int rate, u8 *tx, u8 *rx) {
+    unsigned int old = dev->baud;
+    u64 bps;
+    int status;
+
+    if (!crypticusb_link_baud(dev, rate, tx, rx))
+        return -EOPNOTSUPP;
+    status = crypticusb_bridge_set_rate(dev, rate);
+    if (status >= 0) {
+        msleep(LINK_SETTLE_MS);
+        dev->baud = rate;
+        status = crypticusb_link_test(dev, tx, rx, crypticusb_link_test_len(dev), &bps);
+        if (status == 0 && !crypticusb_link_baud(dev, rate, tx, rx))
+            status = -EIO;
+        if (status == 0) {
+            dev->link_bps = bps;
+            return 0;
+        }
+    }
+    dev->baud = old;
+    crypticusb_bridge_set_rate(dev, old);
+    msleep(CRYPTICUSB_BAUD_CONFIRM_MS + LINK_SETTLE_MS);
+    return status < 0 ? status : -EIO;
+}
+
+/* Raise the serial link to the fastest rate that works, up to the baud parameter, and measure the link.
+ * Each rate that fails costs about CRYPTICUSB_BAUD_CONFIRM_MS */
+static void crypticusb_link_setup(struct crypticusb_dev *dev) {
+    unsigned int i;
+    u8 *tx, *rx;
+    u64 bps;
+    int status;
+
+    /* Older firmware only knows HELLO and HASH */
+    if (!dev->link_ctl)
+        return;
+    tx = kmalloc(dev->frame_size, GFP_KERNEL);
+    rx = kmalloc(sizeof(struct crypticusb_hdr) + sizeof(struct crypticusb_test) + dev->bulk_in_size, GFP_KERNEL);
+    if (!tx || !rx)
+        goto out;
+
+    for (i = 0; dev->baud && i < ARRAY_SIZE(crypticusb_rates); i++) {
+        if (crypticusb_rates[i] > baud || crypticusb_rates[i] <= dev->baud)
+            continue;
+        status = crypticusb_link_try(dev, crypticusb_rates[i], tx, rx);
+        if (status == 0)
+            break;
+        dev_info(&dev->interface->dev, "%s - link at %u bit/s failed, error %d\n", __func__, crypticusb_rates[i],
+                 status);
+    }
+    if (!dev->link_bps && crypticusb_link_test(dev, tx, rx, crypticusb_link_test_len(dev), &bps) == 0)
+        dev->link_bps = bps;
+out:
+    kfree(tx);
+    kfree(rx);
+}
+
+static int crypticusb_alloc_pool(struct crypticusb_dev *dev) {
+    struct crypticusb_wbuf *wbuf;
+    unsigned int i;
+
+    for (i = 0; i < dev->depth; i++) {
+        wbuf = &dev->pool[i];
+        wbuf->dev = dev;
+        wbuf->urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!wbuf->urb)
+            return -ENOMEM;
+        wbuf->data = usb_alloc_coherent(dev->udev, dev->frame_size, GFP_KERNEL, &wbuf->dma);
+        if (!wbuf->data)
+            return -ENOMEM;
+        wbuf->urb->transfer_dma = wbuf->dma;
+        /* The transfer length is set when the buffer is used */
+        usb_fill_bulk_urb(wbuf->urb, dev->udev, usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+                          wbuf->data, dev->frame_size, crypticusb_write_bulk_callback, wbuf);
+        wbuf->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+        list_add_tail(&wbuf->node, &dev->pool_free);
+        dev->pool_avail++;
+    }
+    return 0;
+}
+
+static void crypticusb_free_pool(struct crypticusb_dev *dev) {
+    struct crypticusb_wbuf *wbuf;
+    unsigned int i;
+
+    for (i = 0; i < MAX_IN_FLIGHT; i++) {
+        wbuf = &dev->pool[i];
+        if (wbuf->data)
+            usb_free_coherent(dev->udev, dev->frame_size, wbuf->data, wbuf->dma);
+        usb_free_urb(wbuf->urb);
+        wbuf->data = NULL;
+        wbuf->urb = NULL;
+    }
+    INIT_LIST_HEAD(&dev->pool_free);
+    dev->pool_avail = 0;
+}
+
+/* True when no buffer is lent or in flight */
+static bool crypticusb_pool_idle(struct crypticusb_dev *dev) {
+    bool idle;
+
+    spin_lock_irq(&dev->pool_lock);
+    idle = dev->pool_avail == dev->depth;
+    spin_unlock_irq(&dev->pool_lock);
+    return idle;
+}
+
+/* Nothing is lent once the device is disconnected, disconnect then only waits for the buffers already out */
+static struct crypticusb_wbuf *crypticusb_try_get_wbuf(struct crypticusb_dev *dev) {
+    struct crypticusb_wbuf *wbuf = NULL;
+
+    spin_lock_irq(&dev->pool_lock);
+    if (!dev->disconnected)
+        wbuf = list_first_entry_or_null(&dev->pool_free, struct crypticusb_wbuf, node);
+    if (wbuf) {
+        list_del(&wbuf->node);
+        dev->pool_avail--;
+    }
+    spin_unlock_irq(&dev->pool_lock);
+    return wbuf;
+}
+
+/* Take a write buffer from the pool, waiting for one to be released if they are all in flight.
+ * Returns NULL if the device is disconnected meanwhile */
+static struct crypticusb_wbuf *crypticusb_get_wbuf(struct crypticusb_dev *dev) {
+    struct crypticusb_wbuf *wbuf;
+
+    wbuf = crypticusb_try_get_wbuf(dev);
+    if (!wbuf) {
+        spin_lock_irq(&dev->pool_lock);
+        dev->pool_exhausted++;
+        spin_unlock_irq(&dev->pool_lock);
+        wait_event(dev->pool_wait, (wbuf = crypticusb_try_get_wbuf(dev)) != NULL || dev->disconnected);
+    }
+    return wbuf;
+}
+
+static void crypticusb_put_wbuf(struct crypticusb_wbuf *wbuf) {
+    struct crypticusb_dev *dev = wbuf->dev;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->pool_lock, flags);
+    list_add(&wbuf->node, &dev->pool_free);
+    dev->pool_avail++;
+    spin_unlock_irqrestore(&dev->pool_lock, flags);
+    wake_up(&dev->pool_wait);
+}
+
 static void crypticusb_delete(struct kref *kref) {
     struct crypticusb_dev *dev = to_crypticusb_dev(kref);
-    if (dev != gdev) {
-        pr_err(CRYPTIC_DEV_NAME ": discrepancy in pointers for freeing memory in %s\n", __PRETTY_FUNCTION__);
+    unsigned int i;
+
+    /* A write completion may drop the last reference, disconnect has already freed the pool then */
+    crypticusb_free_pool(dev);
+    for (i = 0; i < MAX_IN_FLIGHT; i++) {
+        usb_free_urb(dev->bulk_in_urbs[i]);
+        kfree(dev->bulk_in_buffers[i]);
     }
-    usb_free_urb(dev->bulk_in_urb);
     usb_put_intf(dev->interface);
     usb_put_dev(dev->udev);
-    kfree(dev->bulk_in_buffer);
     kfree(dev);
-    gdev = NULL;
 }
+
+/* Pick the device of a new frame. The frames of a message stay on the device holding its state in a slot, chain
+ * being the cookie of its last frame, otherwise moving would send the state again and evict another message.
+ * New messages go to the device expected to answer first: the one with the least work queued, weighted by
+ * how long it takes per frame. Returns it with a reference held, or NULL */
+static struct crypticusb_dev *crypticusb_schedule(u64 chain) {
+    struct crypticusb_dev *dev, *best = NULL;
+    u64 cost, best_cost = U64_MAX;
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock(&crypticusb_devs_lock);
+    list_for_each_entry(dev, &crypticusb_devs, node) {
+        if (!chain || best)
+            break;
+        spin_lock_irqsave(&dev->ring_lock, flags);
+        for (i = 0; i < dev->slots; i++) {
+            if (dev->slot_chain[i] == chain)
+                best = dev;
+        }
+        spin_unlock_irqrestore(&dev->ring_lock, flags);
+    }
+    if (!best) {
+        list_for_each_entry(dev, &crypticusb_devs, node) {
+            cost = (u64) (READ_ONCE(dev->ring_tail) - READ_ONCE(dev->ring_head) + 1) * READ_ONCE(dev->service_ns);
+            if (cost < best_cost) {
+                best = dev;
+                best_cost = cost;
+            }
+        }
+    }
+    if (best)
+        kref_get(&best->kref);
+    spin_unlock(&crypticusb_devs_lock);
+    return best;
+}
+
+/* Forget the states the device holds, the next frame of every message carries its state again. Called
+ * with ring_lock held */
+static void crypticusb_slots_reset(struct crypticusb_dev *dev) {
+    memset(dev->slot_chain, 0, sizeof(dev->slot_chain));
+}
+
+/* Slot for a HASH frame following the frame with cookie chain: the slot still holding the state of
+ * that frame, otherwise a free slot, otherwise the least recently used one. The device returns every
+ * state, so evicting a message only costs it the state in its next frame. Called with ring_lock held */
+static unsigned int crypticusb_slot_pick(struct crypticusb_dev *dev, u64 chain, bool *resume) {
+    unsigned int i, best = 0;
+
+    for (i = 0; i < dev->slots; i++) {
+        if (chain && dev->slot_chain[i] == chain) {
+            *resume = true;
+            return i;
+        }
+        if (dev->slot_chain[best] && (!dev->slot_chain[i] || dev->slot_used[i] < dev->slot_used[best]))
+            best = i;
+    }
+    *resume = false;
+    if (dev->slot_chain[best])
+        atomic64_inc(&dev->stats.evictions);
+    return best;
+}
+
+/* Complete every frame still waiting for a response, used when the stream can no longer be trusted */
+static void crypticusb_flush_pending(struct crypticusb_dev *dev, int status) {
+    struct crypticusb_pending pending;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->ring_lock, flags);
+    dev->rx_filled = 0;
+    crypticusb_slots_reset(dev);
+    while (dev->ring_head != dev->ring_tail) {
+        pending = dev->ring[dev->ring_head % MAX_IN_FLIGHT];
+        dev->ring_head++;
+        spin_unlock_irqrestore(&dev->ring_lock, flags);
+        trace_crypticusb_complete(dev->udev, pending.seq, pending.len, status,
+                                  ktime_to_ns(ktime_sub(ktime_get(), pending.sent)));
+        pending.done(pending.context, status);
+        up(&dev->limit_sem);
+        spin_lock_irqsave(&dev->ring_lock, flags);
+    }
+    spin_unlock_irqrestore(&dev->ring_lock, flags);
+}
+
+/* Deadline of the oldest pending frame: the device starts on it once it has answered the previous one, then the
+ * frame and its response cross the serial link. Called with ring_lock held and a frame pending */
+static ktime_t crypticusb_deadline(struct crypticusb_dev *dev) {
+    struct crypticusb_pending *pending = &dev->ring[dev->ring_head % MAX_IN_FLIGHT];
+    ktime_t start = ktime_after(pending->sent, dev->last_rsp) ? pending->sent : dev->last_rsp;
+    u64 ms = READ_ONCE(rsp_timeout_ms);
+
+    /* 10 bits per byte on the serial link */
+    if (dev->baud)
+        ms += div_u64((u64) (pending->len + sizeof(struct crypticusb_hdr) + pending->rsp_len) * 10 * MSEC_PER_SEC,
+                      dev->baud);
+    return ktime_add_ms(start, ms);
+}
+
+/* Arm the watchdog for the oldest pending frame, unless it is already armed. Called with ring_lock held */
+static void crypticusb_watchdog_arm(struct crypticusb_dev *dev) {
+    s64 ms;
+
+    if (dev->ring_head == dev->ring_tail || dev->disconnected)
+        return;
+    ms = ktime_ms_delta(crypticusb_deadline(dev), ktime_get());
+    schedule_delayed_work(&dev->watchdog, ms > 0 ? msecs_to_jiffies(ms) + 1 : 0);
+}
+
+/* The device dropped a frame or its response: nothing would ever complete the pending frames, and
+ * whatever was reassembled of the response cannot be trusted */
+static void crypticusb_watchdog(struct work_struct *work) {
+    struct crypticusb_dev *dev = container_of(to_delayed_work(work), struct crypticusb_dev, watchdog);
+    unsigned long flags;
+    bool expired;
+    u32 seq = 0;
+
+    spin_lock_irqsave(&dev->ring_lock, flags);
+    expired = dev->ring_head != dev->ring_tail && !ktime_before(ktime_get(), crypticusb_deadline(dev));
+    if (expired)
+        seq = dev->ring[dev->ring_head % MAX_IN_FLIGHT].seq;
+    else
+        crypticusb_watchdog_arm(dev);
+    spin_unlock_irqrestore(&dev->ring_lock, flags);
+
+    if (expired) {
+        dev_warn_ratelimited(&dev->interface->dev, "%s - no response to frame %u, failing the pending frames\n",
+                             __func__, seq);
+        crypticusb_error(dev, -ETIMEDOUT);
+        crypticusb_flush_pending(dev, -ETIMEDOUT);
+    }
+}
+
+/* True if the response with sequence number seq answers a pending frame. Called with ring_lock held */
+static bool crypticusb_rsp_pending(struct crypticusb_dev *dev, u32 seq) {
+    return seq - dev->ring[dev->ring_head % MAX_IN_FLIGHT].seq < dev->ring_tail - dev->ring_head;
+}
+
+/* Update the per-frame service time with a response to a frame sent at the given time. While frames
+ * are queued in the device the service time is the interval between responses, not the round trip */
+static void crypticusb_account(struct crypticusb_dev *dev, ktime_t sent) {
+    ktime_t now = ktime_get();
+    s64 sample = ktime_to_ns(ktime_sub(now, ktime_after(sent, dev->last_rsp) ? sent : dev->last_rsp));
+
+    dev->last_rsp = now;
+    if (sample < 1)
+        sample = 1;
+    WRITE_ONCE(dev->service_ns, dev->service_ns - (dev->service_ns >> 3) + ((u64) sample >> 3));
+}
+
+/* Feed received bytes to the response reassembly and complete the frames they answer */
+static void crypticusb_parse_rsp(struct crypticusb_dev *dev, const u8 *data, size_t len) {
+    struct crypticusb_pending pending;
+    struct crypticusb_hdr *hdr = (struct crypticusb_hdr *) dev->rx_buf;
+    ktime_t now = ktime_get();
+    size_t rsp_size, chunk;
+    unsigned long flags;
+    int status;
+    u32 seq;
+
+    spin_lock_irqsave(&dev->ring_lock, flags);
+    while (len > 0) {
+        if (dev->ring_head == dev->ring_tail) {
+            dev_warn_ratelimited(&dev->interface->dev, "%s - discarding %zu unexpected bytes\n", __func__, len);
+            crypticusb_error(dev, -EPROTO);
+            dev->rx_filled = 0;
+            crypticusb_slots_reset(dev);
+            break;
+        }
+        if (dev->rx_filled == 0)
+            dev->rx_start = now;
+        /* Collect the header first, it tells how long the response is */
+        if (dev->rx_filled < sizeof(struct crypticusb_hdr)) {
+            chunk = min(sizeof(struct crypticusb_hdr) - dev->rx_filled, len);
+            memcpy(dev->rx_buf + dev->rx_filled, data, chunk);
+            dev->rx_filled += chunk;
+            data += chunk;
+            len -= chunk;
+            if (dev->rx_filled < sizeof(struct crypticusb_hdr))
+                break;
+            if (!crypticusb_hdr_valid(hdr, CRYPTICUSB_RSP_MAX_LEN)) {
+                /* Out of sync: drop a byte and look for the next header. The device may have reset */
+                crypticusb_slots_reset(dev);
+                dev->rx_filled--;
+                memmove(dev->rx_buf, dev->rx_buf + 1, dev->rx_filled);
+                continue;
+            }
+        }
+        rsp_size = sizeof(struct crypticusb_hdr) + le32_to_cpu(hdr->len);
+        chunk = min(rsp_size - dev->rx_filled, len);
+        memcpy(dev->rx_buf + dev->rx_filled, data, chunk);
+        dev->rx_filled += chunk;
+        data += chunk;
+        len -= chunk;
+        if (dev->rx_filled < rsp_size)
+            break;
+
+        /* Response complete. Responses come back in order, the one expected answers the oldest frame */
+        dev->rx_filled = 0;
+        seq = le32_to_cpu(hdr->seq);
+        if (!crypticusb_rsp_pending(dev, seq)) {
+            /* A late response to a frame already failed by the watchdog */
+            dev_warn_ratelimited(&dev->interface->dev, "%s - discarding response to frame %u, not pending\n",
+                                 __func__, seq);
+            crypticusb_error(dev, -EPROTO);
+            continue;
+        }
+        if (dev->ring[dev->ring_head % MAX_IN_FLIGHT].seq != seq) {
+            /* Either the device dropped the older frames or the sequence number is garbled, then the payload
+             * may be the state of another message. It is not trusted: the frames up to the one it names fail
+             * and the response is dropped */
+            dev_warn_ratelimited(&dev->interface->dev, "%s - response to frame %u while frame %u is the oldest, "
+                                 "failing both and those in between\n", __func__, seq,
+                                 dev->ring[dev->ring_head % MAX_IN_FLIGHT].seq);
+            crypticusb_error(dev, -EPROTO);
+            crypticusb_slots_reset(dev);
+            do {
+                pending = dev->ring[dev->ring_head % MAX_IN_FLIGHT];
+                dev->ring_head++;
+                spin_unlock_irqrestore(&dev->ring_lock, flags);
+                trace_crypticusb_complete(dev->udev, pending.seq, pending.len, -EPROTO,
+                                          ktime_to_ns(ktime_sub(now, pending.sent)));
+                pending.done(pending.context, -EPROTO);
+                up(&dev->limit_sem);
+                spin_lock_irqsave(&dev->ring_lock, flags);
+            } while (crypticusb_rsp_pending(dev, seq));
+            cancel_delayed_work(&dev->watchdog);
+            crypticusb_watchdog_arm(dev);
+            continue;
+        }
+        pending = dev->ring[dev->ring_head % MAX_IN_FLIGHT];
+        crypticusb_account(dev, pending.sent);
+        crypticusb_latency(dev, CRYPTICUSB_LAT_COMPUTE, pending.written ? pending.written : pending.sent, dev->rx_start);
+        crypticusb_latency(dev, CRYPTICUSB_LAT_READ, dev->rx_start, now);
+        if (pending.chained && hdr->len == 0) {
+            /* The device lost the state of the slot, e.g. after a reset. The caller still has it */
+            status = -ESTALE;
+        } else if (le32_to_cpu(hdr->len) != pending.rsp_len) {
+            dev_err_ratelimited(&dev->interface->dev, "%s - response to frame %u has %u bytes, expected %zu\n",
+                                __func__, pending.seq, le32_to_cpu(hdr->len), pending.rsp_len);
+            status = -EPROTO;
+        } else {
+            memcpy(pending.rsp, dev->rx_buf + sizeof(struct crypticusb_hdr), pending.rsp_len);
+            status = 0;
+        }
+        if (status < 0) {
+            crypticusb_error(dev, status);
+            crypticusb_slots_reset(dev);
+        }
+        dev->ring_head++;
+        /* The next frame gets its own time from now */
+        cancel_delayed_work(&dev->watchdog);
+        crypticusb_watchdog_arm(dev);
+
+        spin_unlock_irqrestore(&dev->ring_lock, flags);
+        trace_crypticusb_complete(dev->udev, pending.seq, pending.len, status, ktime_to_ns(ktime_sub(now, pending.sent)));
+        pending.done(pending.context, status);
+        up(&dev->limit_sem);
+        spin_lock_irqsave(&dev->ring_lock, flags);
+    }
+    spin_unlock_irqrestore(&dev->ring_lock, flags);
+}
+
 static void crypticusb_write_bulk_callback(struct urb *urb) {
+    struct crypticusb_wbuf *wbuf;
     struct crypticusb_dev *dev;
     unsigned long flags;
+    ktime_t now;
 
-    dev = urb->context;
+    wbuf = urb->context;
+    dev = wbuf->dev;
 
-    /* Sync/async unlink faults aren't errors */
-    if (urb->status != 0) {
+    if (urb->status == 0) {
+        now = ktime_get();
+        crypticusb_latency(dev, CRYPTICUSB_LAT_SEND, wbuf->sent, now);
+        /* The response may have been received already, then the slot is no longer pending */
+        spin_lock_irqsave(&dev->ring_lock, flags);
+        if (wbuf->slot - dev->ring_head < dev->ring_tail - dev->ring_head)
+            dev->ring[wbuf->slot % MAX_IN_FLIGHT].written = now;
+        spin_unlock_irqrestore(&dev->ring_lock, flags);
+    } else {
+        /* Sync/async unlink faults aren't errors */
         if (!(urb->status == -ENOENT ||
               urb->status == -ECONNRESET ||
               urb->status == -ESHUTDOWN)) {
-            dev_err(&dev->interface->dev, "%s - nonzero write bulk status received: %d\n", __func__, urb->status);
+            dev_err_ratelimited(&dev->interface->dev, "%s - nonzero write bulk status received: %d\n",
+                                __func__, urb->status);
+            crypticusb_error(dev, urb->status);
         }
         spin_lock_irqsave(&dev->err_lock, flags);
         dev->errors = urb->status;
         spin_unlock_irqrestore(&dev->err_lock, flags);
+        /* The device will never answer this frame, and the following ones are out of sync */
+        crypticusb_flush_pending(dev, -EIO);
     }
 
-    /* Free up allocated buffer */
-    usb_free_coherent(urb->dev, urb->transfer_buffer_length, urb->transfer_buffer, urb->transfer_dma);
-    up(&dev->limit_sem);
+    /* Give the buffer back to the pool, then the reference taken when it was lent */
+    crypticusb_put_wbuf(wbuf);
+    kref_put(&dev->kref, crypticusb_delete);
 }
 
 
 static void crypticusb_read_bulk_callback(struct urb *urb) {
     struct crypticusb_dev *dev;
     unsigned long flags;
+    int status;
 
     dev = urb->context;
 
-    spin_lock_irqsave(&dev->err_lock, flags);
     /* sync/async unlink faults aren't errors */
     if (urb->status) {
-        if (!(urb->status == -ENOENT ||
-              urb->status == -ECONNRESET ||
-              urb->status == -ESHUTDOWN)) {
-            dev_err(&dev->interface->dev, "%s - nonzero write bulk status received: %d\n", __func__, urb->status);
+        if (urb->status == -ENOENT ||
+            urb->status == -ECONNRESET ||
+            urb->status == -ESHUTDOWN) {
+            return;
         }
+        dev_err_ratelimited(&dev->interface->dev, "%s - nonzero read bulk status received: %d\n",
+                            __func__, urb->status);
+        crypticusb_error(dev, urb->status);
+        spin_lock_irqsave(&dev->err_lock, flags);
         dev->errors = urb->status;
+        spin_unlock_irqrestore(&dev->err_lock, flags);
+        /* Bytes of the responses were lost, the pending frames will not be answered */
+        crypticusb_flush_pending(dev, -EIO);
+        if (urb->status == -EPIPE) {
+            /* Resubmitting would fail again until the halt is cleared, which has to sleep */
+            schedule_work(&dev->clear_halt);
+            return;
+        }
     } else {
-        dev->bulk_in_filled = urb->actual_length;
+        crypticusb_parse_rsp(dev, urb->transfer_buffer, urb->actual_length);
     }
-    dev->ongoing_read = 0;
-    spin_unlock_irqrestore(&dev->err_lock, flags);
 
-    wake_up_interruptible(&dev->bulk_in_wait);
+    /* Keep the read urb in flight */
+    status = usb_submit_urb(urb, GFP_ATOMIC);
+    if (status < 0 && status != -EPERM && status != -ENODEV)
+        dev_err_ratelimited(&dev->interface->dev, "%s - failed resubmitting read urb, error %d\n", __func__, status);
 }
 
 
-static int crypticusb_do_read_io(struct crypticusb_dev *dev, size_t count) {
+static int crypticusb_start_reads(struct crypticusb_dev *dev) {
+    unsigned int i;
     int status;
 
-    /* Prepare a read USB Request Block (URB) */
-    usb_fill_bulk_urb(dev->bulk_in_urb,
-                      dev->udev,
-                      usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
-                      dev->bulk_in_buffer,
-                      min(dev->bulk_in_size, count),
-                      crypticusb_read_bulk_callback,
-                      dev);
-    /* Acquire lock on URB */
-    spin_lock_irq(&dev->err_lock);
-    dev->ongoing_read = 1;
-    spin_unlock_irq(&dev->err_lock);
+    for (i = 0; i < dev->depth; i++) {
+        /* Prepare a read USB Request Block (URB) */
+        usb_fill_bulk_urb(dev->bulk_in_urbs[i],
+                          dev->udev,
+                          usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+                          dev->bulk_in_buffers[i],
+                          dev->bulk_in_size,
+                          crypticusb_read_bulk_callback,
+                          dev);
+        status = usb_submit_urb(dev->bulk_in_urbs[i], GFP_KERNEL);
+        if (status < 0) {
+            dev_err(&dev->interface->dev, "%s - failed submitting read urb, error %d\n", __func__, status);
+            return status == -ENOMEM ? status : -EIO;
+        }
+    }
+    return 0;
+}
+
+static void crypticusb_stop_reads(struct crypticusb_dev *dev) {
+    unsigned int i;
 
-    /* Submit bulk in urb */
-    dev->bulk_in_filled = 0;
-    dev->bulk_in_copied = 0;
-    status = usb_submit_urb(dev->bulk_in_urb, GFP_KERNEL);
+    /* Poisoning prevents the callback from resubmitting */
+    for (i = 0; i < dev->depth; i++)
+        usb_poison_urb(dev->bulk_in_urbs[i]);
+}
+
+/* Clear the halt of the bulk in endpoint and start reading again */
+static void crypticusb_clear_halt(struct work_struct *work) {
+    struct crypticusb_dev *dev = container_of(work, struct crypticusb_dev, clear_halt);
+    unsigned int i;
+    int status;
+
+    /* Disconnect stops the reads for good, holding io_mutex keeps it from doing so meanwhile */
+    mutex_lock(&dev->io_mutex);
+    if (dev->disconnected)
+        goto out;
+    /* The reads that did not stall fail once the endpoint halts, wait for all of them */
+    for (i = 0; i < dev->depth; i++)
+        usb_kill_urb(dev->bulk_in_urbs[i]);
+    status = usb_clear_halt(dev->udev, usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr));
     if (status < 0) {
-        dev_err(&dev->interface->dev, "%s - failed submitting read urb, error %d\n", __func__, status);
-        status = status == -ENOMEM ? status : -EIO;
-        /* Signal read completion */
-        spin_lock_irq(&dev->err_lock);
-        dev->ongoing_read = 0;
-        spin_unlock_irq(&dev->err_lock);
+        dev_err(&dev->interface->dev, "%s - failed clearing halt, error %d\n", __func__, status);
+        goto out;
     }
-    return status;
+    /* Nothing was answered while the reads were stopped */
+    crypticusb_flush_pending(dev, -EIO);
+    crypticusb_start_reads(dev);
+out:
+    mutex_unlock(&dev->io_mutex);
 }
 
 /* Module functions */
 int crypticusb_init(void) {
     int status;
+    /* Statistics are optional, debugfs functions cope with a missing directory */
+    crypticusb_debugfs = debugfs_create_dir("cryptic", NULL);
     /* Register driver within USB subsystem */
     status = usb_register(&crypticusb_driver);
     if (status != 0) {
         pr_err(CRYPTIC_DEV_NAME ": could not register USB driver: error %d\n", status);
+        debugfs_remove_recursive(crypticusb_debugfs);
         return -1;
     }
     pr_info(CRYPTIC_DEV_NAME ": succesfully registered USB driver!\n");
@@ -158,24 +1084,32 @@ int crypticusb_init(void) {
 
 void crypticusb_exit(void) {
     usb_deregister(&crypticusb_driver);
+    debugfs_remove_recursive(crypticusb_debugfs);
     pr_info(CRYPTIC_DEV_NAME ": deregistered USB driver\n");
 }
 
 static int crypticusb_probe(struct usb_interface *intf, const struct usb_device_id *id) {
     struct crypticusb_dev *dev;
     struct usb_endpoint_descriptor *bulk_in, *bulk_out;
+    unsigned int i;
     int status;
     /* Allocate memory for device state and initialize it */
     dev = kzalloc(sizeof(*dev), GFP_KERNEL);
     if (!dev)
         return -ENOMEM;
 
+    dev->depth = clamp_t(unsigned int, depth, 1, MAX_IN_FLIGHT);
     kref_init(&dev->kref);
-    sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
+    sema_init(&dev->limit_sem, dev->depth);
     mutex_init(&dev->io_mutex);
     spin_lock_init(&dev->err_lock);
+    spin_lock_init(&dev->ring_lock);
+    spin_lock_init(&dev->pool_lock);
+    INIT_LIST_HEAD(&dev->pool_free);
+    init_waitqueue_head(&dev->pool_wait);
     init_usb_anchor(&dev->submitted);
-    init_waitqueue_head(&dev->bulk_in_wait);
+    INIT_DELAYED_WORK(&dev->watchdog, crypticusb_watchdog);
+    INIT_WORK(&dev->clear_halt, crypticusb_clear_halt);
 
     dev->udev = usb_get_dev(interface_to_usbdev(intf));
     dev->interface = usb_get_intf(intf);
@@ -190,69 +1124,109 @@ static int crypticusb_probe(struct usb_interface *intf, const struct usb_device_
     }
     dev->bulk_in_size = usb_endpoint_maxp(bulk_in);
     dev->bulk_in_endpointAddr = bulk_in->bEndpointAddress;
-    dev->bulk_in_buffer = kmalloc(dev->bulk_in_size, GFP_KERNEL);
-    if (!dev->bulk_in_buffer) {
+    for (i = 0; i < dev->depth; i++) {
+        dev->bulk_in_buffers[i] = kmalloc(dev->bulk_in_size, GFP_KERNEL);
+        dev->bulk_in_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+        if (!dev->bulk_in_buffers[i] || !dev->bulk_in_urbs[i]) {
+            /* Free memory and return */
+            kref_put(&dev->kref, crypticusb_delete);
+            return -ENOMEM;
+        }
+    }
+    dev->bulk_out_endpointAddr = bulk_out->bEndpointAddress;
+    /* The frame size must be known before the write buffers are allocated */
+    crypticusb_bridge_init(dev);
+    status = crypticusb_handshake(dev);
+    if (status < 0) {
         /* Free memory and return */
         kref_put(&dev->kref, crypticusb_delete);
-        return -ENOMEM;
+        return status;
     }
-    dev->bulk_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (!dev->bulk_in_urb) {
+    crypticusb_link_setup(dev);
+    status = crypticusb_alloc_pool(dev);
+    if (status < 0) {
         /* Free memory and return */
         kref_put(&dev->kref, crypticusb_delete);
-        return -ENOMEM;
+        return status;
+    }
+    /* Keep reads in flight so that responses are collected as soon as they arrive */
+    status = crypticusb_start_reads(dev);
+    if (status < 0) {
+        crypticusb_stop_reads(dev);
+        cancel_work_sync(&dev->clear_halt);
+        kref_put(&dev->kref, crypticusb_delete);
+        return status;
     }
-    dev->bulk_out_endpointAddr = bulk_out->bEndpointAddress;
     /* Save data pointer in interface device */
     usb_set_intfdata(intf, dev);
-    /* Increment usage count for device */
-    kref_get(&dev->kref);
-    /* Save to global pointer */
-    dev_info(&intf->dev, CRYPTIC_DEV_NAME " connected");
-    gdev = dev;
+    dev->debugfs = debugfs_create_dir(dev_name(&intf->dev), crypticusb_debugfs);
+    debugfs_create_file("latency", 0444, dev->debugfs, dev, &crypticusb_latency_fops);
+    /* Make it available to the scheduler, the list holds the initial reference */
+    spin_lock(&crypticusb_devs_lock);
+    list_add_tail(&dev->node, &crypticusb_devs);
+    spin_unlock(&crypticusb_devs_lock);
+    dev_info(&intf->dev, CRYPTIC_DEV_NAME " connected, %u frames of up to %zu bytes in flight, %u state slots, "
+             "%u messages per batch, link at %u bit/s (0 for native USB), %llu bytes/s measured", dev->depth,
+             dev->max_payload, dev->slots, dev->batch, dev->baud, (unsigned long long) dev->link_bps);
     return 0;
 }
 
 static void crypticusb_disconnect(struct usb_interface *intf) {
     struct crypticusb_dev *dev;
     dev = usb_get_intfdata(intf);
-    if (dev != gdev) {
-        pr_err(CRYPTIC_DEV_NAME ": discrepancy in pointers in %s\n", __PRETTY_FUNCTION__);
-    }
     /* Empty interface */
     usb_set_intfdata(intf, NULL);
+    /* Waits for readers of the statistics */
+    debugfs_remove_recursive(dev->debugfs);
 
-    /* Temporarily block IO */
+    /* No new frame is scheduled on this device, the others are not affected */
+    spin_lock(&crypticusb_devs_lock);
+    list_del(&dev->node);
+    spin_unlock(&crypticusb_devs_lock);
+
+    /* Temporarily block IO. Setting the flag under pool_lock as well keeps new buffers from being lent */
     mutex_lock(&dev->io_mutex);
+    spin_lock_irq(&dev->pool_lock);
     dev->disconnected = 1;
+    spin_unlock_irq(&dev->pool_lock);
     mutex_unlock(&dev->io_mutex);
+    wake_up_all(&dev->pool_wait);
 
-    usb_kill_urb(dev->bulk_in_urb);
+    crypticusb_stop_reads(dev);
+    cancel_work_sync(&dev->clear_halt);
     usb_kill_anchored_urbs(&dev->submitted);
+    /* No frame can be sent any more, so the watchdog is not armed again */
+    cancel_delayed_work_sync(&dev->watchdog);
+    /* Nobody will answer the frames still in flight */
+    crypticusb_flush_pending(dev, -ENODEV);
+    /* Wait for lent frames to be given back, no new frame can be sent */
+    wait_event(dev->pool_wait, crypticusb_pool_idle(dev));
+    crypticusb_free_pool(dev);
 
-    /* Decrement usage count */
-    kref_put(&dev->kref, crypticusb_delete);
     dev_info(&intf->dev, CRYPTIC_DEV_NAME " disconnected");
-    gdev = NULL;
+    /* Drop the reference of the list of devices */
+    kref_put(&dev->kref, crypticusb_delete);
 }
 
-ssize_t crypticusb_send(const char *buffer, size_t count) {
+/**
+ * crypticusb_get_frame: lend a DMA-coherent buffer, to be filled in place and then sent with
+ * crypticusb_submit_frame or given back with crypticusb_put_frame. The frame is bound to a device at this
+ * point: the one holding the state of chain, the cookie set by crypticusb_submit_frame for the previous frame
+ * of the message, or else the least loaded one. A slot in its completion ring is reserved as well, blocking
+ * while the maximum number of frames is in flight. The device is kept until the frame is given back or sent.
+ * Returns the buffer and sets handle and size, the largest frame the device accepts, or an ERR_PTR.
+ **/
+void *crypticusb_get_frame(struct crypticusb_wbuf **handle, size_t *size, u64 chain) {
     struct crypticusb_dev *dev;
+    struct crypticusb_wbuf *wbuf;
     int status = 0;
-    struct urb *urb = NULL;
-    char *buf = NULL;
-    size_t writesize = min(count, (size_t) MAX_TRANSFER);
-
-    /* Check if buffer actually contains data */
-    if (count == 0)
-        return 0;
 
-    /* Retrieve device pointer */
-    if (!gdev) {
-        pr_err(CRYPTIC_DEV_NAME ": cannot write, device is disconnected\n");
-        return -ENODEV;
+    /* Choose a device */
+    dev = crypticusb_schedule(chain);
+    if (!dev) {
+        pr_err_ratelimited(CRYPTIC_DEV_NAME ": cannot write, no device connected\n");
+        return ERR_PTR(-ENODEV);
     }
-    dev = gdev;
 
     /* Check for errors */
     spin_lock_irq(&dev->err_lock);
@@ -264,165 +1238,242 @@ ssize_t crypticusb_send(const char *buffer, size_t count) {
     }
     spin_unlock_irq(&dev->err_lock);
 
-    if (status < 0) {
-        up(&dev->limit_sem);
-        return status;
-    }
+    if (status < 0)
+        goto out;
 
-    /* Create a USB Request Block (URB) and its buffer */
-    urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (!urb) {
-        up(&dev->limit_sem);
-        return -ENOMEM;
-    }
-    buf = usb_alloc_coherent(dev->udev, writesize, GFP_KERNEL, &urb->transfer_dma);
-    if (!buf) {
-        usb_free_coherent(dev->udev, writesize, buf, urb->transfer_dma);
-        usb_free_urb(urb);
+    /* Wait for a free slot in the completion ring */
+    status = down_interruptible(&dev->limit_sem);
+    if (status < 0)
+        goto out;
+
+    wbuf = crypticusb_get_wbuf(dev);
+    if (!wbuf) {
         up(&dev->limit_sem);
-        return -ENOMEM;
+        status = -ENODEV;
+        goto out;
     }
-    /* Copy data from buffer to URB buffer */
-    memcpy(buf, buffer, writesize);
+    /* The reference is dropped when the frame is given back or its write completes */
+    *handle = wbuf;
+    *size = dev->frame_size;
+    return wbuf->data;
+out:
+    kref_put(&dev->kref, crypticusb_delete);
+    return ERR_PTR(status);
+}
+
+/**
+ * crypticusb_put_frame: give back a frame obtained with crypticusb_get_frame without sending it
+ **/
+void crypticusb_put_frame(struct crypticusb_wbuf *handle) {
+    struct crypticusb_dev *dev = handle->dev;
+
+    crypticusb_put_wbuf(handle);
+    up(&dev->limit_sem);
+    kref_put(&dev->kref, crypticusb_delete);
+}
+
+/**
+ * crypticusb_submit_frame: send a frame obtained with crypticusb_get_frame without waiting for its
+ * response. The frame must start with a struct crypticusb_hdr where the caller sets the opcode, the
+ * other fields are filled in here.
+ * When the response arrives its payload is copied to rsp and done is called, possibly in atomic context.
+ * On error the frame is still lent to the caller, who must give it back with crypticusb_put_frame.
+ * chain, if not NULL, points to the cookie of the HASH frame whose response holds the chaining state of
+ * this one, or 0. If a slot of the device still holds that state, the one in the frame is left out,
+ * otherwise the frame loads its state into a slot. The cookie of this frame is stored back, for the next
+ * frame of the same message. If the device lost the state meanwhile the frame completes with -ESTALE, it
+ * can be sent again with a cookie of 0.
+ **/
+int crypticusb_submit_frame(struct crypticusb_wbuf *handle, size_t count, u8 *rsp, size_t rsp_len,
+                            crypticusb_complete_t done, void *context, u64 *chain) {
+    struct crypticusb_dev *dev = handle->dev;
+    struct crypticusb_hdr *hdr = (struct crypticusb_hdr *) handle->data;
+    struct crypticusb_pending *pending;
+    struct urb *urb = handle->urb;
+    unsigned int in_flight;
+    unsigned int slot;
+    size_t skip = 0;
+    bool resume;
+    int status = 0;
+    u32 seq;
+
+    /* Check if the frame fits in the negotiated size */
+    if (count < sizeof(struct crypticusb_hdr) || count > dev->frame_size || rsp_len > CRYPTICUSB_RSP_MAX_LEN)
+        return -EINVAL;
+    hdr->magic = CRYPTICUSB_MAGIC;
+    hdr->version = CRYPTICUSB_PROTO_VERSION;
+    hdr->flags = 0;
 
     /* Check if device is still actually connected */
     mutex_lock(&dev->io_mutex);
     if (dev->disconnected) {
         mutex_unlock(&dev->io_mutex);
-        usb_free_coherent(dev->udev, writesize, buf, urb->transfer_dma);
-        usb_free_urb(urb);
-        up(&dev->limit_sem);
         return -ENODEV;
     }
 
-    /* Initialize URB's other fields */
-    usb_fill_bulk_urb(urb, dev->udev, usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr), buf, writesize,
-                      crypticusb_write_bulk_callback, dev);
-    urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    /* Register the frame in the completion ring before it hits the wire. Holding io_mutex keeps
+     * sequence numbers in the same order as the frames on the bus */
+    spin_lock_irq(&dev->ring_lock);
+    if (chain && dev->slots) {
+        /* The device still holds the state if the frame it answered it for is the last one sent to its
+         * slot. The header then moves over the state, and the frame is sent from there */
+        slot = crypticusb_slot_pick(dev, *chain, &resume);
+        if (resume && count >= sizeof(struct crypticusb_hdr) + CRYPTICUSB_CHAIN_STATE_LEN) {
+            skip = CRYPTICUSB_CHAIN_STATE_LEN;
+            memmove(handle->data + skip, hdr, sizeof(*hdr));
+            hdr = (struct crypticusb_hdr *) (handle->data + skip);
+            hdr->flags = CRYPTICUSB_FLAG_CHAINED;
+        }
+        hdr->flags |= CRYPTICUSB_FLAG_SLOT(slot);
+        *chain = dev->slot_chain[slot] = atomic64_inc_return(&crypticusb_chain_next);
+        dev->slot_used[slot] = ++dev->slot_clock;
+    } else if (hdr->opcode == CRYPTICUSB_OP_HASH) {
+        /* HASH frames without a chain go to the first slot, other frames leave the slots alone */
+        dev->slot_chain[0] = 0;
+        if (chain)
+            *chain = 0;
+    }
+    hdr->len = cpu_to_le32(count - skip - sizeof(struct crypticusb_hdr));
+    urb->transfer_buffer = handle->data + skip;
+    urb->transfer_dma = handle->dma + skip;
+    urb->transfer_buffer_length = count - skip;
+
+    pending = &dev->ring[dev->ring_tail % MAX_IN_FLIGHT];
+    pending->seq = dev->next_seq++;
+    pending->rsp = rsp;
+    pending->rsp_len = rsp_len;
+    pending->len = count - skip;
+    pending->chained = skip != 0;
+    pending->done = done;
+    pending->context = context;
+    pending->sent = ktime_get();
+    pending->written = 0;
+    handle->slot = dev->ring_tail;
+    handle->sent = pending->sent;
+    dev->ring_tail++;
+    in_flight = dev->ring_tail - dev->ring_head;
+    if (in_flight > dev->in_flight_peak)
+        dev->in_flight_peak = in_flight;
+    seq = pending->seq;
+    hdr->seq = cpu_to_le32(seq);
+    crypticusb_watchdog_arm(dev);
+    spin_unlock_irq(&dev->ring_lock);
+
     usb_anchor_urb(urb, &dev->submitted);
 
     /* Send the data out the bulk port */
     status = usb_submit_urb(urb, GFP_KERNEL);
-    mutex_unlock(&dev->io_mutex);
     if (status != 0) {
-        dev_err(&dev->interface->dev, "%s - failed submitting write urb, error %d\n", __func__, status);
+        dev_err_ratelimited(&dev->interface->dev, "%s - failed submitting write urb, error %d\n", __func__, status);
+        crypticusb_error(dev, status);
+        /* Nothing was sent after this frame, so it is the newest in the ring unless a write error
+         * flushed the ring in the meantime and already completed it, releasing its slot */
+        spin_lock_irq(&dev->ring_lock);
+        crypticusb_slots_reset(dev);
+        if (dev->ring_head != dev->ring_tail) {
+            dev->ring_tail--;
+            dev->next_seq--;
+        } else {
+            status = 0;
+        }
+        spin_unlock_irq(&dev->ring_lock);
         usb_unanchor_urb(urb);
-        usb_free_coherent(dev->udev, writesize, buf, urb->transfer_dma);
-        usb_free_urb(urb);
-        up(&dev->limit_sem);
+        mutex_unlock(&dev->io_mutex);
+        if (status == 0) {
+            crypticusb_put_wbuf(handle);
+            kref_put(&dev->kref, crypticusb_delete);
+        }
         return status;
     }
-
-    /* Release current reference to this urb, the USB core will eventually free it entirely */
-    usb_free_urb(urb);
-    return writesize;
+    mutex_unlock(&dev->io_mutex);
+    trace_crypticusb_submit(dev->udev, seq, count - skip, in_flight);
+    atomic64_inc(&dev->stats.frames);
+    atomic64_add(count - skip, &dev->stats.bytes);
+    if (skip)
+        atomic64_inc(&dev->stats.chained);
+    return 0;
 }
 
-ssize_t crypticusb_read(char *buffer, size_t count) {
+/**
+ * crypticusb_release_chain: the message whose last frame had this cookie is over, the slot holding its
+ * state can be reused without evicting another message
+ **/
+void crypticusb_release_chain(u64 chain) {
     struct crypticusb_dev *dev;
-    int status;
-    bool ongoing_io;
-
-    /* Check if the request actually needs data */
-    if (!count)
-        return 0;
-    /* Retrieve device data */
-    if (!gdev) {
-        pr_err(CRYPTIC_DEV_NAME ": cannot read, device is disconnected\n");
-        return -ENODEV;
-    }
-    dev = gdev;
-
-    /* Lock mutex to prevent others from reading */
-    status = mutex_lock_interruptible(&dev->io_mutex);
-    if (status < 0)
-        return status;
-
-    if (dev->disconnected) {		/* disconnect() was called */
-        mutex_unlock(&dev->io_mutex);
-        return -ENODEV;
-    }
-
-    /* if IO is under way, we must not touch things */
-    retry:
-    spin_lock_irq(&dev->err_lock);
-    ongoing_io = dev->ongoing_read;
-    spin_unlock_irq(&dev->err_lock);
+    unsigned long flags;
+    unsigned int i;
 
-    if (ongoing_io) {
-        /* IO may take forever, hence wait in an interruptible state */
-        status = wait_event_interruptible(dev->bulk_in_wait, (!dev->ongoing_read));
-        if (status < 0) {
-            mutex_unlock(&dev->io_mutex);
-            return status;
+    if (!chain)
+        return;
+    spin_lock(&crypticusb_devs_lock);
+    list_for_each_entry(dev, &crypticusb_devs, node) {
+        spin_lock_irqsave(&dev->ring_lock, flags);
+        for (i = 0; i < dev->slots; i++) {
+            if (dev->slot_chain[i] == chain)
+                dev->slot_chain[i] = 0;
         }
+        spin_unlock_irqrestore(&dev->ring_lock, flags);
     }
+    spin_unlock(&crypticusb_devs_lock);
+}
 
-    /* Errors must be reported */
-    status = dev->errors;
-    if (status < 0) {
-        /* Any error is reported once */
-        dev->errors = 0;
-        /* To check notifications about reset */
-        status = (status == -EPIPE) ? status : -EIO;
-        /* report it */
-        mutex_unlock(&dev->io_mutex);
-        return status;
-    }
-
-    /*
-     * if the buffer is filled we may satisfy the read
-     * else we need to start IO
-     */
-
-    if (dev->bulk_in_filled) {
-        /* we had read data */
-        size_t available = dev->bulk_in_filled - dev->bulk_in_copied;
-        size_t chunk = min(available, count);
-
-        if (!available) {
-            /* All data has been used. Actual IO needs to be done */
-            status = crypticusb_do_read_io(dev, count);
-            if (status < 0) {
-                mutex_unlock(&dev->io_mutex);
-                return status;
-            }
-            else
-                goto retry;
-        }
-        /* Data is available. Chunk tells us how much shall be copied */
-
-        memcpy(buffer, dev->bulk_in_buffer + dev->bulk_in_copied, chunk);
-        status = chunk;
+/**
+ * crypticusb_frame_batch: most messages a BATCH frame may carry on the device the frame is bound to, 0 if
+ * it does not accept BATCH frames
+ **/
+unsigned int crypticusb_frame_batch(struct crypticusb_wbuf *handle) {
+    return handle->dev->batch;
+}
 
-        dev->bulk_in_copied += chunk;
+/**
+ * crypticusb_submit: copy a frame to a pooled buffer and send it, see crypticusb_submit_frame
+ **/
+int crypticusb_submit(const void *frame, size_t count, u8 *rsp, size_t rsp_len, crypticusb_complete_t done, void *context) {
+    struct crypticusb_wbuf *handle;
+    size_t size;
+    void *buf;
+    int status;
 
-        /* If we are asked for more than we have, we start IO but don't wait */
-        if (available < count)
-            crypticusb_do_read_io(dev, count - chunk);
-    } else {
-        /* no data in the buffer */
-        status = crypticusb_do_read_io(dev, count);
-        if (status < 0) {
-            mutex_unlock(&dev->io_mutex);
-            return status;
-        }
-        else
-            goto retry;
+    buf = crypticusb_get_frame(&handle, &size, 0);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+    status = -EINVAL;
+    if (count <= size) {
+        memcpy(buf, frame, count);
+        status = crypticusb_submit_frame(handle, count, rsp, rsp_len, done, context, NULL);
     }
-    mutex_unlock(&dev->io_mutex);
+    if (status != 0)
+        crypticusb_put_frame(handle);
     return status;
 }
 
 int crypticusb_isConnected(void) {
-    return gdev != NULL && !gdev->disconnected;
+    int connected;
+
+    spin_lock(&crypticusb_devs_lock);
+    connected = !list_empty(&crypticusb_devs);
+    spin_unlock(&crypticusb_devs_lock);
+    return connected;
+}
+
+/**
+ * crypticusb_debugfs_root: debugfs directory of the driver, for the hash interface to add its own statistics.
+ * May be an ERR_PTR when debugfs is not available, which debugfs functions accept
+ **/
+struct dentry *crypticusb_debugfs_root(void) {
+    return crypticusb_debugfs;
 }
 
 MODULE_LICENSE("GPL v2");
 MODULE_DEVICE_TABLE(usb, crypticusb_devs_table);
 
-EXPORT_SYMBOL_GPL(crypticusb_send);
-EXPORT_SYMBOL_GPL(crypticusb_read);
+EXPORT_SYMBOL_GPL(crypticusb_get_frame);
+EXPORT_SYMBOL_GPL(crypticusb_put_frame);
+EXPORT_SYMBOL_GPL(crypticusb_submit_frame);
+EXPORT_SYMBOL_GPL(crypticusb_release_chain);
+EXPORT_SYMBOL_GPL(crypticusb_frame_batch);
+EXPORT_SYMBOL_GPL(crypticusb_submit);
 EXPORT_SYMBOL_GPL(crypticusb_init);
 EXPORT_SYMBOL_GPL(crypticusb_exit);
 EXPORT_SYMBOL_GPL(crypticusb_isConnected);
+EXPORT_SYMBOL_GPL(crypticusb_debugfs_root);
@@ -9,6 +9,7 @@
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
+#include <linux/debugfs.h>
 
 #ifndef CRYPTIC_DEV_VENDOR_ID
 #error Undefined CryptIC device vendor ID
@@ -20,13 +21,113 @@
 
 #define CRYPTIC_DEV_NAME "cryptIC"
 
+/* Frame format: every frame sent to the device and every response it sends back starts with a
+ * struct crypticusb_hdr followed by len bytes of payload. Bump the version on incompatible changes */
+#define CRYPTICUSB_MAGIC 0xC7
+#define CRYPTICUSB_PROTO_VERSION 1
+
+/* Largest frame payload the driver supports, the actual limit is negotiated with the device at probe time */
+#define CRYPTICUSB_MAX_PAYLOAD 8192
+
+/* Smallest frame payload a device must accept */
+#define CRYPTICUSB_MIN_PAYLOAD 512
+
+/* HASH frames start with the chaining state the device resumes from, this many bytes */
+#define CRYPTICUSB_CHAIN_STATE_LEN 32
+
+/* Most messages carried by a BATCH frame */
+#define CRYPTICUSB_BATCH_MAX 16
+
+/* Largest response payload the device may send back for a frame, that of a full BATCH frame */
+#define CRYPTICUSB_RSP_MAX_LEN (CRYPTICUSB_BATCH_MAX * CRYPTICUSB_CHAIN_STATE_LEN)
+
+/* The device keeps up to this many chaining states, one per slot. The upper bits of the flags of a HASH
+ * frame select the slot its state is loaded into, or resumed from with CRYPTICUSB_FLAG_CHAINED. In a
+ * HELLO response they give the number of slots minus one, older devices have a single slot */
+#define CRYPTICUSB_MAX_SLOTS 16
+#define CRYPTICUSB_SLOT_SHIFT 4
+#define CRYPTICUSB_FLAG_SLOT(slot) ((slot) << CRYPTICUSB_SLOT_SHIFT)
+
+enum crypticusb_opcode {
+    CRYPTICUSB_OP_HELLO = 0,                   /* protocol negotiation, see struct crypticusb_hello */
+    CRYPTICUSB_OP_HASH = 1,                    /* hash a chunk of message, see struct cryptpb */
+    CRYPTICUSB_OP_BAUD = 2,                    /* change the serial link rate, see struct crypticusb_baud */
+    CRYPTICUSB_OP_TEST = 3,                    /* check the link, see struct crypticusb_test */
+    CRYPTICUSB_OP_BATCH = 4                    /* hash several short messages, see struct crypticusb_batch */
+};
+
+enum crypticusb_flags {
+    /* In a HELLO response: the device keeps the state it returned for the last HASH frame of each slot.
+     * In a HASH frame: the chaining state is left out, the device resumes from the state it returned for
+     * the previous frame of the slot. A device without a state answers with an empty payload */
+    CRYPTICUSB_FLAG_CHAINED = 1 << 0,
+    /* In a HELLO response: the device accepts BAUD and TEST frames */
+    CRYPTICUSB_FLAG_LINK = 1 << 1,
+    /* In a HELLO response: the device accepts BATCH frames */
+    CRYPTICUSB_FLAG_BATCH = 1 << 2
+};
+
+/* Header of frames and responses. The sequence number is assigned by the transport and echoed by the
+ * device to match responses with frames */
+struct crypticusb_hdr {
+    u8 magic;                                  /* CRYPTICUSB_MAGIC, to find the start of a frame */
+    u8 version;                                /* CRYPTICUSB_PROTO_VERSION */
+    u8 opcode;                                 /* enum crypticusb_opcode, echoed in the response */
+    u8 flags;                                  /* enum crypticusb_flags */
+    __le32 seq;
+    __le32 len;                                /* payload bytes following the header */
+} __packed;
+
+/* Payload of HELLO frames: each side advertises the largest frame payload it accepts */
+struct crypticusb_hello {
+    __le32 max_payload;
+} __packed;
+
+/* Payload of BAUD frames and of their response. The device answers at the current rate with the rate it
+ * switches to, or 0 if it cannot. It goes back to the old rate unless a valid frame arrives within
+ * CRYPTICUSB_BAUD_CONFIRM_MS */
+struct crypticusb_baud {
+    __le32 rate;                               /* bits per second */
+} __packed;
+#define CRYPTICUSB_BAUD_CONFIRM_MS 1000
+
+/* Response to TEST frames, whose payload is any len bytes */
+struct crypticusb_test {
+    __le32 len;                                /* payload bytes received */
+    __le32 sum;                                /* sum of the payload bytes */
+} __packed;
+
+/* Payload of BATCH frames: count independent messages, each one a struct crypticusb_batch_msg followed by its
+ * blocks, padded by the host. Every message is hashed from the SHA-256 initial state and the slots are left
+ * alone. The response holds the final state of each message, CRYPTICUSB_CHAIN_STATE_LEN bytes each, in
+ * order. A device that cannot take count messages answers with an empty payload */
+struct crypticusb_batch {
+    __le32 count;                              /* messages, at most CRYPTICUSB_BATCH_MAX */
+} __packed;
+
+struct crypticusb_batch_msg {
+    __le32 blocks;                             /* 64-byte blocks of the message, padding included */
+} __packed;
+
+/* Completion callback of a submitted frame, may be called in atomic context */
+typedef void (*crypticusb_complete_t)(void *context, int status);
+
+/* Frame buffer lent by the transport */
+struct crypticusb_wbuf;
+
 /* USB module setup */
 int crypticusb_init(void);
 void crypticusb_exit(void);
 
 /* USB module interface */
-ssize_t crypticusb_send(const char *buffer, size_t count);
-ssize_t crypticusb_read(char *buffer, size_t count);
+void *crypticusb_get_frame(struct crypticusb_wbuf **handle, size_t *size, u64 chain);
+void crypticusb_put_frame(struct crypticusb_wbuf *handle);
+int crypticusb_submit_frame(struct crypticusb_wbuf *handle, size_t count, u8 *rsp, size_t rsp_len,
+                            crypticusb_complete_t done, void *context, u64 *chain);
+void crypticusb_release_chain(u64 chain);
+unsigned int crypticusb_frame_batch(struct crypticusb_wbuf *handle);
+int crypticusb_submit(const void *frame, size_t count, u8 *rsp, size_t rsp_len, crypticusb_complete_t done, void *context);
 int crypticusb_isConnected(void);
+struct dentry *crypticusb_debugfs_root(void);
 
 #endif //CRYPTIC_CRYPTICUSB_H
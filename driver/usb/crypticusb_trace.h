@@ -0,0 +1,82 @@
+/* Tracepoints of the USB transport, see Documentation/trace/events.rst. They cost a branch when
+ * tracing is off, enable them with e.g. echo 1 > /sys/kernel/tracing/events/crypticusb/enable */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM crypticusb
+
+#if !defined(CRYPTIC_CRYPTICUSB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define CRYPTIC_CRYPTICUSB_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+/* A frame was handed to the host controller */
+TRACE_EVENT(crypticusb_submit,
+    TP_PROTO(struct usb_device *udev, u32 seq, size_t len, unsigned int in_flight),
+    TP_ARGS(udev, seq, len, in_flight),
+    TP_STRUCT__entry(
+        __field(int, busnum)
+        __field(int, devnum)
+        __field(u32, seq)
+        __field(size_t, len)
+        __field(unsigned int, in_flight)
+    ),
+    TP_fast_assign(
+        __entry->busnum = udev->bus->busnum;
+        __entry->devnum = udev->devnum;
+        __entry->seq = seq;
+        __entry->len = len;
+        __entry->in_flight = in_flight;
+    ),
+    TP_printk("dev=%d-%d seq=%u len=%zu in_flight=%u", __entry->busnum, __entry->devnum, __entry->seq,
+              __entry->len, __entry->in_flight)
+);
+
+/* A frame was answered, or given up on when status is negative. The latency runs from its submission */
+TRACE_EVENT(crypticusb_complete,
+    TP_PROTO(struct usb_device *udev, u32 seq, size_t len, int status, s64 latency_ns),
+    TP_ARGS(udev, seq, len, status, latency_ns),
+    TP_STRUCT__entry(
+        __field(int, busnum)
+        __field(int, devnum)
+        __field(u32, seq)
+        __field(size_t, len)
+        __field(int, status)
+        __field(s64, latency_ns)
+    ),
+    TP_fast_assign(
+        __entry->busnum = udev->bus->busnum;
+        __entry->devnum = udev->devnum;
+        __entry->seq = seq;
+        __entry->len = len;
+        __entry->status = status;
+        __entry->latency_ns = latency_ns;
+    ),
+    TP_printk("dev=%d-%d seq=%u len=%zu status=%d latency_ns=%lld", __entry->busnum, __entry->devnum,
+              __entry->seq, __entry->len, __entry->status, (long long) __entry->latency_ns)
+);
+
+/* A transfer failed or the device sent something unexpected */
+TRACE_EVENT(crypticusb_error,
+    TP_PROTO(struct usb_device *udev, int status),
+    TP_ARGS(udev, status),
+    TP_STRUCT__entry(
+        __field(int, busnum)
+        __field(int, devnum)
+        __field(int, status)
+    ),
+    TP_fast_assign(
+        __entry->busnum = udev->bus->busnum;
+        __entry->devnum = udev->devnum;
+        __entry->status = status;
+    ),
+    TP_printk("dev=%d-%d status=%d", __entry->busnum, __entry->devnum, __entry->status)
+);
+
+#endif //CRYPTIC_CRYPTICUSB_TRACE_H
+
+/* Out of tree: the header is found through the include path set in the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE crypticusb_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,298 @@
+
+/*************************** HEADER FILES ***************************/
+#include <stdio.h>
+#include <string.h>
+#include "sha256.h"
+
+// Benchmark of the compression function, in cycles per 64-byte block, and of sha256_main_loop on a
+// whole message, in cycles per byte.
+// On the host the cycles come from the time stamp counter, on an ATmega328P (e.g. under simavr)
+// from Timer1 running at the CPU clock. The result is compared with the straightforward transform
+// with a 64-word schedule the firmware used before, and checked against known digests.
+
+/****************************** MACROS ******************************/
+#ifdef __AVR__
+#define BENCH_BLOCKS 16
+#else
+#define BENCH_BLOCKS 8192
+#endif
+#define BENCH_RUNS 25
+#define BENCH_MESSAGE 1024
+
+/*************************** REFERENCE ******************************/
+#define REF_ROTRIGHT(a,b) (((a) >> (b)) | ((a) << (32-(b))))
+#define REF_CH(x,y,z) (((x) & (y)) ^ (~(x) & (z)))
+#define REF_MAJ(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define REF_EP0(x) (REF_ROTRIGHT(x,2) ^ REF_ROTRIGHT(x,13) ^ REF_ROTRIGHT(x,22))
+#define REF_EP1(x) (REF_ROTRIGHT(x,6) ^ REF_ROTRIGHT(x,11) ^ REF_ROTRIGHT(x,25))
+#define REF_SIG0(x) (REF_ROTRIGHT(x,7) ^ REF_ROTRIGHT(x,18) ^ ((x) >> 3))
+#define REF_SIG1(x) (REF_ROTRIGHT(x,17) ^ REF_ROTRIGHT(x,19) ^ ((x) >> 10))
+
+static const WORD ref_k[64] = {
+	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+	0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+	0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+	0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+	0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+	0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+	0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+	0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+static void ref_transform(SHA256_CTX *ctx, const BYTE data[])
+{
+	WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
+
+	for (i = 0, j = 0; i < 16; ++i, j += 4)
+		m[i] = ((WORD) data[j] << 24) | ((WORD) data[j + 1] << 16) | ((WORD) data[j + 2] << 8) | (data[j + 3]);
+	for ( ; i < 64; ++i)
+		m[i] = REF_SIG1(m[i - 2]) + m[i - 7] + REF_SIG0(m[i - 15]) + m[i - 16];
+
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+	e = ctx->state[4];
+	f = ctx->state[5];
+	g = ctx->state[6];
+	h = ctx->state[7];
+
+	for (i = 0; i < 64; ++i) {
+		t1 = h + REF_EP1(e) + REF_CH(e,f,g) + ref_k[i] + m[i];
+		t2 = REF_EP0(a) + REF_MAJ(a,b,c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
+
+// The main loop as it was, copying every byte to the context before hashing it
+static void ref_main_loop(SHA256_CTX *ctx, const BYTE data[], size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		ctx->data[ctx->datalen] = data[i];
+		ctx->datalen++;
+		if (ctx->datalen == 64) {
+			sha256_transform(ctx, ctx->data);
+			ctx->bitlen += 512;
+			ctx->datalen = 0;
+		}
+	}
+}
+
+/***************************** CYCLES *******************************/
+#if defined(__AVR__)
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+static volatile uint32_t overflows;
+
+ISR(TIMER1_OVF_vect)
+{
+	overflows += 0x10000;
+}
+
+static uint32_t cycles(void)
+{
+	uint32_t high;
+	uint16_t low;
+
+	cli();
+	low = TCNT1;
+	high = overflows;
+	// An overflow that happened while interrupts were off is still pending
+	if (TIFR1 & _BV(TOV1) && low < 0x8000)
+		high += 0x10000;
+	sei();
+	return high + low;
+}
+
+static int uart_putchar(char c, FILE *stream)
+{
+	(void) stream;
+	while (!(UCSR0A & _BV(UDRE0)))
+		;
+	UDR0 = c;
+	return 0;
+}
+
+static FILE uart = FDEV_SETUP_STREAM(uart_putchar, NULL, _FDEV_SETUP_WRITE);
+
+static void setup(void)
+{
+	// 115200 baud at 16 MHz, simavr does not care
+	UBRR0 = 8;
+	UCSR0B = _BV(TXEN0);
+	stdout = &uart;
+	TCCR1A = 0;
+	TCCR1B = _BV(CS10);
+	TIMSK1 = _BV(TOIE1);
+	sei();
+}
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static unsigned long long cycles(void)
+{
+	return __rdtsc();
+}
+
+static void setup(void)
+{
+}
+#else
+#include <time.h>
+
+// No cycle counter: nanoseconds, which are cycles at 1 GHz
+static unsigned long long cycles(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void setup(void)
+{
+}
+#endif
+
+/*********************** FUNCTION DEFINITIONS ***********************/
+// Best of a few runs of BENCH_BLOCKS transforms, in cycles per block
+static unsigned long bench(void (*transform)(SHA256_CTX *, const BYTE []), SHA256_CTX *ctx, const BYTE block[])
+{
+	unsigned long best = (unsigned long) -1, run;
+	unsigned long long start;
+	long i;
+	int r;
+
+	for (r = 0; r < BENCH_RUNS; ++r) {
+		start = cycles();
+		for (i = 0; i < BENCH_BLOCKS; ++i)
+			transform(ctx, block);
+		run = (unsigned long) ((cycles() - start) / BENCH_BLOCKS);
+		if (run < best)
+			best = run;
+	}
+	return best;
+}
+
+// Best of a few runs hashing the message, in cycles per 100 bytes
+static unsigned long bench_loop(void (*main_loop)(SHA256_CTX *, const BYTE [], size_t), const BYTE message[])
+{
+	unsigned long best = (unsigned long) -1, run;
+	unsigned long long start;
+	SHA256_CTX ctx;
+	long i;
+	int r;
+
+	for (r = 0; r < BENCH_RUNS; ++r) {
+		sha256_init(&ctx);
+		start = cycles();
+		for (i = 0; i < BENCH_BLOCKS * 64 / BENCH_MESSAGE; ++i)
+			main_loop(&ctx, message, BENCH_MESSAGE);
+		run = (unsigned long) ((cycles() - start) * 100 / ((unsigned long long) BENCH_BLOCKS * 64));
+		if (run < best)
+			best = run;
+	}
+	return best;
+}
+
+static int check_digest(const char *text, const char *expected)
+{
+	SHA256_CTX ctx;
+	BYTE hash[SHA256_BLOCK_SIZE];
+	char hex[2 * SHA256_BLOCK_SIZE + 1];
+	int i;
+
+	sha256(&ctx, (const BYTE *) text, strlen(text), hash);
+	for (i = 0; i < SHA256_BLOCK_SIZE; ++i)
+		sprintf(hex + 2 * i, "%02x", hash[i]);
+	if (strcmp(hex, expected) != 0) {
+		printf("wrong digest of \"%s\": %s\n", text, hex);
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	static BYTE message[BENCH_MESSAGE];
+	SHA256_CTX ctx, ref;
+	BYTE block[64];
+	unsigned long fast, slow;
+	size_t len, step;
+	int i, errors = 0;
+
+	setup();
+
+	errors += check_digest("", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+	errors += check_digest("abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	errors += check_digest("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+	                       "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+	// Both transforms must follow the same chain of states
+	for (i = 0; i < 64; ++i)
+		block[i] = i * 37 + 11;
+	sha256_init(&ctx);
+	sha256_init(&ref);
+	for (i = 0; i < 64; ++i) {
+		block[i] ^= ctx.state[i & 7];
+		sha256_transform(&ctx, block);
+		ref_transform(&ref, block);
+	}
+	if (memcmp(ctx.state, ref.state, sizeof(ctx.state)) != 0) {
+		printf("transform does not match the reference\n");
+		errors++;
+	}
+
+	// Both main loops must give the same state, whatever the sizes of the updates
+	for (i = 0; i < BENCH_MESSAGE; ++i)
+		message[i] = i * 131 + 7;
+	for (step = 1; step <= 200; step += 13) {
+		sha256_init(&ctx);
+		sha256_init(&ref);
+		for (len = 0; len < BENCH_MESSAGE; len += step) {
+			sha256_main_loop(&ctx, message + len, len + step < BENCH_MESSAGE ? step : BENCH_MESSAGE - len);
+			ref_main_loop(&ref, message + len, len + step < BENCH_MESSAGE ? step : BENCH_MESSAGE - len);
+		}
+		if (memcmp(ctx.state, ref.state, sizeof(ctx.state)) != 0 || ctx.bitlen != ref.bitlen ||
+		    ctx.datalen != ref.datalen || memcmp(ctx.data, ref.data, ctx.datalen) != 0) {
+			printf("main loop does not match the reference with updates of %u bytes\n", (unsigned) step);
+			errors++;
+		}
+	}
+
+	fast = bench(sha256_transform, &ctx, block);
+	slow = bench(ref_transform, &ref, block);
+	printf("sha256_transform: %lu cycles/block, reference: %lu cycles/block\n", fast, slow);
+	fast = bench_loop(sha256_main_loop, message);
+	slow = bench_loop(ref_main_loop, message);
+	printf("sha256_main_loop: %lu.%02lu cycles/byte, byte by byte: %lu.%02lu cycles/byte\n",
+	       fast / 100, fast % 100, slow / 100, slow % 100);
+	printf("%s\n", errors ? "FAILED" : "OK");
+
+#ifdef __AVR__
+	// Sleeping with interrupts off stops simavr
+	cli();
+	sleep_cpu();
+#endif
+	return errors != 0;
+}
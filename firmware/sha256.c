@@ -8,13 +8,59 @@
 
 #define CH(x,y,z) (((x) & (y)) ^ (~(x) & (z)))
 #define MAJ(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+#if defined(__AVR__) || defined(SHA256_BYTE_ROTATIONS)
+// An 8-bit core shifts one bit at a time, but rotating by whole bytes only moves registers around:
+// every rotation is split into a byte rotation and a shift of at most 3 bits.
+#define ROTR8(x) ROTRIGHT(x,8)
+#define ROTR16(x) ROTRIGHT(x,16)
+#define ROTR24(x) ROTRIGHT(x,24)
+#define EP0(x) (ROTRIGHT(x,2) ^ ROTLEFT(ROTR16(x),3) ^ ROTLEFT(ROTR24(x),2))
+#define EP1(x) (ROTLEFT(ROTR8(x),2) ^ ROTRIGHT(ROTR8(x),3) ^ ROTRIGHT(ROTR24(x),1))
+#define SIG0(x) (ROTLEFT(ROTR8(x),1) ^ ROTRIGHT(ROTR16(x),2) ^ ((x) >> 3))
+#define SIG1(x) (ROTRIGHT(ROTR16(x),1) ^ ROTRIGHT(ROTR16(x),3) ^ (((x) >> 8) >> 2))
+#else
 #define EP0(x) (ROTRIGHT(x,2) ^ ROTRIGHT(x,13) ^ ROTRIGHT(x,22))
 #define EP1(x) (ROTRIGHT(x,6) ^ ROTRIGHT(x,11) ^ ROTRIGHT(x,25))
 #define SIG0(x) (ROTRIGHT(x,7) ^ ROTRIGHT(x,18) ^ ((x) >> 3))
 #define SIG1(x) (ROTRIGHT(x,17) ^ ROTRIGHT(x,19) ^ ((x) >> 10))
+#endif
+
+// The message schedule is a ring of 16 words: W(i) holds m[i], which replaces m[i - 16]
+#define W(i) w[(i) & 15]
+#define LOAD(i) (W(i) = ((WORD) data[4 * (i)] << 24) | ((WORD) data[4 * (i) + 1] << 16) | \
+                        ((WORD) data[4 * (i) + 2] << 8) | ((WORD) data[4 * (i) + 3]))
+#define SCHEDULE(i) (W(i) += SIG1(W((i) - 2)) + W((i) - 7) + SIG0(W((i) - 15)))
+
+// One round. Instead of shifting the eight working variables, the next round names them differently
+#define ROUND(a,b,c,d,e,f,g,h,i) do { \
+		t1 = h + EP1(e) + CH(e,f,g) + K(i) + ((i) < 16 ? LOAD(i) : SCHEDULE(i)); \
+		d += t1; \
+		h = t1 + EP0(a) + MAJ(a,b,c); \
+	} while (0)
+
+// Eight rounds bring the variables back to their names
+#define ROUNDS8(i) do { \
+		ROUND(a,b,c,d,e,f,g,h,(i) + 0); \
+		ROUND(h,a,b,c,d,e,f,g,(i) + 1); \
+		ROUND(g,h,a,b,c,d,e,f,(i) + 2); \
+		ROUND(f,g,h,a,b,c,d,e,(i) + 3); \
+		ROUND(e,f,g,h,a,b,c,d,(i) + 4); \
+		ROUND(d,e,f,g,h,a,b,c,(i) + 5); \
+		ROUND(c,d,e,f,g,h,a,b,(i) + 6); \
+		ROUND(b,c,d,e,f,g,h,a,(i) + 7); \
+	} while (0)
 
 /**************************** VARIABLES *****************************/
+#ifdef __AVR__
+// Keep the constants in flash, RAM is scarce
+#include <avr/pgmspace.h>
+#define K(i) pgm_read_dword(&k[i])
+static const WORD k[64] PROGMEM = {
+#else
+#define K(i) k[i]
 static const WORD k[64] = {
+#endif
 	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
 	0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
 	0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
@@ -26,14 +72,14 @@ static const WORD k[64] = {
 };
 
 /*********************** FUNCTION DEFINITIONS ***********************/
+// Compression function: 16 words of schedule instead of 64, and the 64 rounds fully unrolled.
+// Define SHA256_SMALL to keep a loop over groups of 8 rounds when flash is short.
 void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 {
-	WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
-
-	for (i = 0, j = 0; i < 16; ++i, j += 4)
-		m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
-	for ( ; i < 64; ++i)
-		m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+	WORD a, b, c, d, e, f, g, h, t1, w[16];
+#ifdef SHA256_SMALL
+	WORD i;
+#endif
 
 	a = ctx->state[0];
 	b = ctx->state[1];
@@ -44,18 +90,19 @@ void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 	g = ctx->state[6];
 	h = ctx->state[7];
 
-	for (i = 0; i < 64; ++i) {
-		t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
-		t2 = EP0(a) + MAJ(a,b,c);
-		h = g;
-		g = f;
-		f = e;
-		e = d + t1;
-		d = c;
-		c = b;
-		b = a;
-		a = t1 + t2;
-	}
+#ifdef SHA256_SMALL
+	for (i = 0; i < 64; i += 8)
+		ROUNDS8(i);
+#else
+	ROUNDS8(0);
+	ROUNDS8(8);
+	ROUNDS8(16);
+	ROUNDS8(24);
+	ROUNDS8(32);
+	ROUNDS8(40);
+	ROUNDS8(48);
+	ROUNDS8(56);
+#endif
 
 	ctx->state[0] += a;
 	ctx->state[1] += b;
@@ -83,17 +130,28 @@ void sha256_init(SHA256_CTX *ctx)
 
 void sha256_main_loop(SHA256_CTX *ctx, const BYTE data[], size_t len)
 {
-    //main loop
-	for (int i = 0; i < len; ++i) {
-		ctx->data[ctx->datalen] = data[i];
-		ctx->datalen++;
-		if (ctx->datalen == 64) {
-			sha256_transform(ctx, ctx->data);
-			ctx->bitlen += 512;
-			ctx->datalen = 0;
-		}
+	size_t i = 0, n;
+
+	// Complete a block left over by a previous call
+	if (ctx->datalen > 0) {
+		n = 64 - ctx->datalen < len ? 64 - ctx->datalen : len;
+		memcpy(ctx->data + ctx->datalen, data, n);
+		ctx->datalen += n;
+		i = n;
+		if (ctx->datalen < 64)
+			return;
+		sha256_transform(ctx, ctx->data);
+		ctx->bitlen += 512;
+		ctx->datalen = 0;
 	}
 
+	// Whole blocks are hashed where they are, only a final partial block is copied
+	for ( ; len - i >= 64; i += 64) {
+		sha256_transform(ctx, data + i);
+		ctx->bitlen += 512;
+	}
+	memcpy(ctx->data, data + i, len - i);
+	ctx->datalen = len - i;
 }
 
 void sha256_final(SHA256_CTX *ctx, BYTE hash[])
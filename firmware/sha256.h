@@ -4,15 +4,16 @@
 
 /*************************** HEADER FILES ***************************/
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <memory.h>
+#include <string.h>
 
 /****************************** MACROS ******************************/
 #define SHA256_BLOCK_SIZE 32            // SHA256 outputs a 32 byte digest
 
 /**************************** DATA TYPES ****************************/
 typedef unsigned char BYTE;             // 8-bit byte
-typedef unsigned int  WORD;             // 32-bit word, change to "long" for 16-bit machines
+typedef uint32_t WORD;                  // 32-bit word, also on 8 and 16-bit machines
 
 typedef struct {
 	BYTE data[64];
@@ -22,6 +23,10 @@ typedef struct {
 } SHA256_CTX;
 
 /*********************** FUNCTION DECLARATIONS **********************/
+void sha256_transform(SHA256_CTX *ctx, const BYTE data[]);
+void sha256_init(SHA256_CTX *ctx);
+void sha256_main_loop(SHA256_CTX *ctx, const BYTE data[], size_t len);
+void sha256_final(SHA256_CTX *ctx, BYTE hash[]);
 void sha256(SHA256_CTX *ctx, const BYTE data[], size_t len, BYTE hash[]);
 
 #endif   // SHA256_H
@@ -0,0 +1,367 @@
+/*
+ * AF_ALG benchmark: hashes messages through the userspace interface of the Crypto API with several
+ * clients at once and reports the aggregate throughput, the latency distribution of single hashes and
+ * the CPU time they cost. Every digest is checked against a reference implementation, also reached
+ * through AF_ALG so that no crypto library is needed.
+ *
+ * Each of the N sockets is a transformation bound to the algorithm under test, they are spread over
+ * M threads which hash on their sockets in turn with blocking calls. Messages are written with send,
+ * or with vmsplice and splice to skip the copy into the socket (-z).
+ *
+ *   ./afalg_bench -n 8 -t 4 -s 64,4096,65536 -d 5
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/if_alg.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+
+#define DIGEST_SIZE 32
+#define MAX_SIZES 32
+#define MAX_SAMPLES (1 << 20)
+
+/* Options */
+static const char *alg = "cryptic-sha256";
+static const char *ref = "sha256-generic";
+static unsigned int n_sockets = 1;
+static unsigned int n_threads = 1;
+static unsigned int duration = 3;
+static int zero_copy;
+static size_t sizes[MAX_SIZES] = {16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576};
+static unsigned int n_sizes = 9;
+
+/* State of a run, shared by the threads */
+static const uint8_t *message;
+static size_t message_len;
+static uint8_t expected[DIGEST_SIZE];
+static atomic_int stop;
+static pthread_barrier_t start_barrier;
+
+struct client {
+    pthread_t thread;
+    int *ops;                   /* op sockets of this thread, one per transformation */
+    unsigned int n_ops;
+    uint64_t *samples;          /* latency of each hash, in ns */
+    size_t n_samples;
+    uint64_t hashes;
+    uint64_t errors;            /* failed calls */
+    uint64_t mismatches;        /* wrong digests */
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Open a transformation of the given driver and an op socket on it, returns the op socket or -1 */
+static int alg_open(const char *name, int *tfm) {
+    struct sockaddr_alg sa = {.salg_family = AF_ALG, .salg_type = "hash"};
+    int op;
+
+    strncpy((char *) sa.salg_name, name, sizeof(sa.salg_name) - 1);
+    *tfm = socket(AF_ALG, SOCK_SEQPACKET, 0);
+    if (*tfm < 0)
+        return -1;
+    if (bind(*tfm, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+        close(*tfm);
+        return -1;
+    }
+    op = accept(*tfm, NULL, 0);
+    if (op < 0)
+        close(*tfm);
+    return op;
+}
+
+/* Move len bytes into the socket through a pipe, without copying them */
+static int splice_all(int op, int pipefd[2], const uint8_t *buf, size_t len) {
+    struct iovec iov;
+    ssize_t in, out;
+
+    while (len > 0) {
+        iov.iov_base = (void *) buf;
+        iov.iov_len = len;
+        in = vmsplice(pipefd[1], &iov, 1, 0);
+        if (in <= 0)
+            return -1;
+        buf += in;
+        len -= in;
+        /* More data to come: the hash must not be finalized yet */
+        while (in > 0) {
+            out = splice(pipefd[0], NULL, op, NULL, in, len > 0 ? SPLICE_F_MORE : 0);
+            if (out <= 0)
+                return -1;
+            in -= out;
+        }
+    }
+    return 0;
+}
+
+/* Hash the message on an op socket, through the pipe if there is one */
+static int hash_once(int op, int pipefd[2], const uint8_t *buf, size_t len, uint8_t *digest) {
+    if (len > 0) {
+        if (pipefd[0] >= 0) {
+            if (splice_all(op, pipefd, buf, len) < 0)
+                return -1;
+        } else if (send(op, buf, len, 0) != (ssize_t) len) {
+            return -1;
+        }
+    }
+    return read(op, digest, DIGEST_SIZE) == DIGEST_SIZE ? 0 : -1;
+}
+
+static void *client_run(void *arg) {
+    struct client *c = arg;
+    uint8_t digest[DIGEST_SIZE];
+    int pipefd[2] = {-1, -1};
+    unsigned int next = 0;
+    uint64_t start;
+
+    if (zero_copy && pipe(pipefd) < 0)
+        c->errors++;
+    pthread_barrier_wait(&start_barrier);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed) && c->errors == 0) {
+        start = now_ns();
+        if (hash_once(c->ops[next], pipefd, message, message_len, digest) < 0) {
+            c->errors++;
+            break;
+        }
+        if (c->n_samples < MAX_SAMPLES)
+            c->samples[c->n_samples++] = now_ns() - start;
+        if (memcmp(digest, expected, DIGEST_SIZE) != 0)
+            c->mismatches++;
+        c->hashes++;
+        next = (next + 1) % c->n_ops;
+    }
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Busy and total jiffies of all the CPUs, from /proc/stat */
+static void cpu_times(uint64_t *busy, uint64_t *total) {
+    unsigned long long v[8] = {0};
+    FILE *f = fopen("/proc/stat", "r");
+    int i;
+
+    *busy = *total = 0;
+    if (!f)
+        return;
+    if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+               &v[6], &v[7]) == 8) {
+        for (i = 0; i < 8; i++)
+            *total += v[i];
+        /* idle and iowait */
+        *busy = *total - v[3] - v[4];
+    }
+    fclose(f);
+}
+
+static double rusage_seconds(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* Run every client on the current message for the configured duration and print one line */
+static int run_size(struct client *clients) {
+    uint64_t start, elapsed, busy0, total0, busy1, total1, hashes = 0, errors = 0, mismatches = 0;
+    uint64_t *all;
+    size_t n_all = 0;
+    double cpu0, cpu;
+    unsigned int t;
+
+    atomic_store(&stop, 0);
+    for (t = 0; t < n_threads; t++) {
+        clients[t].n_samples = clients[t].hashes = clients[t].errors = clients[t].mismatches = 0;
+        if (pthread_create(&clients[t].thread, NULL, client_run, &clients[t]) != 0)
+            return -1;
+    }
+    cpu_times(&busy0, &total0);
+    cpu0 = rusage_seconds();
+    start = now_ns();
+    pthread_barrier_wait(&start_barrier);
+    sleep(duration);
+    atomic_store(&stop, 1);
+    for (t = 0; t < n_threads; t++)
+        pthread_join(clients[t].thread, NULL);
+    elapsed = now_ns() - start;
+    cpu = rusage_seconds() - cpu0;
+    cpu_times(&busy1, &total1);
+
+    for (t = 0; t < n_threads; t++) {
+        hashes += clients[t].hashes;
+        errors += clients[t].errors;
+        mismatches += clients[t].mismatches;
+        n_all += clients[t].n_samples;
+    }
+    all = malloc((n_all ? n_all : 1) * sizeof(*all));
+    if (!all)
+        return -1;
+    n_all = 0;
+    for (t = 0; t < n_threads; t++) {
+        memcpy(all + n_all, clients[t].samples, clients[t].n_samples * sizeof(*all));
+        n_all += clients[t].n_samples;
+    }
+    qsort(all, n_all, sizeof(*all), cmp_u64);
+
+    printf("%9zu %10.2f %10.0f", message_len, hashes * message_len / (elapsed / 1e3), hashes / (elapsed / 1e9));
+    if (n_all > 0)
+        printf(" %9.1f %9.1f %9.1f %9.1f", all[(n_all - 1) / 2] / 1e3, all[(n_all - 1) * 9 / 10] / 1e3,
+               all[(n_all - 1) * 99 / 100] / 1e3, all[n_all - 1] / 1e3);
+    else
+        printf(" %9s %9s %9s %9s", "-", "-", "-", "-");
+    printf(" %7.1f %7.1f %7llu %7llu\n", 100.0 * cpu / (elapsed / 1e9),
+           total1 > total0 ? 100.0 * (busy1 - busy0) / (total1 - total0) : 0.0, (unsigned long long) errors,
+           (unsigned long long) mismatches);
+    fflush(stdout);
+    free(all);
+    return errors || mismatches ? 1 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-a alg] [-r ref] [-n sockets] [-t threads] [-s size,...] [-d seconds] [-z]\n"
+            "  -a  driver under test, default %s\n"
+            "  -r  reference driver checking the digests, default %s, empty to trust the driver\n"
+            "  -n  sockets bound to the driver, spread over the threads\n"
+            "  -t  client threads\n"
+            "  -s  message sizes in bytes\n"
+            "  -d  seconds spent on each size\n"
+            "  -z  zero-copy: vmsplice and splice instead of send\n", prog, alg, ref);
+}
+
+static int parse_sizes(char *list) {
+    char *tok, *save = NULL;
+
+    n_sizes = 0;
+    for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (n_sizes == MAX_SIZES)
+            return -1;
+        sizes[n_sizes++] = strtoull(tok, NULL, 0);
+    }
+    return n_sizes > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    struct client *clients;
+    size_t max_len = 0;
+    uint8_t *buf;
+    int *tfms, *ops;
+    int opt, status = 0, ref_tfm, ref_op = -1, pipefd[2] = {-1, -1};
+    unsigned int i;
+
+    while ((opt = getopt(argc, argv, "a:r:n:t:s:d:zh")) != -1) {
+        switch (opt) {
+            case 'a': alg = optarg; break;
+            case 'r': ref = optarg; break;
+            case 'n': n_sockets = strtoul(optarg, NULL, 0); break;
+            case 't': n_threads = strtoul(optarg, NULL, 0); break;
+            case 's':
+                if (parse_sizes(optarg) < 0) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'd': duration = strtoul(optarg, NULL, 0); break;
+            case 'z': zero_copy = 1; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (n_threads == 0 || n_sockets < n_threads) {
+        fprintf(stderr, "need at least one thread and one socket per thread\n");
+        return 2;
+    }
+
+    for (i = 0; i < n_sizes; i++)
+        max_len = sizes[i] > max_len ? sizes[i] : max_len;
+    /* Page aligned, so that vmsplice can take whole pages */
+    if (posix_memalign((void **) &buf, 4096, max_len ? max_len : 1) != 0)
+        return 1;
+    srand(1);
+    for (i = 0; i < max_len; i++)
+        buf[i] = rand();
+    message = buf;
+
+    tfms = calloc(n_sockets, sizeof(*tfms));
+    ops = calloc(n_sockets, sizeof(*ops));
+    clients = calloc(n_threads, sizeof(*clients));
+    if (!tfms || !ops || !clients)
+        return 1;
+    for (i = 0; i < n_sockets; i++) {
+        ops[i] = alg_open(alg, &tfms[i]);
+        if (ops[i] < 0) {
+            fprintf(stderr, "cannot open %s: %s\n", alg, strerror(errno));
+            return 1;
+        }
+    }
+    /* Sockets are dealt to the threads in turn */
+    for (i = 0; i < n_threads; i++) {
+        clients[i].ops = calloc(n_sockets / n_threads + 1, sizeof(int));
+        clients[i].samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+        if (!clients[i].ops || !clients[i].samples)
+            return 1;
+    }
+    for (i = 0; i < n_sockets; i++) {
+        struct client *c = &clients[i % n_threads];
+        c->ops[c->n_ops++] = ops[i];
+    }
+    if (ref[0] != '\0') {
+        ref_op = alg_open(ref, &ref_tfm);
+        if (ref_op < 0) {
+            fprintf(stderr, "cannot open reference %s: %s\n", ref, strerror(errno));
+            return 1;
+        }
+    }
+    pthread_barrier_init(&start_barrier, NULL, n_threads + 1);
+
+    printf("# %s, %u sockets, %u threads, %s, %us per size, checked against %s\n", alg, n_sockets, n_threads,
+           zero_copy ? "splice" : "send", duration, ref_op >= 0 ? ref : "nothing");
+    printf("# %7s %10s %10s %9s %9s %9s %9s %7s %7s %7s %7s\n", "bytes", "MB/s", "ops/s", "p50 us", "p90 us",
+           "p99 us", "max us", "cpu %", "sys %", "errors", "wrong");
+    for (i = 0; i < n_sizes; i++) {
+        message_len = sizes[i];
+        /* The reference digest, or the driver's own first one when there is no reference */
+        if (hash_once(ref_op >= 0 ? ref_op : ops[0], pipefd, message, message_len, expected) < 0) {
+            fprintf(stderr, "hashing %zu bytes failed: %s\n", message_len, strerror(errno));
+            return 1;
+        }
+        status |= run_size(clients);
+    }
+
+    for (i = 0; i < n_sockets; i++) {
+        close(ops[i]);
+        close(tfms[i]);
+    }
+    if (ref_op >= 0) {
+        close(ref_op);
+        close(ref_tfm);
+    }
+    return status;
+}
@@ -9,8 +9,27 @@
 /****************************** MACROS ******************************/
 #define SHA256_BLOCK_SIZE 64            
 #define SHA256_DIGEST_SIZE 32
-#define CRYPTIC_N_BLOCKS 2
-#define CRYPTIC_BUF_LEN SHA256_BLOCK_SIZE*CRYPTIC_N_BLOCKS
+
+/* Frame format, must match the driver (usb/crypticusb.h) */
+#define CRYPTIC_MAGIC 0xC7
+#define CRYPTIC_PROTO_VERSION 1
+#define CRYPTIC_OP_HELLO 0
+#define CRYPTIC_OP_HASH 1
+#define CRYPTIC_OP_BAUD 2
+#define CRYPTIC_OP_TEST 3
+#define CRYPTIC_OP_BATCH 4
+#define CRYPTIC_FLAG_CHAINED 0x01
+#define CRYPTIC_FLAG_LINK 0x02
+#define CRYPTIC_FLAG_BATCH 0x04
+/* Upper bits of the flags: slot of a HASH frame, number of slots minus one in the HELLO response */
+#define CRYPTIC_SLOT_SHIFT 4
+#define CRYPTIC_SLOTS 8
+/* A new link rate is dropped unless it is confirmed by a second BAUD frame within this time */
+#define CRYPTIC_BAUD_CONFIRM_MS 1000
+/* The message is streamed one block at a time, so frames are not bounded by the RAM */
+#define CRYPTIC_MAX_PAYLOAD 8192
+/* Most messages of a BATCH frame */
+#define CRYPTIC_BATCH_MAX 16
 
 /**************************** DATA TYPES ****************************/
 typedef byte BYTE;             // 8-bit byte
@@ -23,13 +42,21 @@ typedef struct {
   WORD state[8];
 } SHA256_CTX;
 
+typedef struct {
+  u8 magic;
+  u8 version;
+  u8 opcode;
+  u8 flags;
+  u32 seq;
+  u32 len;     // payload bytes following the header
+} FrameHeader;
+
+// Parameters of a HASH frame, followed by len bytes of message, a multiple of the block size.
+// The host pads the message, the device only runs the compression function and returns the state.
+// Chained frames leave out the state: the device resumes from the one it returned for the last frame
 typedef struct cryptpb {
-  u8 message[CRYPTIC_BUF_LEN];
   u8 in_partial_digest[SHA256_DIGEST_SIZE];
   u32 len;
-  u32 finalize;
-  u32 bitlen;
-  u8 digest[SHA256_DIGEST_SIZE];
 } CryptICData;
 
 
@@ -38,13 +65,51 @@ typedef struct cryptpb {
 
 #define CH(x,y,z) (((x) & (y)) ^ (~(x) & (z)))
 #define MAJ(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
-#define EP0(x) (ROTRIGHT(x,2) ^ ROTRIGHT(x,13) ^ ROTRIGHT(x,22))
-#define EP1(x) (ROTRIGHT(x,6) ^ ROTRIGHT(x,11) ^ ROTRIGHT(x,25))
-#define SIG0(x) (ROTRIGHT(x,7) ^ ROTRIGHT(x,18) ^ ((x) >> 3))
-#define SIG1(x) (ROTRIGHT(x,17) ^ ROTRIGHT(x,19) ^ ((x) >> 10))
+
+// The AVR shifts one bit at a time, but rotating by whole bytes only moves registers around:
+// every rotation is a byte rotation and a shift of at most 3 bits (same as firmware/sha256.c)
+#define ROTR8(x) ROTRIGHT(x,8)
+#define ROTR16(x) ROTRIGHT(x,16)
+#define ROTR24(x) ROTRIGHT(x,24)
+#define EP0(x) (ROTRIGHT(x,2) ^ ROTLEFT(ROTR16(x),3) ^ ROTLEFT(ROTR24(x),2))
+#define EP1(x) (ROTLEFT(ROTR8(x),2) ^ ROTRIGHT(ROTR8(x),3) ^ ROTRIGHT(ROTR24(x),1))
+#define SIG0(x) (ROTLEFT(ROTR8(x),1) ^ ROTRIGHT(ROTR16(x),2) ^ ((x) >> 3))
+#define SIG1(x) (ROTRIGHT(ROTR16(x),1) ^ ROTRIGHT(ROTR16(x),3) ^ (((x) >> 8) >> 2))
+
+// The message schedule is a ring of 16 words: W(i) holds m[i], which replaces m[i - 16]
+#define W(i) w[(i) & 15]
+#define LOAD(i) (W(i) = ((WORD) data[4 * (i)] << 24) | ((WORD) data[4 * (i) + 1] << 16) | \
+                        ((WORD) data[4 * (i) + 2] << 8) | ((WORD) data[4 * (i) + 3]))
+#define SCHEDULE(i) (W(i) += SIG1(W((i) - 2)) + W((i) - 7) + SIG0(W((i) - 15)))
+
+// One round. Instead of shifting the eight working variables, the next round names them differently
+#define ROUND(a,b,c,d,e,f,g,h,i) do { \
+    t1 = h + EP1(e) + CH(e,f,g) + K(i) + ((i) < 16 ? LOAD(i) : SCHEDULE(i)); \
+    d += t1; \
+    h = t1 + EP0(a) + MAJ(a,b,c); \
+  } while (0)
+
+// Eight rounds bring the variables back to their names
+#define ROUNDS8(i) do { \
+    ROUND(a,b,c,d,e,f,g,h,(i) + 0); \
+    ROUND(h,a,b,c,d,e,f,g,(i) + 1); \
+    ROUND(g,h,a,b,c,d,e,f,(i) + 2); \
+    ROUND(f,g,h,a,b,c,d,e,(i) + 3); \
+    ROUND(e,f,g,h,a,b,c,d,(i) + 4); \
+    ROUND(d,e,f,g,h,a,b,c,(i) + 5); \
+    ROUND(c,d,e,f,g,h,a,b,(i) + 6); \
+    ROUND(b,c,d,e,f,g,h,a,(i) + 7); \
+  } while (0)
 
 /**************************** VARIABLES *****************************/
+// The constants stay in flash, RAM is scarce
+#ifdef __AVR__
+#define K(i) pgm_read_dword(&k[i])
+static const WORD k[64] PROGMEM = {
+#else
+#define K(i) k[i]
 static const WORD k[64] = {
+#endif
   0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
   0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
   0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
@@ -55,19 +120,17 @@ static const WORD k[64] = {
   0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
 };
 
+// Initial state of the messages of a BATCH frame
+static const WORD iv[8] = {
+  0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19
+};
+
 /*********************** FUNCTION DEFINITIONS ***********************/
+// Compression function: 16 words of schedule instead of 64, and the 64 rounds fully unrolled.
+// Define SHA256_SMALL to keep a loop over groups of 8 rounds when flash is short.
 void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 {
-  WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
-
-  for (i = 0, j = 0; i < 16; ++i, j += 4) {
-    m[i] =    ((WORD) data[j] << 24) 
-            | ((WORD) data[j + 1] << 16) 
-            | ((WORD) data[j + 2] << 8) 
-            | ((WORD) data[j + 3]);
-  }
-  for ( ; i < 64; ++i)
-    m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+  WORD a, b, c, d, e, f, g, h, t1, w[16];
 
   a = ctx->state[0];
   b = ctx->state[1];
@@ -78,18 +141,19 @@ void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
   g = ctx->state[6];
   h = ctx->state[7];
 
-  for (i = 0; i < 64; ++i) {
-    t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
-    t2 = EP0(a) + MAJ(a,b,c);
-    h = g;
-    g = f;
-    f = e;
-    e = d + t1;
-    d = c;
-    c = b;
-    b = a;
-    a = t1 + t2;
-  }
+#ifdef SHA256_SMALL
+  for (u8 i = 0; i < 64; i += 8)
+    ROUNDS8(i);
+#else
+  ROUNDS8(0);
+  ROUNDS8(8);
+  ROUNDS8(16);
+  ROUNDS8(24);
+  ROUNDS8(32);
+  ROUNDS8(40);
+  ROUNDS8(48);
+  ROUNDS8(56);
+#endif
 
   ctx->state[0] += a;
   ctx->state[1] += b;
@@ -109,115 +173,356 @@ void sha256_init(SHA256_CTX *ctx,BYTE in_partial_digest[])
   memcpy(ctx->state, in_partial_digest, SHA256_DIGEST_SIZE);
 }
 
-void sha256_main_loop(SHA256_CTX *ctx, const BYTE data[], size_t len)
-{
-    //main loop
-  for (int i = 0; i < len; ++i) {
-    ctx->data[ctx->datalen] = data[i];
-    ctx->datalen++;
-    if (ctx->datalen == 64) {
-      sha256_transform(ctx, ctx->data);
-      ctx->bitlen += 512;
-      ctx->datalen = 0;
-    }
-  }
+/* Arduino code **************************************************************/
+#define PIN_LED 13
+#define BAUD 9600
+#define RX_TIMEOUT_MS 5000
+
+// State returned for the last HASH frame of each slot, a chained frame resumes from it. Each slot
+// holds a different message, so that frames of several messages can interleave
+static WORD resident[CRYPTIC_SLOTS][8];
+static bool resident_valid[CRYPTIC_SLOTS];
+
+#ifdef USBCON
+// Boards with native USB, like the Leonardo, are a CDC device: the link runs at USB speed whatever the
+// rate, and Serial buffers it
+void link_begin() {
+  Serial.begin(BAUD);
+}
+
+u8 rx_avail() {
+  int avail = Serial.available();
 
+  return avail > 255 ? 255 : avail;
 }
 
-void sha256_final(SHA256_CTX *ctx, BYTE hash[], u32 bitlen)
-{
-  WORD i;
+byte rx_take() {
+  return Serial.read();
+}
 
-  i = ctx->datalen;
+void tx_write(const byte src[], u32 len) {
+  Serial.write(src, len);
+}
 
-  // Pad whatever data is left in the buffer.
-  if (ctx->datalen < 56) {
-    ctx->data[i++] = 0x80;
-    while (i < 56)
-      ctx->data[i++] = 0x00;
-  }
-  else {
-    ctx->data[i++] = 0x80;
-    while (i < 64)
-      ctx->data[i++] = 0x00;
-    sha256_transform(ctx, ctx->data);
-    //memset(ctx->data, 0, 56);
-    for (int ii = 0; ii < 56; ii++)
-    {
-      ctx->data[ii] = 0x0;
-    }
+bool link_rate(u32 rate, uint16_t *ubrr) {
+  return false;
+}
+
+void link_switch(u32 rate, uint16_t ubrr) {
+}
+
+bool link_check() {
+  return true;
+}
+#else
+// The UART is driven by interrupts instead of Serial, whose 64-byte buffer would overflow while a
+// block is hashed at higher rates. The next blocks, or the next frame, keep arriving in the receive
+// ring while a block is hashed, and responses leave from the transmit ring while the next frame is
+// hashed. The receive ring has a byte index, so it wraps for free
+#define RX_RING 256
+#define TX_RING 64
+
+static volatile byte rx_ring[RX_RING];
+static volatile u8 rx_head;            // written by the interrupt
+static u8 rx_tail;
+static volatile byte tx_ring[TX_RING];
+static u8 tx_head;
+static volatile u8 tx_tail;            // written by the interrupt
+
+// Rate switched to by a BAUD frame and not confirmed yet, 0 if none, and the divisor to go back to
+static u32 baud_pending;
+static unsigned long baud_since;
+static uint16_t baud_prev;
+
+ISR(USART_RX_vect) {
+  byte c = UDR0;
+  u8 next = rx_head + 1;
+
+  // A full ring drops the byte. The frame is then cut short and not answered: the driver fails it once
+  // its rsp_timeout_ms deadline passes, and the firmware looks for the magic of the next header
+  if (next != rx_tail) {
+    rx_ring[rx_head] = c;
+    rx_head = next;
   }
+}
 
-  // Append to the padding the total message's length in bits and transform.
-  //ctx->bitlen += ctx->datalen * 8;
-  ctx->bitlen = bitlen;
-  ctx->data[63] = ctx->bitlen;
-  ctx->data[62] = ctx->bitlen >> 8;
-  ctx->data[61] = ctx->bitlen >> 16;
-  ctx->data[60] = ctx->bitlen >> 24;
-  ctx->data[59] = ctx->bitlen >> 32;
-  ctx->data[58] = ctx->bitlen >> 40;
-  ctx->data[57] = ctx->bitlen >> 48;
-  ctx->data[56] = ctx->bitlen >> 56;
-  sha256_transform(ctx, ctx->data);
-
-  // Since this implementation uses little endian byte ordering and SHA uses big endian,
-  // reverse all the bytes when copying the final state to the output hash.
-  for (i = 0; i < 4; ++i) {
-    hash[i]      = (ctx->state[0] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 4]  = (ctx->state[1] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 8]  = (ctx->state[2] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 12] = (ctx->state[3] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 16] = (ctx->state[4] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 20] = (ctx->state[5] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 24] = (ctx->state[6] >> (24 - i * 8)) & 0x000000ff;
-    hash[i + 28] = (ctx->state[7] >> (24 - i * 8)) & 0x000000ff;
+ISR(USART_UDRE_vect) {
+  if (tx_tail == tx_head) {
+    UCSR0B &= ~_BV(UDRIE0);
+    return;
   }
+  UDR0 = tx_ring[tx_tail];
+  tx_tail = (tx_tail + 1) % TX_RING;
 }
 
-void sha256(SHA256_CTX *ctx, const BYTE data[], size_t len, BYTE hash[], BYTE in_partial_digest[], u8 finalize, u32 bitlen)
-{
+void link_begin() {
+  // 8N1 at double speed, like Serial.begin
+  UCSR0A = _BV(U2X0);
+  UBRR0 = (F_CPU / 4 / BAUD - 1) / 2;
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+}
 
-    sha256_init(ctx,in_partial_digest);
+u8 rx_avail() {
+  return rx_head - rx_tail;
+}
 
-    sha256_main_loop(ctx, data, len);
+byte rx_take() {
+  return rx_ring[rx_tail++];
+}
 
-    if (finalize != 0) {
-        sha256_final(ctx, hash, bitlen);
-    }
-    else{
-        memcpy(hash, ctx->state, SHA256_DIGEST_SIZE);
-    }
+void tx_write(const byte src[], u32 len) {
+  u8 next;
+
+  for (; len > 0; len--) {
+    next = (tx_head + 1) % TX_RING;
+    while (next == tx_tail);
+    tx_ring[tx_head] = *src++;
+    tx_head = next;
+    // Writing 1 clears the transmit complete flag, link_switch waits for it
+    UCSR0A |= _BV(TXC0);
+    UCSR0B |= _BV(UDRIE0);
+  }
+}
 
-    
+// Divisor for rate at double speed, false if it is more than 2.5% off (115200 is 2.1% off at 16 MHz)
+bool link_rate(u32 rate, uint16_t *ubrr) {
+  u32 actual;
+
+  if (rate == 0 || rate > F_CPU / 8 || (F_CPU / 4 / rate - 1) / 2 > 4095)
+    return false;
+  *ubrr = (F_CPU / 4 / rate - 1) / 2;
+  actual = F_CPU / 8 / (*ubrr + 1);
+  return (actual > rate ? actual - rate : rate - actual) <= rate / 40;
 }
 
-/* Arduino code **************************************************************/
-#define PIN_LED 13
-const unsigned rx_data_size = offsetof(CryptICData, digest);
+// Switch once the response to the BAUD frame is out, what arrives meanwhile is garbage
+void link_switch(u32 rate, uint16_t ubrr) {
+  while (tx_head != tx_tail);
+  while (!(UCSR0A & _BV(TXC0)));
+  if (baud_pending == 0)
+    baud_prev = UBRR0;
+  UBRR0 = ubrr;
+  rx_tail = rx_head;
+  baud_pending = rate;
+  baud_since = millis();
+}
 
-CryptICData data;
+// Go back to the previous rate when a new one is not confirmed in time, false if so
+bool link_check() {
+  if (baud_pending == 0 || millis() - baud_since <= CRYPTIC_BAUD_CONFIRM_MS)
+    return true;
+  baud_pending = 0;
+  UBRR0 = baud_prev;
+  rx_tail = rx_head;
+  return false;
+}
+#endif
+
+// Take len bytes from the link, or drop them if dst is NULL. Fails if the host stays silent, or if
+// the link goes back to its previous rate meanwhile
+bool rx_read(byte dst[], u32 len) {
+  unsigned long last = millis();
+  u8 avail;
+  byte c;
+
+  while (len > 0) {
+    avail = rx_avail();
+    if (avail == 0) {
+      if (!link_check() || millis() - last > RX_TIMEOUT_MS)
+        return false;
+      continue;
+    }
+    for (; avail > 0 && len > 0; avail--, len--) {
+      c = rx_take();
+      if (dst != NULL)
+        *dst++ = c;
+    }
+    last = millis();
+  }
+  return true;
+}
 
 void setup() {
-	Serial.begin(9600);
-  Serial.setTimeout(5000);
+  link_begin();
   // Pin for status signalling
   pinMode(PIN_LED, OUTPUT);
 }
 
+// Write a response, preceded by the header of the frame it answers. Without a payload only the header
+// goes out, the caller writes the len bytes that follow
+void reply(const FrameHeader *hdr, u8 flags, const byte payload[], u32 len) {
+  FrameHeader rsp = *hdr;
+
+  rsp.version = CRYPTIC_PROTO_VERSION;
+  rsp.flags = flags;
+  rsp.len = len;
+  tx_write((byte*) &rsp, sizeof(rsp));
+  if (payload != NULL)
+    tx_write(payload, len);
+}
+
+// Advertise the protocol version, the largest payload accepted and the resident states
+void hello(const FrameHeader *hdr) {
+  u32 max_payload = CRYPTIC_MAX_PAYLOAD;
+
+  if (!rx_read(NULL, hdr->len))
+    return;
+  memset(resident_valid, 0, sizeof(resident_valid));
+  reply(hdr, CRYPTIC_FLAG_CHAINED | CRYPTIC_FLAG_LINK | CRYPTIC_FLAG_BATCH | ((CRYPTIC_SLOTS - 1) << CRYPTIC_SLOT_SHIFT),
+        (byte*) &max_payload, sizeof(max_payload));
+}
+
+// Change the link rate: the response goes at the current rate, then the link switches. The same
+// rate again confirms it, otherwise link_check goes back
+void baud(const FrameHeader *hdr) {
+  u32 rate;
+  uint16_t ubrr;
+
+  if (hdr->len != sizeof(rate)) {
+    rx_read(NULL, hdr->len);
+    return;
+  }
+  if (!rx_read((byte*) &rate, sizeof(rate)))
+    return;
+#ifndef USBCON
+  if (baud_pending != 0 && rate == baud_pending) {
+    baud_pending = 0;
+    reply(hdr, 0, (byte*) &rate, sizeof(rate));
+    return;
+  }
+#endif
+  if (!link_rate(rate, &ubrr))
+    rate = 0;
+  reply(hdr, 0, (byte*) &rate, sizeof(rate));
+  if (rate != 0)
+    link_switch(rate, ubrr);
+}
+
+// Check the link: answer with the number and the sum of the bytes received
+void test(const FrameHeader *hdr) {
+  BYTE block[SHA256_BLOCK_SIZE];
+  u32 rsp[2] = {hdr->len, 0};
+  u32 left, chunk, i;
+
+  for (left = hdr->len; left > 0; left -= chunk) {
+    chunk = left < sizeof(block) ? left : sizeof(block);
+    if (!rx_read(block, chunk))
+      return;
+    for (i = 0; i < chunk; i++)
+      rsp[1] += block[i];
+  }
+  reply(hdr, 0, (byte*) rsp, sizeof(rsp));
+}
+
+void hash(const FrameHeader *hdr) {
+  CryptICData data;
+  SHA256_CTX ctx;
+  BYTE block[SHA256_BLOCK_SIZE];
+  bool chained = hdr->flags & CRYPTIC_FLAG_CHAINED;
+  u8 slot = hdr->flags >> CRYPTIC_SLOT_SHIFT;
+  // Chained frames start at the length
+  u32 size = chained ? sizeof(data.len) : sizeof(data);
+  u32 left;
+
+  if (slot >= CRYPTIC_SLOTS || (chained && !resident_valid[slot])) {
+    // Nothing to resume from, e.g. after a reset: an empty response has the driver send the state again
+    if (rx_read(NULL, hdr->len))
+      reply(hdr, 0, NULL, 0);
+    return;
+  }
+  if (!rx_read((byte*) &data + sizeof(data) - size, size))
+    return;
+  if (chained) {
+    ctx.datalen = 0;
+    ctx.bitlen = 0;
+    memcpy(ctx.state, resident[slot], SHA256_DIGEST_SIZE);
+  } else {
+    sha256_init(&ctx, data.in_partial_digest);
+  }
+  resident_valid[slot] = false;
+
+  // Stream the message through the compression function one block at a time
+  for (left = data.len; left >= SHA256_BLOCK_SIZE; left -= SHA256_BLOCK_SIZE) {
+    if (!rx_read(block, SHA256_BLOCK_SIZE))
+      return;
+    sha256_transform(&ctx, block);
+  }
+  if (!rx_read(NULL, left))
+    return;
+  memcpy(resident[slot], ctx.state, SHA256_DIGEST_SIZE);
+  resident_valid[slot] = true;
+  reply(hdr, 0, (byte*) ctx.state, SHA256_DIGEST_SIZE);
+}
+
+// Hash several short messages, each one preceded by its number of blocks and padded by the host. The
+// header promises the states of all of them, so nothing goes out before the whole frame is received:
+// a frame cut short is not answered and the driver times it out
+static WORD batch_states[CRYPTIC_BATCH_MAX][8];
+
+void batch(const FrameHeader *hdr) {
+  SHA256_CTX ctx;
+  BYTE block[SHA256_BLOCK_SIZE];
+  u32 count, blocks, n;
+  u32 left = hdr->len;
+
+  if (left < sizeof(count)) {
+    rx_read(NULL, left);
+    return;
+  }
+  if (!rx_read((byte*) &count, sizeof(count)))
+    return;
+  left -= sizeof(count);
+  if (count > CRYPTIC_BATCH_MAX) {
+    // An empty response fails the frame
+    if (rx_read(NULL, left))
+      reply(hdr, 0, NULL, 0);
+    return;
+  }
+
+  for (n = 0; n < count; n++) {
+    blocks = 0;
+    if (left >= sizeof(blocks)) {
+      if (!rx_read((byte*) &blocks, sizeof(blocks)))
+        return;
+      left -= sizeof(blocks);
+    }
+    memcpy(ctx.state, iv, SHA256_DIGEST_SIZE);
+    for (; blocks > 0 && left >= SHA256_BLOCK_SIZE; blocks--, left -= SHA256_BLOCK_SIZE) {
+      if (!rx_read(block, SHA256_BLOCK_SIZE))
+        return;
+      sha256_transform(&ctx, block);
+    }
+    memcpy(batch_states[n], ctx.state, SHA256_DIGEST_SIZE);
+  }
+  if (!rx_read(NULL, left))
+    return;
+  reply(hdr, 0, (byte*) batch_states, count * SHA256_DIGEST_SIZE);
+}
 
 void loop() {
-  // Receive data
-  while (Serial.available() <= 0);
-  
-  Serial.readBytes((byte*) &data, rx_data_size);
+  FrameHeader hdr;
+
+  // Look for the start of a frame
+  if (!rx_read(&hdr.magic, 1) || hdr.magic != CRYPTIC_MAGIC)
+    return;
+  if (!rx_read(((byte*) &hdr) + 1, sizeof(hdr) - 1))
+    return;
   digitalWrite(PIN_LED, HIGH);
-  
-	//Compute the sha256 of the received string
-  SHA256_CTX ctx;
-  sha256(&ctx, data.message, data.len, data.digest, data.in_partial_digest, data.finalize, data.bitlen);
-    
-	//Write the result on USB
-  Serial.write((byte*) data.digest, SHA256_DIGEST_SIZE);
+
+  if (hdr.opcode == CRYPTIC_OP_HELLO)
+    hello(&hdr);
+  else if (hdr.version != CRYPTIC_PROTO_VERSION)
+    rx_read(NULL, hdr.len);
+  else if (hdr.opcode == CRYPTIC_OP_HASH)
+    hash(&hdr);
+  else if (hdr.opcode == CRYPTIC_OP_BAUD)
+    baud(&hdr);
+  else if (hdr.opcode == CRYPTIC_OP_TEST)
+    test(&hdr);
+  else if (hdr.opcode == CRYPTIC_OP_BATCH)
+    batch(&hdr);
+  else
+    rx_read(NULL, hdr.len);
   digitalWrite(PIN_LED, LOW);
 }
@@ -0,0 +1,234 @@
+/*
+ * Batch benchmark: hashes many short messages, like keys or log lines, once through AF_ALG with a round
+ * trip per message and once through the batch ioctl of /dev/cryptic, and reports the throughput of each.
+ * Every digest is checked against a reference implementation reached through AF_ALG.
+ *
+ * Each batch holds B messages of the same size, made of random bytes; the run goes on for the given
+ * number of seconds per size and interface.
+ *
+ *   ./batch_bench -b 256 -s 32,64,200 -d 5
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/if_alg.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "cryptic_ioctl.h"
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+
+#define DIGEST_SIZE 32
+#define MAX_SIZES 32
+
+/* Options */
+static const char *alg = "cryptic-sha256";
+static const char *ref = "sha256-generic";
+static unsigned int batch = 256;
+static unsigned int duration = 3;
+static size_t sizes[MAX_SIZES] = {32, 64, 128, 200};
+static unsigned int n_sizes = 4;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Open a transformation of the given driver and an op socket on it, returns the op socket or -1 */
+static int alg_open(const char *name, int *tfm) {
+    struct sockaddr_alg sa = {.salg_family = AF_ALG, .salg_type = "hash"};
+    int op;
+
+    strncpy((char *) sa.salg_name, name, sizeof(sa.salg_name) - 1);
+    *tfm = socket(AF_ALG, SOCK_SEQPACKET, 0);
+    if (*tfm < 0)
+        return -1;
+    if (bind(*tfm, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+        close(*tfm);
+        return -1;
+    }
+    op = accept(*tfm, NULL, 0);
+    if (op < 0)
+        close(*tfm);
+    return op;
+}
+
+/* Hash every message of the batch on an op socket, one round trip each */
+static int hash_afalg(int op, const struct cryptic_ioc_batch *b) {
+    const struct cryptic_ioc_msg *msgs = (const struct cryptic_ioc_msg *) (uintptr_t) b->msgs;
+    uint8_t *digests = (uint8_t *) (uintptr_t) b->digests;
+    unsigned int i;
+
+    for (i = 0; i < b->count; i++) {
+        if (msgs[i].len > 0 && send(op, (void *) (uintptr_t) msgs[i].data, msgs[i].len, 0) != (ssize_t) msgs[i].len)
+            return -1;
+        if (read(op, digests + i * DIGEST_SIZE, DIGEST_SIZE) != DIGEST_SIZE)
+            return -1;
+    }
+    return 0;
+}
+
+/* Hash the whole batch with one call */
+static int hash_ioctl(int dev, const struct cryptic_ioc_batch *b) {
+    return ioctl(dev, CRYPTIC_IOC_SHA256_BATCH, b);
+}
+
+/* Hash batches for the configured duration and print one line, -1 on failure, 1 on wrong digests */
+static int run(const char *name, int fd, int (*hash)(int, const struct cryptic_ioc_batch *),
+               const struct cryptic_ioc_batch *b, const uint8_t *expected, size_t len) {
+    uint64_t start, elapsed, batches = 0, wrong = 0;
+
+    start = now_ns();
+    do {
+        memset((void *) (uintptr_t) b->digests, 0, (size_t) b->count * DIGEST_SIZE);
+        if (hash(fd, b) < 0) {
+            fprintf(stderr, "%s: hashing failed: %s\n", name, strerror(errno));
+            return -1;
+        }
+        if (memcmp((void *) (uintptr_t) b->digests, expected, (size_t) b->count * DIGEST_SIZE) != 0)
+            wrong++;
+        batches++;
+        elapsed = now_ns() - start;
+    } while (elapsed < duration * 1000000000ull);
+
+    printf("%9zu %8s %10.2f %12.0f %7llu\n", len, name, batches * b->count * len / (elapsed / 1e3),
+           batches * b->count / (elapsed / 1e9), (unsigned long long) wrong);
+    fflush(stdout);
+    return wrong ? 1 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-a alg] [-r ref] [-b messages] [-s size,...] [-d seconds]\n"
+            "  -a  driver compared with the batch ioctl through AF_ALG, default %s, empty to skip\n"
+            "  -r  reference driver checking the digests, default %s\n"
+            "  -b  messages per batch, at most %u\n"
+            "  -s  message sizes in bytes\n"
+            "  -d  seconds spent on each size and interface\n", prog, alg, ref, CRYPTIC_IOC_BATCH_MAX);
+}
+
+static int parse_sizes(char *list) {
+    char *tok, *save = NULL;
+
+    n_sizes = 0;
+    for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (n_sizes == MAX_SIZES)
+            return -1;
+        sizes[n_sizes++] = strtoull(tok, NULL, 0);
+    }
+    return n_sizes > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    struct cryptic_ioc_batch b = {0};
+    struct cryptic_ioc_msg *msgs;
+    uint8_t *data, *digests, *expected;
+    size_t max_len = 0;
+    int opt, status = 0, dev, tfm, op = -1, ref_tfm, ref_op, ret;
+    unsigned int i, j;
+
+    while ((opt = getopt(argc, argv, "a:r:b:s:d:h")) != -1) {
+        switch (opt) {
+            case 'a': alg = optarg; break;
+            case 'r': ref = optarg; break;
+            case 'b': batch = strtoul(optarg, NULL, 0); break;
+            case 's':
+                if (parse_sizes(optarg) < 0) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'd': duration = strtoul(optarg, NULL, 0); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (batch == 0 || batch > CRYPTIC_IOC_BATCH_MAX) {
+        usage(argv[0]);
+        return 2;
+    }
+    for (i = 0; i < n_sizes; i++)
+        max_len = sizes[i] > max_len ? sizes[i] : max_len;
+    if ((size_t) batch * max_len > CRYPTIC_IOC_BATCH_BYTES) {
+        fprintf(stderr, "a batch carries at most %u bytes\n", CRYPTIC_IOC_BATCH_BYTES);
+        return 2;
+    }
+
+    msgs = calloc(batch, sizeof(*msgs));
+    data = malloc((size_t) batch * max_len + 1);
+    digests = malloc((size_t) batch * DIGEST_SIZE);
+    expected = malloc((size_t) batch * DIGEST_SIZE);
+    if (!msgs || !data || !digests || !expected)
+        return 1;
+    srand(1);
+    for (i = 0; i < batch * max_len; i++)
+        data[i] = rand();
+    b.msgs = (uintptr_t) msgs;
+    b.digests = (uintptr_t) digests;
+    b.count = batch;
+
+    dev = open(CRYPTIC_IOC_DEVICE, O_RDWR);
+    if (dev < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", CRYPTIC_IOC_DEVICE, strerror(errno));
+        return 1;
+    }
+    if (alg[0] != '\0') {
+        op = alg_open(alg, &tfm);
+        if (op < 0) {
+            fprintf(stderr, "cannot open %s: %s\n", alg, strerror(errno));
+            return 1;
+        }
+    }
+    ref_op = alg_open(ref, &ref_tfm);
+    if (ref_op < 0) {
+        fprintf(stderr, "cannot open reference %s: %s\n", ref, strerror(errno));
+        return 1;
+    }
+
+    printf("# %u messages per batch, %us per size, %s against the batch ioctl, checked against %s\n", batch,
+           duration, op >= 0 ? alg : "nothing", ref);
+    printf("# %7s %8s %10s %12s %7s\n", "bytes", "path", "MB/s", "messages/s", "wrong");
+    for (i = 0; i < n_sizes; i++) {
+        for (j = 0; j < batch; j++) {
+            msgs[j].data = (uintptr_t) (data + (size_t) j * sizes[i]);
+            msgs[j].len = sizes[i];
+        }
+        b.digests = (uintptr_t) expected;
+        if (hash_afalg(ref_op, &b) < 0) {
+            fprintf(stderr, "hashing %zu bytes failed: %s\n", sizes[i], strerror(errno));
+            return 1;
+        }
+        b.digests = (uintptr_t) digests;
+        if (op >= 0) {
+            ret = run("afalg", op, hash_afalg, &b, expected, sizes[i]);
+            if (ret < 0)
+                return 1;
+            status |= ret;
+        }
+        ret = run("batch", dev, hash_ioctl, &b, expected, sizes[i]);
+        if (ret < 0)
+            return 1;
+        status |= ret;
+    }
+
+    if (op >= 0) {
+        close(op);
+        close(tfm);
+    }
+    close(ref_op);
+    close(ref_tfm);
+    close(dev);
+    return status;
+}
@@ -0,0 +1,9 @@
+#!/bin/bash
+# Run the in-kernel benchmark against the loaded cryptIC driver, extra arguments are passed to insmod,
+# e.g. ./bench_cryptic.sh iters=64 ref=sha256-avx2
+cd "$(dirname "$0")/../driver/test" || exit 1
+make || exit 1
+# The module always refuses to stay loaded, the results are in the kernel log
+sudo dmesg -C
+sudo insmod crypticbench.ko "$@"
+sudo dmesg | grep cryptic-bench
@@ -0,0 +1,309 @@
+/*
+ * Merkle tree benchmark: hashes a file once with plain SHA-256 through AF_ALG, whose throughput is bound
+ * by a single stream, then builds its Merkle tree through merkle-sha256 over AF_ALG and through the Merkle
+ * ioctl of /dev/cryptic, whose leaves are hashed in parallel, and reports the throughput of each.
+ * Every root is checked against a tree built here from a reference implementation reached through AF_ALG.
+ *
+ * Without a file, one of the given number of MiB of random bytes is made in /tmp. The AF_ALG tree is only
+ * built when the leaf size is that of the driver, see the merkle_leaf parameter.
+ *
+ *   ./merkle_bench -f disk.img -l 4096
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/if_alg.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "cryptic_ioctl.h"
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+
+#define DIGEST_SIZE 32
+#define CHUNK (1 << 20)
+#define MAX_LEVELS 16
+#define LEAF_PARAM "/sys/module/crypticintf/parameters/merkle_leaf"
+
+/* Options */
+static const char *sha = "cryptic-sha256";
+static const char *merkle = "cryptic-merkle-sha256";
+static const char *ref = "sha256-generic";
+static const char *path = NULL;
+static unsigned int leaf = 4096;
+static unsigned int mib = 256;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Open a transformation of the given driver and an op socket on it, returns the op socket or -1 */
+static int alg_open(const char *name, int *tfm) {
+    struct sockaddr_alg sa = {.salg_family = AF_ALG, .salg_type = "hash"};
+    int op;
+
+    strncpy((char *) sa.salg_name, name, sizeof(sa.salg_name) - 1);
+    *tfm = socket(AF_ALG, SOCK_SEQPACKET, 0);
+    if (*tfm < 0)
+        return -1;
+    if (bind(*tfm, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+        close(*tfm);
+        return -1;
+    }
+    op = accept(*tfm, NULL, 0);
+    if (op < 0)
+        close(*tfm);
+    return op;
+}
+
+/* Hash len bytes with one round trip */
+static int digest(int op, const uint8_t *data, size_t len, uint8_t *out) {
+    if (send(op, data, len, 0) != (ssize_t) len)
+        return -1;
+    return read(op, out, DIGEST_SIZE) == DIGEST_SIZE ? 0 : -1;
+}
+
+/* Stream the whole file through an op socket, returns the bytes hashed or -1 */
+static long long hash_stream(int op, int fd, uint8_t *buf, uint8_t *out) {
+    long long total = 0;
+    ssize_t n;
+
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        return -1;
+    while ((n = read(fd, buf, CHUNK)) > 0) {
+        if (send(op, buf, n, MSG_MORE) != n)
+            return -1;
+        total += n;
+    }
+    if (n < 0 || send(op, NULL, 0, 0) < 0 || read(op, out, DIGEST_SIZE) != DIGEST_SIZE)
+        return -1;
+    return total;
+}
+
+/* Build the tree here, one reference digest per block, keeping one block of digests per level */
+static long long hash_reference(int op, int fd, uint8_t *buf, uint8_t *out) {
+    static uint8_t levels[MAX_LEVELS][65536];
+    size_t fill[MAX_LEVELS] = {0}, blocks[MAX_LEVELS] = {0};
+    uint8_t node[DIGEST_SIZE];
+    long long total = 0;
+    unsigned int h;
+    ssize_t n, i;
+
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        return -1;
+    while ((n = read(fd, buf, CHUNK)) > 0) {
+        /* Reads end on leaf boundaries except at the end of the file */
+        for (i = 0; i < n; i += leaf) {
+            if (n - i < leaf)
+                memset(buf + n, 0, leaf - (n - i));
+            if (digest(op, buf + i, leaf, node) < 0)
+                return -1;
+            for (h = 0;; h++) {
+                if (h == MAX_LEVELS)
+                    return -1;
+                memcpy(levels[h] + fill[h], node, DIGEST_SIZE);
+                fill[h] += DIGEST_SIZE;
+                if (fill[h] < leaf)
+                    break;
+                if (digest(op, levels[h], leaf, node) < 0)
+                    return -1;
+                fill[h] = 0;
+                blocks[h]++;
+            }
+        }
+        total += n;
+    }
+    if (n < 0)
+        return -1;
+    memset(out, 0, DIGEST_SIZE);
+    for (h = 0; total > 0 && h < MAX_LEVELS; h++) {
+        /* A level made of a single digest is the root */
+        if (blocks[h] == 0 && fill[h] == DIGEST_SIZE) {
+            memcpy(out, levels[h], DIGEST_SIZE);
+            break;
+        }
+        if (fill[h] > 0) {
+            if (h + 1 == MAX_LEVELS)
+                return -1;
+            memset(levels[h] + fill[h], 0, leaf - fill[h]);
+            if (digest(op, levels[h], leaf, levels[h + 1] + fill[h + 1]) < 0)
+                return -1;
+            fill[h + 1] += DIGEST_SIZE;
+        }
+    }
+    return total;
+}
+
+/* Hash the whole file with one call */
+static long long hash_ioctl(int dev, int fd, uint8_t *root) {
+    struct cryptic_ioc_merkle m = {.fd = fd, .leaf_size = leaf, .offset = 0, .len = UINT64_MAX,
+                                   .root = (uintptr_t) root};
+
+    if (ioctl(dev, CRYPTIC_IOC_MERKLE_SHA256, &m) < 0)
+        return -1;
+    return m.len;
+}
+
+/* Print one line, 1 if the root is wrong */
+static int report(const char *name, long long len, uint64_t ns, const uint8_t *out, const uint8_t *expected) {
+    int wrong = expected && memcmp(out, expected, DIGEST_SIZE) != 0;
+
+    printf("%8s %10.2f %6s\n", name, len / (ns / 1e3), expected ? (wrong ? "wrong" : "ok") : "-");
+    fflush(stdout);
+    return wrong;
+}
+
+/* Leaf size of the merkle-sha256 driver, 0 if unknown */
+static unsigned int driver_leaf(void) {
+    unsigned int size = 0;
+    FILE *f = fopen(LEAF_PARAM, "r");
+
+    if (f) {
+        if (fscanf(f, "%u", &size) != 1)
+            size = 0;
+        fclose(f);
+    }
+    return size;
+}
+
+/* Fill a temporary file with random bytes, returns its descriptor */
+static int make_file(uint8_t *buf) {
+    char name[] = "/tmp/merkle_benchXXXXXX";
+    unsigned int i, j;
+    int fd = mkstemp(name);
+
+    if (fd < 0)
+        return -1;
+    unlink(name);
+    srand(1);
+    for (i = 0; i < mib; i++) {
+        for (j = 0; j < CHUNK; j++)
+            buf[j] = rand();
+        if (write(fd, buf, CHUNK) != CHUNK) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-f file | -n MiB] [-l leaf] [-s sha] [-m merkle] [-r ref]\n"
+            "  -f  file to hash, otherwise one of -n MiB of random bytes, default %u\n"
+            "  -l  leaf size, a power of 2 from 1024 to 65536, default %u\n"
+            "  -s  plain SHA-256 driver, default %s, empty to skip\n"
+            "  -m  Merkle tree driver reached through AF_ALG, default %s, empty to skip\n"
+            "  -r  reference driver checking the roots, default %s\n", prog, mib, leaf, sha, merkle, ref);
+}
+
+int main(int argc, char **argv) {
+    uint8_t *buf, out[DIGEST_SIZE], expected[DIGEST_SIZE];
+    int opt, status = 0, fd, dev, tfm, op, ref_tfm, ref_op;
+    long long len;
+    uint64_t start;
+
+    while ((opt = getopt(argc, argv, "f:n:l:s:m:r:h")) != -1) {
+        switch (opt) {
+            case 'f': path = optarg; break;
+            case 'n': mib = strtoul(optarg, NULL, 0); break;
+            case 'l': leaf = strtoul(optarg, NULL, 0); break;
+            case 's': sha = optarg; break;
+            case 'm': merkle = optarg; break;
+            case 'r': ref = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (leaf < 1024 || leaf > 65536 || (leaf & (leaf - 1)) != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    /* Room for a zero-padded last leaf */
+    buf = malloc(CHUNK + 65536);
+    if (!buf)
+        return 1;
+    fd = path ? open(path, O_RDONLY) : make_file(buf);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", path ? path : "a temporary file", strerror(errno));
+        return 1;
+    }
+    dev = open(CRYPTIC_IOC_DEVICE, O_RDWR);
+    if (dev < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", CRYPTIC_IOC_DEVICE, strerror(errno));
+        return 1;
+    }
+    ref_op = alg_open(ref, &ref_tfm);
+    if (ref_op < 0) {
+        fprintf(stderr, "cannot open reference %s: %s\n", ref, strerror(errno));
+        return 1;
+    }
+
+    len = hash_reference(ref_op, fd, buf, expected);
+    if (len < 0) {
+        fprintf(stderr, "reference tree failed: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("# %lld bytes, %u byte leaves, checked against %s\n", len, leaf, ref);
+    printf("# %6s %10s %6s\n", "path", "MB/s", "root");
+
+    if (sha[0] != '\0') {
+        op = alg_open(sha, &tfm);
+        if (op < 0) {
+            fprintf(stderr, "cannot open %s: %s\n", sha, strerror(errno));
+            return 1;
+        }
+        start = now_ns();
+        if (hash_stream(op, fd, buf, out) < 0) {
+            fprintf(stderr, "%s failed: %s\n", sha, strerror(errno));
+            return 1;
+        }
+        report("sha256", len, now_ns() - start, out, NULL);
+        close(op);
+        close(tfm);
+    }
+
+    if (merkle[0] != '\0' && driver_leaf() == leaf) {
+        op = alg_open(merkle, &tfm);
+        if (op < 0) {
+            fprintf(stderr, "cannot open %s: %s\n", merkle, strerror(errno));
+            return 1;
+        }
+        start = now_ns();
+        if (hash_stream(op, fd, buf, out) < 0) {
+            fprintf(stderr, "%s failed: %s\n", merkle, strerror(errno));
+            return 1;
+        }
+        status |= report("afalg", len, now_ns() - start, out, expected);
+        close(op);
+        close(tfm);
+    } else if (merkle[0] != '\0') {
+        printf("# AF_ALG skipped, the leaves of the driver are not %u bytes long\n", leaf);
+    }
+
+    start = now_ns();
+    if (hash_ioctl(dev, fd, out) != len) {
+        fprintf(stderr, "Merkle ioctl failed: %s\n", strerror(errno));
+        return 1;
+    }
+    status |= report("ioctl", len, now_ns() - start, out, expected);
+
+    close(ref_op);
+    close(ref_tfm);
+    close(dev);
+    close(fd);
+    return status;
+}
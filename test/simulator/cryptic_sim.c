@@ -0,0 +1,570 @@
+/*
+ * cryptIC device simulator: a FunctionFS gadget that answers the cryptIC USB protocol like the
+ * firmware in test/arduino_firmware, so that the driver, transport included, runs without the board.
+ * Bound to dummy_hcd it shows up on the same machine as 1a86:7523 with a pair of bulk endpoints,
+ * see cryptic_sim.sh which sets up the gadget and starts this program.
+ *
+ * The device handles one frame at a time like the real one. Its speed is configurable: a link
+ * bandwidth paces the bytes in both directions and each frame costs a fixed latency plus a time per
+ * block. Faults can be injected to exercise the error handling of the transport.
+ * Like the firmware it keeps the state of the last HASH frame of each slot for a chained frame, in as many
+ * slots as -n gives, none with -s, it hashes BATCH frames of several short messages unless -x is given,
+ * and it answers the link frames like a board with native USB: TEST frames are summed, BAUD frames
+ * are refused since there is no serial rate to change.
+ *
+ *   cryptic_sim [-b bytes/s] [-l frame latency ns] [-k block ns] [-m max payload] [-n slots] [-s] [-x]
+ *               [-c corrupt every Nth response] [-g garbage before every Nth response] ffs-dir
+ */
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+/* Frame format, must match the driver (driver/usb/crypticusb.h) */
+#define CRYPTIC_MAGIC 0xC7
+#define CRYPTIC_PROTO_VERSION 1
+#define CRYPTIC_OP_HELLO 0
+#define CRYPTIC_OP_HASH 1
+#define CRYPTIC_OP_BAUD 2
+#define CRYPTIC_OP_TEST 3
+#define CRYPTIC_OP_BATCH 4
+#define CRYPTIC_FLAG_CHAINED 0x01
+#define CRYPTIC_FLAG_LINK 0x02
+#define CRYPTIC_FLAG_BATCH 0x04
+#define CRYPTIC_SLOT_SHIFT 4
+#define CRYPTIC_MAX_SLOTS 16
+#define CRYPTIC_BATCH_MAX 16
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+/* Reads must not ask for more than a packet: a frame ending on a full packet is not followed by a
+ * short one, and a larger read would wait for the next frame */
+#define READ_SIZE 512
+#define MAX_PAYLOAD_LIMIT (1 << 20)
+
+/* Byte order of the static descriptors, htole32 cannot be used in initializers */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define LE16(x) (x)
+#define LE32(x) (x)
+#else
+#define LE16(x) __bswap_constant_16(x)
+#define LE32(x) __bswap_constant_32(x)
+#endif
+
+struct frame_header {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t seq;
+    uint32_t len;                /* payload bytes following the header */
+} __attribute__((packed));
+
+/* Parameters of a HASH frame, followed by len bytes of message, a multiple of the block size.
+ * Chained frames leave out the state */
+struct hash_params {
+    uint32_t state[SHA256_DIGEST_SIZE / 4];
+    uint32_t len;
+} __attribute__((packed));
+
+/* Options */
+static uint64_t bandwidth;       /* link bytes per second, 0 for unlimited */
+static uint64_t frame_ns;        /* compute time of each frame */
+static uint64_t block_ns;        /* compute time of each block */
+static uint32_t max_payload = 8192;
+static unsigned long corrupt_every;
+static unsigned long garbage_every;
+static unsigned int slots = CRYPTIC_MAX_SLOTS;
+static int batch_frames = 1;
+
+/* State returned for the last HASH frame of each slot, which a chained frame resumes from */
+static uint32_t resident[CRYPTIC_MAX_SLOTS][SHA256_DIGEST_SIZE / 4];
+static int resident_valid[CRYPTIC_MAX_SLOTS];
+
+static int ep_in = -1, ep_out = -1;
+/* Time the simulated device is busy until, in CLOCK_MONOTONIC ns */
+static uint64_t busy_until;
+
+/* FunctionFS descriptors: one vendor specific interface with a bulk endpoint in each direction,
+ * ep1 is OUT and ep2 is IN. Full and high speed, dummy_hcd runs at high speed */
+static const struct {
+    struct usb_functionfs_descs_head_v2 header;
+    __le32 fs_count;
+    __le32 hs_count;
+    struct {
+        struct usb_interface_descriptor intf;
+        struct usb_endpoint_descriptor_no_audio out;
+        struct usb_endpoint_descriptor_no_audio in;
+    } __attribute__((packed)) fs, hs;
+} __attribute__((packed)) descriptors = {
+    .header = {
+        .magic = LE32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+        .flags = LE32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC),
+        .length = LE32(sizeof(descriptors)),
+    },
+    .fs_count = LE32(3),
+    .hs_count = LE32(3),
+    .fs = {
+        .intf = {
+            .bLength = sizeof(descriptors.fs.intf),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+            .iInterface = 1,
+        },
+        .out = {
+            .bLength = sizeof(descriptors.fs.out),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = 1 | USB_DIR_OUT,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = LE16(64),
+        },
+        .in = {
+            .bLength = sizeof(descriptors.fs.in),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = 2 | USB_DIR_IN,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = LE16(64),
+        },
+    },
+    .hs = {
+        .intf = {
+            .bLength = sizeof(descriptors.hs.intf),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+            .iInterface = 1,
+        },
+        .out = {
+            .bLength = sizeof(descriptors.hs.out),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = 1 | USB_DIR_OUT,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = LE16(512),
+        },
+        .in = {
+            .bLength = sizeof(descriptors.hs.in),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = 2 | USB_DIR_IN,
+            .bmAttributes = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize = LE16(512),
+        },
+    },
+};
+
+#define INTERFACE_NAME "cryptIC simulator"
+
+static const struct {
+    struct usb_functionfs_strings_head header;
+    struct {
+        __le16 code;
+        const char name[sizeof(INTERFACE_NAME)];
+    } __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+    .header = {
+        .magic = LE32(FUNCTIONFS_STRINGS_MAGIC),
+        .length = LE32(sizeof(strings)),
+        .str_count = LE32(1),
+        .lang_count = LE32(1),
+    },
+    .lang0 = {LE16(0x0409), INTERFACE_NAME},
+};
+
+/* SHA-256 compression function, as in the firmware */
+#define ROTRIGHT(a, b) (((a) >> (b)) | ((a) << (32 - (b))))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define EP0(x) (ROTRIGHT(x, 2) ^ ROTRIGHT(x, 13) ^ ROTRIGHT(x, 22))
+#define EP1(x) (ROTRIGHT(x, 6) ^ ROTRIGHT(x, 11) ^ ROTRIGHT(x, 25))
+#define SIG0(x) (ROTRIGHT(x, 7) ^ ROTRIGHT(x, 18) ^ ((x) >> 3))
+#define SIG1(x) (ROTRIGHT(x, 17) ^ ROTRIGHT(x, 19) ^ ((x) >> 10))
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_transform(uint32_t state[8], const uint8_t data[SHA256_BLOCK_SIZE]) {
+    uint32_t a, b, c, d, e, f, g, h, t1, t2, m[64];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        m[i] = (uint32_t) data[4 * i] << 24 | (uint32_t) data[4 * i + 1] << 16 | (uint32_t) data[4 * i + 2] << 8 |
+               data[4 * i + 3];
+    for (; i < 64; i++)
+        m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + EP1(e) + CH(e, f, g) + k[i] + m[i];
+        t2 = EP0(a) + MAJ(a, b, c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/* Timing */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Keep the device busy for ns more, then wait until it is done */
+static void busy(uint64_t ns) {
+    struct timespec ts;
+    uint64_t now = now_ns();
+
+    if (busy_until < now)
+        busy_until = now;
+    busy_until += ns;
+    if (busy_until > now) {
+        ts.tv_sec = busy_until / 1000000000ull;
+        ts.tv_nsec = busy_until % 1000000000ull;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+}
+
+/* Time the link takes to carry len bytes */
+static uint64_t link_ns(size_t len) {
+    return bandwidth ? len * 1000000000ull / bandwidth : 0;
+}
+
+/* Receive stream: frames are read a packet at a time and consumed from this buffer */
+static uint8_t rx_buf[READ_SIZE];
+static size_t rx_pos, rx_len;
+
+static int rx_fill(void) {
+    ssize_t n;
+
+    do {
+        n = read(ep_out, rx_buf, sizeof(rx_buf));
+    } while (n < 0 && (errno == EINTR || errno == ESHUTDOWN));
+    if (n < 0)
+        return -1;
+    busy(link_ns(n));
+    rx_pos = 0;
+    rx_len = n;
+    return 0;
+}
+
+/* Read exactly len bytes of the stream, or skip them when buf is NULL */
+static int rx_read(void *buf, size_t len) {
+    size_t chunk;
+
+    while (len > 0) {
+        if (rx_pos == rx_len && rx_fill() < 0)
+            return -1;
+        chunk = rx_len - rx_pos < len ? rx_len - rx_pos : len;
+        if (buf) {
+            memcpy(buf, rx_buf + rx_pos, chunk);
+            buf = (uint8_t *) buf + chunk;
+        }
+        rx_pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Write to the host, what is written while it is gone is lost like on the wire */
+static int ep_write(const void *buf, size_t len) {
+    ssize_t n;
+
+    do {
+        n = write(ep_in, buf, len);
+    } while (n < 0 && errno == EINTR);
+    return n < 0 && errno != ESHUTDOWN ? -1 : 0;
+}
+
+/* Write a response, preceded by the header of the frame it answers */
+static int reply(const struct frame_header *hdr, uint8_t flags, const void *payload, uint32_t len) {
+    static unsigned long responses;
+    static const uint8_t garbage[] = {0x00, 0xff, CRYPTIC_MAGIC, 0x55};
+    uint8_t buf[sizeof(struct frame_header) + CRYPTIC_BATCH_MAX * SHA256_DIGEST_SIZE];
+    struct frame_header *rsp = (struct frame_header *) buf;
+
+    responses++;
+    *rsp = *hdr;
+    rsp->version = CRYPTIC_PROTO_VERSION;
+    rsp->flags = flags;
+    rsp->len = htole32(len);
+    if (corrupt_every && responses % corrupt_every == 0)
+        rsp->seq = htole32(le32toh(rsp->seq) + 1);
+    memcpy(buf + sizeof(*rsp), payload, len);
+    if (garbage_every && responses % garbage_every == 0 && ep_write(garbage, sizeof(garbage)) < 0)
+        return -1;
+    busy(link_ns(sizeof(*rsp) + len));
+    return ep_write(buf, sizeof(*rsp) + len);
+}
+
+static int hello(const struct frame_header *hdr) {
+    uint32_t payload = htole32(max_payload);
+    uint8_t flags = CRYPTIC_FLAG_LINK | (batch_frames ? CRYPTIC_FLAG_BATCH : 0);
+
+    if (rx_read(NULL, le32toh(hdr->len)) < 0)
+        return -1;
+    memset(resident_valid, 0, sizeof(resident_valid));
+    if (slots == 0)
+        return reply(hdr, flags, &payload, sizeof(payload));
+    return reply(hdr, flags | CRYPTIC_FLAG_CHAINED | ((slots - 1) << CRYPTIC_SLOT_SHIFT), &payload, sizeof(payload));
+}
+
+/* The link runs at USB speed: any rate is refused with 0 */
+static int baud(const struct frame_header *hdr) {
+    uint32_t rate = 0;
+
+    if (rx_read(NULL, le32toh(hdr->len)) < 0)
+        return -1;
+    return reply(hdr, 0, &rate, sizeof(rate));
+}
+
+/* Answer with the number and the sum of the bytes received */
+static int test(const struct frame_header *hdr) {
+    uint8_t block[SHA256_BLOCK_SIZE];
+    uint32_t left, chunk, i, sum = 0;
+    uint32_t payload[2];
+
+    for (left = le32toh(hdr->len); left > 0; left -= chunk) {
+        chunk = left < sizeof(block) ? left : sizeof(block);
+        if (rx_read(block, chunk) < 0)
+            return -1;
+        for (i = 0; i < chunk; i++)
+            sum += block[i];
+    }
+    payload[0] = hdr->len;
+    payload[1] = htole32(sum);
+    return reply(hdr, 0, payload, sizeof(payload));
+}
+
+static int hash(const struct frame_header *hdr) {
+    uint8_t block[SHA256_BLOCK_SIZE];
+    struct hash_params params;
+    uint32_t state[SHA256_DIGEST_SIZE / 4];
+    uint32_t size, left, blocks = 0;
+    int chained = hdr->flags & CRYPTIC_FLAG_CHAINED;
+    unsigned int slot = hdr->flags >> CRYPTIC_SLOT_SHIFT;
+
+    /* Chained frames start at the length */
+    size = chained ? sizeof(params.len) : sizeof(params);
+    if (le32toh(hdr->len) < size || le32toh(hdr->len) > max_payload)
+        return rx_read(NULL, le32toh(hdr->len));
+    if ((slots > 0 && slot >= slots) || (chained && (slot >= slots || !resident_valid[slot]))) {
+        /* Nothing to resume from: an empty response fails the frame */
+        if (rx_read(NULL, le32toh(hdr->len)) < 0)
+            return -1;
+        return reply(hdr, 0, NULL, 0);
+    }
+    if (rx_read((uint8_t *) &params + sizeof(params) - size, size) < 0)
+        return -1;
+    memcpy(state, chained ? resident[slot] : params.state, sizeof(state));
+    left = le32toh(hdr->len) - size;
+    if (params.len < left)
+        left = params.len;
+    /* Stream the message through the compression function one block at a time */
+    for (; left >= SHA256_BLOCK_SIZE; left -= SHA256_BLOCK_SIZE, blocks++) {
+        if (rx_read(block, sizeof(block)) < 0)
+            return -1;
+        sha256_transform(state, block);
+    }
+    if (rx_read(NULL, le32toh(hdr->len) - size - blocks * SHA256_BLOCK_SIZE) < 0)
+        return -1;
+    busy(frame_ns + blocks * block_ns);
+    if (slot < slots) {
+        memcpy(resident[slot], state, sizeof(state));
+        resident_valid[slot] = 1;
+    }
+    return reply(hdr, 0, state, SHA256_DIGEST_SIZE);
+}
+
+/* Hash count short messages, each one preceded by its number of blocks, from the initial state. Older
+ * firmware (-x) skips the frame like any unknown opcode */
+static int batch(const struct frame_header *hdr) {
+    static const uint32_t iv[SHA256_DIGEST_SIZE / 4] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    uint32_t states[CRYPTIC_BATCH_MAX][SHA256_DIGEST_SIZE / 4];
+    uint8_t block[SHA256_BLOCK_SIZE];
+    uint32_t left = le32toh(hdr->len), count, n, blocks, total = 0;
+
+    if (!batch_frames || left < sizeof(count) || left > max_payload)
+        return rx_read(NULL, left);
+    if (rx_read(&count, sizeof(count)) < 0)
+        return -1;
+    left -= sizeof(count);
+    count = le32toh(count);
+    if (count > CRYPTIC_BATCH_MAX) {
+        /* An empty response fails the frame */
+        if (rx_read(NULL, left) < 0)
+            return -1;
+        return reply(hdr, 0, NULL, 0);
+    }
+    for (n = 0; n < count; n++) {
+        blocks = 0;
+        if (left >= sizeof(blocks)) {
+            if (rx_read(&blocks, sizeof(blocks)) < 0)
+                return -1;
+            left -= sizeof(blocks);
+            blocks = le32toh(blocks);
+        }
+        memcpy(states[n], iv, sizeof(iv));
+        for (; blocks > 0 && left >= SHA256_BLOCK_SIZE; blocks--, left -= SHA256_BLOCK_SIZE, total++) {
+            if (rx_read(block, sizeof(block)) < 0)
+                return -1;
+            sha256_transform(states[n], block);
+        }
+    }
+    if (rx_read(NULL, left) < 0)
+        return -1;
+    busy(frame_ns + total * block_ns);
+    return reply(hdr, 0, states, count * SHA256_DIGEST_SIZE);
+}
+
+/* Handle the events of the control endpoint: requests are not part of the protocol, stall them */
+static void *ep0_run(void *arg) {
+    struct usb_functionfs_event event;
+    int ep0 = *(int *) arg;
+    ssize_t n;
+
+    for (;;) {
+        n = read(ep0, &event, sizeof(event));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < (ssize_t) sizeof(event))
+            break;
+        switch (event.type) {
+            case FUNCTIONFS_ENABLE:
+                fprintf(stderr, "cryptic_sim: enabled\n");
+                break;
+            case FUNCTIONFS_DISABLE:
+                fprintf(stderr, "cryptic_sim: disabled\n");
+                break;
+            case FUNCTIONFS_SETUP:
+                /* I/O in the wrong direction stalls the request */
+                if (event.u.setup.bRequestType & USB_DIR_IN)
+                    n = write(ep0, NULL, 0);
+                else
+                    n = read(ep0, NULL, 0);
+                break;
+            default:
+                break;
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-b bytes/s] [-l ns] [-k ns] [-m bytes] [-n N] [-s] [-x] [-c N] [-g N] ffs-dir\n"
+            "  -b  link bandwidth in bytes per second, both directions, default unlimited\n"
+            "  -l  compute latency of each frame in ns\n"
+            "  -k  compute time of each 64-byte block in ns\n"
+            "  -m  largest frame payload advertised in HELLO, default %u\n"
+            "  -n  state slots kept between frames, default and at most %u\n"
+            "  -s  do not keep the state between frames, like older firmware, same as -n 0\n"
+            "  -x  do not accept BATCH frames, like older firmware\n"
+            "  -c  corrupt the sequence number of every Nth response\n"
+            "  -g  send garbage bytes before every Nth response\n", prog, max_payload, CRYPTIC_MAX_SLOTS);
+}
+
+int main(int argc, char **argv) {
+    struct frame_header hdr;
+    char path[4096];
+    pthread_t ep0_thread;
+    int opt, ep0;
+
+    while ((opt = getopt(argc, argv, "b:l:k:m:n:sxc:g:h")) != -1) {
+        switch (opt) {
+            case 'b': bandwidth = strtoull(optarg, NULL, 0); break;
+            case 'l': frame_ns = strtoull(optarg, NULL, 0); break;
+            case 'k': block_ns = strtoull(optarg, NULL, 0); break;
+            case 'm': max_payload = strtoul(optarg, NULL, 0); break;
+            case 'n': slots = strtoul(optarg, NULL, 0); break;
+            case 's': slots = 0; break;
+            case 'x': batch_frames = 0; break;
+            case 'c': corrupt_every = strtoul(optarg, NULL, 0); break;
+            case 'g': garbage_every = strtoul(optarg, NULL, 0); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1 || max_payload > MAX_PAYLOAD_LIMIT || slots > CRYPTIC_MAX_SLOTS) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    snprintf(path, sizeof(path), "%s/ep0", argv[optind]);
+    ep0 = open(path, O_RDWR);
+    if (ep0 < 0) {
+        perror(path);
+        return 1;
+    }
+    if (write(ep0, &descriptors, sizeof(descriptors)) < 0 || write(ep0, &strings, sizeof(strings)) < 0) {
+        perror("cryptic_sim: writing descriptors");
+        return 1;
+    }
+    /* The endpoint files exist once the descriptors are written, I/O waits for the host */
+    snprintf(path, sizeof(path), "%s/ep1", argv[optind]);
+    ep_out = open(path, O_RDONLY);
+    snprintf(path, sizeof(path), "%s/ep2", argv[optind]);
+    ep_in = open(path, O_WRONLY);
+    if (ep_out < 0 || ep_in < 0) {
+        perror(path);
+        return 1;
+    }
+    if (pthread_create(&ep0_thread, NULL, ep0_run, &ep0) != 0)
+        return 1;
+    fprintf(stderr, "cryptic_sim: ready, bind the gadget to a UDC\n");
+
+    for (;;) {
+        /* Look for the start of a frame */
+        if (rx_read(&hdr.magic, 1) < 0)
+            break;
+        if (hdr.magic != CRYPTIC_MAGIC)
+            continue;
+        if (rx_read((uint8_t *) &hdr + 1, sizeof(hdr) - 1) < 0)
+            break;
+        if (hdr.opcode == CRYPTIC_OP_HELLO) {
+            if (hello(&hdr) < 0)
+                break;
+        } else if (hdr.version != CRYPTIC_PROTO_VERSION) {
+            if (rx_read(NULL, le32toh(hdr.len)) < 0)
+                break;
+        } else if (hdr.opcode == CRYPTIC_OP_HASH) {
+            if (hash(&hdr) < 0)
+                break;
+        } else if (hdr.opcode == CRYPTIC_OP_BAUD) {
+            if (baud(&hdr) < 0)
+                break;
+        } else if (hdr.opcode == CRYPTIC_OP_TEST) {
+            if (test(&hdr) < 0)
+                break;
+        } else if (hdr.opcode == CRYPTIC_OP_BATCH) {
+            if (batch(&hdr) < 0)
+                break;
+        } else if (rx_read(NULL, le32toh(hdr.len)) < 0) {
+            break;
+        }
+    }
+    perror("cryptic_sim: endpoint I/O");
+    return 1;
+}
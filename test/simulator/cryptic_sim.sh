@@ -0,0 +1,56 @@
+#!/bin/bash
+# Present the cryptIC simulator to this machine: a configfs gadget with the IDs of the device and a
+# FunctionFS function served by cryptic_sim, bound to a dummy_hcd controller. Arguments are passed
+# to cryptic_sim, e.g. ./cryptic_sim.sh -b 1000000 -k 2000
+# Needs root, libcomposite and dummy_hcd. The ch341 serial driver claims the same IDs, it is unloaded.
+set -e
+cd "$(dirname "$0")"
+make
+
+VENDOR_ID=0x1a86
+PRODUCT_ID=0x7523
+GADGET=/sys/kernel/config/usb_gadget/cryptic
+FFS=/dev/ffs-cryptic
+
+cleanup() {
+    set +e
+    [ -n "$SIM" ] && kill "$SIM" 2>/dev/null
+    [ -e "$GADGET/UDC" ] && echo "" > "$GADGET/UDC"
+    wait
+    umount "$FFS" 2>/dev/null
+    rm -f "$GADGET/configs/c.1/ffs.cryptic"
+    rmdir "$GADGET/configs/c.1/strings/0x409" "$GADGET/configs/c.1" "$GADGET/functions/ffs.cryptic" \
+          "$GADGET/strings/0x409" "$GADGET" 2>/dev/null
+    rmdir "$FFS" 2>/dev/null
+}
+trap cleanup EXIT
+
+modprobe -r ch341 2>/dev/null || true
+modprobe libcomposite
+modprobe dummy_hcd
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+mkdir "$GADGET"
+echo "$VENDOR_ID" > "$GADGET/idVendor"
+echo "$PRODUCT_ID" > "$GADGET/idProduct"
+mkdir "$GADGET/strings/0x409"
+echo "cryptic" > "$GADGET/strings/0x409/manufacturer"
+echo "cryptIC simulator" > "$GADGET/strings/0x409/product"
+mkdir "$GADGET/configs/c.1"
+mkdir "$GADGET/configs/c.1/strings/0x409"
+echo "cryptIC" > "$GADGET/configs/c.1/strings/0x409/configuration"
+mkdir "$GADGET/functions/ffs.cryptic"
+ln -s "$GADGET/functions/ffs.cryptic" "$GADGET/configs/c.1/"
+
+mkdir -p "$FFS"
+mount -t functionfs cryptic "$FFS"
+./cryptic_sim "$@" "$FFS" &
+SIM=$!
+# The gadget can be bound once the descriptors are written
+for _ in $(seq 50); do
+    [ -e "$FFS/ep1" ] && break
+    sleep 0.1
+done
+ls /sys/class/udc | grep dummy_udc | head -n 1 > "$GADGET/UDC"
+echo "Simulator running, press Ctrl-C to unplug it"
+wait "$SIM"